@@ -6,6 +6,10 @@
 #include "nn/nn.h"
 #include "speech/speech.h"
 #include <fstream>
+#include <cstdio>
+#include <algorithm>
+#include <limits>
+#include <unistd.h>
 
 namespace fscrf {
 
@@ -38,29 +42,56 @@ namespace fscrf {
         data.initials.push_back(0);
         data.finals.push_back(v);
 
-        for (int u = 0; u < data.vertices.size(); ++u) {
-            for (int v = u + 1; v < data.vertices.size(); ++v) {
-                int duration = data.vertices[v].time - data.vertices[u].time;
+        std::vector<int> labels;
 
-                if (duration < min_seg_len) {
-                    continue;
-                }
+        for (auto& p: label_id) {
+            if (p.second == 0) {
+                continue;
+            }
 
-                if (duration > max_seg_len) {
-                    break;
-                }
+            labels.push_back(p.second);
+        }
 
-                for (auto& p: label_id) {
-                    if (p.second == 0) {
-                        continue;
-                    }
+        ilat::add_segments(data, labels, min_seg_len, max_seg_len);
 
-                    ilat::add_edge(data, data.edges.size(),
-                        ilat::edge_data { u, v, 0, p.second, p.second });
-                }
+        ilat::fst result;
+        result.data = std::make_shared<ilat::fst_data>(std::move(data));
+
+        return std::make_shared<ilat::fst>(result);
+    }
+
+    std::shared_ptr<ilat::fst> make_boundary_graph(std::vector<int> const& boundaries,
+        std::unordered_map<std::string, int> const& label_id,
+        std::vector<std::string> const& id_label,
+        int min_seg_len, int max_seg_len)
+    {
+        assert(min_seg_len >= 1);
+        assert(max_seg_len >= min_seg_len);
+
+        ilat::fst_data data;
+
+        data.symbol_id = std::make_shared<std::unordered_map<std::string, int>>(label_id);
+        data.id_symbol = std::make_shared<std::vector<std::string>>(id_label);
+
+        for (int v = 0; v < boundaries.size(); ++v) {
+            ilat::add_vertex(data, v, ilat::vertex_data { boundaries[v] });
+        }
+
+        data.initials.push_back(0);
+        data.finals.push_back(boundaries.size() - 1);
+
+        std::vector<int> labels;
+
+        for (auto& p: label_id) {
+            if (p.second == 0) {
+                continue;
             }
+
+            labels.push_back(p.second);
         }
 
+        ilat::add_segments(data, labels, min_seg_len, max_seg_len);
+
         ilat::fst result;
         result.data = std::make_shared<ilat::fst_data>(std::move(data));
 
@@ -355,6 +386,21 @@ namespace fscrf {
     {
         score = autodiff::rtmul(param, frames);
         autodiff::eval_vertex(score, autodiff::eval_funcs);
+
+        auto& m = autodiff::get_output<la::tensor_like<double>>(score);
+
+        int labels = m.size(0);
+        int time = m.size(1);
+
+        cumsum.resize(labels * (time + 1));
+
+        for (int ell = 0; ell < labels; ++ell) {
+            double *c = cumsum.data() + ell * (time + 1);
+
+            for (int t = 0; t < time; ++t) {
+                c[t + 1] = c[t] + m({ell, t});
+            }
+        }
     }
 
     double frame_avg_score::operator()(ilat::fst const& f,
@@ -362,17 +408,17 @@ namespace fscrf {
     {
         auto& m = autodiff::get_output<la::tensor_like<double>>(score);
 
-        double sum = 0;
-
         int ell = f.output(e) - 1;
         int tail_time = f.time(f.tail(e));
         int head_time = f.time(f.head(e));
 
-        for (int t = tail_time; t < head_time; ++t) {
-            sum += m({ell, t});
+        if (head_time <= tail_time) {
+            return 0;
         }
 
-        return (head_time <= tail_time ? 0 : sum / (head_time - tail_time));
+        double const *c = cumsum.data() + ell * (m.size(1) + 1);
+
+        return (c[head_time] - c[tail_time]) / (head_time - tail_time);
     }
 
     void frame_avg_score::accumulate_grad(double g, ilat::fst const& f,
@@ -380,28 +426,78 @@ namespace fscrf {
     {
         auto& m = autodiff::get_output<la::tensor_like<double>>(score);
 
-        if (score->grad == nullptr) {
-            la::tensor<double> m_grad;
-            la::resize_as(m_grad, m);
-            score->grad = std::make_shared<la::tensor<double>>(std::move(m_grad));
+        if (grad_diff.size() == 0) {
+            grad_diff.resize(m.size(0) * (m.size(1) + 1));
         }
 
-        auto& m_grad = autodiff::get_grad<la::tensor_like<double>>(score);
-
         int ell = f.output(e) - 1;
         int tail_time = f.time(f.tail(e));
         int head_time = f.time(f.head(e));
 
-        for (int t = tail_time; t < head_time; ++t) {
-            m_grad({ell, t}) += g / (head_time - tail_time);
+        if (head_time <= tail_time) {
+            return;
         }
+
+        double *d = grad_diff.data() + ell * (m.size(1) + 1);
+
+        d[tail_time] += g / (head_time - tail_time);
+        d[head_time] -= g / (head_time - tail_time);
     }
 
     void frame_avg_score::grad() const
     {
+        auto& m = autodiff::get_output<la::tensor_like<double>>(score);
+
+        if (score->grad == nullptr) {
+            la::tensor<double> m_grad;
+            la::resize_as(m_grad, m);
+            score->grad = std::make_shared<la::tensor<double>>(std::move(m_grad));
+        }
+
+        auto& m_grad = autodiff::get_grad<la::tensor_like<double>>(score);
+
+        if (grad_diff.size() != 0) {
+            int time = m.size(1);
+
+            for (int ell = 0; ell < m.size(0); ++ell) {
+                double const *d = grad_diff.data() + ell * (time + 1);
+                double sum = 0;
+
+                for (int t = 0; t < time; ++t) {
+                    sum += d[t];
+                    m_grad({ell, t}) += sum;
+                }
+            }
+
+            grad_diff.clear();
+        }
+
         autodiff::eval_vertex(score, autodiff::grad_funcs);
     }
 
+    namespace {
+
+        /*
+         * Adds x to the sum s and the rounding error of the addition
+         * to c (Knuth's two-sum), so that s + c keeps roughly twice
+         * the precision of s over a long run of additions.
+         *
+         */
+        void compensated_add(double& s, double& c, double x)
+        {
+            double t = s + x;
+            double b = t - s;
+            c += (s - (t - b)) + (x - b);
+            s = t;
+        }
+
+        double prefix_diff(double const *s, double const *c, int start, int end)
+        {
+            return (s[end] - s[start]) + (c[end] - c[start]);
+        }
+
+    }
+
     frame_weighted_avg_score::frame_weighted_avg_score(
             std::shared_ptr<autodiff::op_t> param,
             std::shared_ptr<autodiff::op_t> att_param,
@@ -415,16 +511,43 @@ namespace fscrf {
         att_exp = autodiff::exp(att);
         autodiff::eval_vertex(att, autodiff::eval_funcs);
         autodiff::eval_vertex(att_exp, autodiff::eval_funcs);
+
+        auto& m = autodiff::get_output<la::tensor_like<double>>(score);
+        auto& n = autodiff::get_output<la::tensor_like<double>>(att_exp);
+
+        int labels = n.size(0);
+        int time = n.size(1);
+
+        z_cumsum.resize(labels * (time + 1));
+        z_cumsum_err.resize(labels * (time + 1));
+        sum_cumsum.resize(labels * (time + 1));
+        sum_cumsum_err.resize(labels * (time + 1));
+
+        for (int ell = 0; ell < labels; ++ell) {
+            double *z = z_cumsum.data() + ell * (time + 1);
+            double *z_err = z_cumsum_err.data() + ell * (time + 1);
+            double *c = sum_cumsum.data() + ell * (time + 1);
+            double *c_err = sum_cumsum_err.data() + ell * (time + 1);
+
+            for (int t = 0; t < time; ++t) {
+                double w = n({ell, t}) + 0.01;
+
+                z[t + 1] = z[t];
+                z_err[t + 1] = z_err[t];
+                compensated_add(z[t + 1], z_err[t + 1], w);
+
+                c[t + 1] = c[t];
+                c_err[t + 1] = c_err[t];
+                compensated_add(c[t + 1], c_err[t + 1], w * m({ell, t}));
+            }
+        }
     }
 
     double frame_weighted_avg_score::operator()(ilat::fst const& f,
         int e) const
     {
-        auto& m = autodiff::get_output<la::tensor_like<double>>(score);
         auto& n = autodiff::get_output<la::tensor_like<double>>(att_exp);
 
-        double sum = 0;
-
         int ell = f.output(e) - 1;
         int tail_time = f.time(f.tail(e));
         int head_time = f.time(f.head(e));
@@ -432,20 +555,57 @@ namespace fscrf {
         int start = std::max<int>(0, tail_time);
         int end = std::min<int>(head_time, n.size(1));
 
-        double Z = 0;
-        for (int t = start; t < end; ++t) {
-            Z += n({ell, t}) + 0.01;
+        if (end <= start) {
+            return 0;
         }
 
-        for (int t = start; t < end; ++t) {
-            sum += (n({ell, t}) + 0.01) * m({ell, t}) / Z;
-        }
+        int offset = ell * (n.size(1) + 1);
 
-        return sum;
+        return prefix_diff(sum_cumsum.data() + offset, sum_cumsum_err.data() + offset, start, end)
+            / prefix_diff(z_cumsum.data() + offset, z_cumsum_err.data() + offset, start, end);
     }
 
     void frame_weighted_avg_score::accumulate_grad(double g, ilat::fst const& f,
         int e) const
+    {
+        auto& n = autodiff::get_output<la::tensor_like<double>>(att_exp);
+
+        int time = n.size(1);
+
+        if (scale_diff.size() == 0) {
+            scale_diff.resize(n.size(0) * (time + 1));
+            shift_diff.resize(n.size(0) * (time + 1));
+        }
+
+        int ell = f.output(e) - 1;
+        int tail_time = f.time(f.tail(e));
+        int head_time = f.time(f.head(e));
+
+        int start = std::max<int>(0, tail_time);
+        int end = std::min<int>(head_time, time);
+
+        if (end <= start) {
+            return;
+        }
+
+        int offset = ell * (time + 1);
+
+        double Z = prefix_diff(z_cumsum.data() + offset, z_cumsum_err.data() + offset, start, end);
+        double sum = prefix_diff(sum_cumsum.data() + offset, sum_cumsum_err.data() + offset,
+            start, end) / Z;
+
+        // d/dm_t = g (n_t + 0.01) / Z and d/dn_t = g m_t / Z - g sum / Z
+
+        double *a = scale_diff.data() + ell * (time + 1);
+        double *b = shift_diff.data() + ell * (time + 1);
+
+        a[start] += g / Z;
+        a[end] -= g / Z;
+        b[start] += g * sum / Z;
+        b[end] -= g * sum / Z;
+    }
+
+    void frame_weighted_avg_score::grad() const
     {
         auto& m = autodiff::get_output<la::tensor_like<double>>(score);
         auto& n = autodiff::get_output<la::tensor_like<double>>(att_exp);
@@ -465,39 +625,38 @@ namespace fscrf {
         auto& m_grad = autodiff::get_grad<la::tensor<double>>(score);
         auto& n_grad = autodiff::get_grad<la::tensor<double>>(att_exp);
 
-        int ell = f.output(e) - 1;
-        int tail_time = f.time(f.tail(e));
-        int head_time = f.time(f.head(e));
+        if (scale_diff.size() != 0) {
+            int time = n.size(1);
 
-        int start = std::max<int>(0, tail_time);
-        int end = std::min<int>(head_time, n.size(1));
+            for (int ell = 0; ell < n.size(0); ++ell) {
+                double const *a = scale_diff.data() + ell * (time + 1);
+                double const *b = shift_diff.data() + ell * (time + 1);
+                double scale = 0;
+                double scale_err = 0;
+                double shift = 0;
+                double shift_err = 0;
 
-        double Z = 0;
-        for (int t = start; t < end; ++t) {
-            Z += n({ell, t}) + 0.01;
-        }
+                for (int t = 0; t < time; ++t) {
+                    compensated_add(scale, scale_err, a[t]);
+                    compensated_add(shift, shift_err, b[t]);
 
-        double sum = 0;
-        for (int t = start; t < end; ++t) {
-            sum += (n({ell, t}) + 0.01) * m({ell, t}) / Z;
-        }
+                    m_grad({ell, t}) += (scale + scale_err) * (n({ell, t}) + 0.01);
+                    n_grad({ell, t}) += (scale + scale_err) * m({ell, t}) - (shift + shift_err);
 
-        for (int t = start; t < end; ++t) {
-            m_grad({ell, t}) += g * (n({ell, t}) + 0.01) / Z;
-            n_grad({ell, t}) += g * (m({ell, t}) - sum) / Z;
+                    if (std::isnan(m_grad({ell, t}))) {
+                        std::cout << "m_grad has nan" << std::endl;
+                    }
 
-            if (std::isnan(m_grad({ell, t}))) {
-                std::cout << "m_grad has nan" << std::endl;
+                    if (std::isnan(n_grad({ell, t}))) {
+                        std::cout << "n_grad has nan" << std::endl;
+                    }
+                }
             }
 
-            if (std::isnan(n_grad({ell, t}))) {
-                std::cout << "n_grad has nan" << std::endl;
-            }
+            scale_diff.clear();
+            shift_diff.clear();
         }
-    }
 
-    void frame_weighted_avg_score::grad() const
-    {
         autodiff::eval_vertex(score, autodiff::grad_funcs);
         autodiff::eval_vertex(att_exp, autodiff::grad_funcs);
         autodiff::eval_vertex(att, autodiff::grad_funcs);
@@ -505,7 +664,7 @@ namespace fscrf {
 
     frame_samples_score::frame_samples_score(std::shared_ptr<autodiff::op_t> param,
             std::shared_ptr<autodiff::op_t> frames, double scale)
-        : param(param), frames(frames), scale(scale)
+        : param(param), frames(frames), scale(scale), grad_cells(std::make_shared<util::sparse_grad>())
     {
         score = autodiff::rtmul(param, frames);
         autodiff::eval_vertex(score, autodiff::eval_funcs);
@@ -530,31 +689,35 @@ namespace fscrf {
     {
         auto& m = autodiff::get_output<la::tensor<double>>(score);
 
-        if (score->grad == nullptr) {
-            la::tensor<double> m_grad;
-            la::resize_as(m_grad, m);
-            score->grad = std::make_shared<la::tensor<double>>(std::move(m_grad));
-        }
-
-        auto& m_grad = autodiff::get_grad<la::tensor<double>>(score);
-
         int ell = f.output(e) - 1;
         int tail_time = f.time(f.tail(e));
         int head_time = f.time(f.head(e));
 
         int dur = head_time - tail_time;
 
-        m_grad({ell, int(tail_time + dur * scale)}) += g;
+        grad_cells->add(m, ell, int(tail_time + dur * scale), g);
     }
 
     void frame_samples_score::grad() const
     {
+        if (!grad_cells->empty()) {
+            auto& m = autodiff::get_output<la::tensor<double>>(score);
+
+            if (score->grad == nullptr) {
+                la::tensor<double> m_grad;
+                la::resize_as(m_grad, m);
+                score->grad = std::make_shared<la::tensor<double>>(std::move(m_grad));
+            }
+
+            grad_cells->flush(autodiff::get_grad<la::tensor<double>>(score));
+        }
+
         autodiff::eval_vertex(score, autodiff::grad_funcs);
     }
 
     left_boundary_score::left_boundary_score(std::shared_ptr<autodiff::op_t> param,
             std::shared_ptr<autodiff::op_t> frames, int shift)
-        : param(param), frames(frames), shift(shift)
+        : param(param), frames(frames), shift(shift), grad_cells(std::make_shared<util::sparse_grad>())
     {
         score = autodiff::rtmul(param, frames);
         autodiff::eval_vertex(score, autodiff::eval_funcs);
@@ -577,29 +740,33 @@ namespace fscrf {
     {
         auto& m = autodiff::get_output<la::tensor<double>>(score);
 
-        if (score->grad == nullptr) {
-            la::tensor<double> m_grad;
-            la::resize_as(m_grad, m);
-            score->grad = std::make_shared<la::tensor<double>>(std::move(m_grad));
-        }
-
-        auto& m_grad = autodiff::get_grad<la::tensor<double>>(score);
-
         int ell = f.output(e) - 1;
         int tail_time = f.time(f.tail(e));
         int head_time = f.time(f.head(e));
 
-        m_grad({ell, std::max<int>(tail_time + shift, 0)}) += g;
+        grad_cells->add(m, ell, std::max<int>(tail_time + shift, 0), g);
     }
 
     void left_boundary_score::grad() const
     {
+        if (!grad_cells->empty()) {
+            auto& m = autodiff::get_output<la::tensor<double>>(score);
+
+            if (score->grad == nullptr) {
+                la::tensor<double> m_grad;
+                la::resize_as(m_grad, m);
+                score->grad = std::make_shared<la::tensor<double>>(std::move(m_grad));
+            }
+
+            grad_cells->flush(autodiff::get_grad<la::tensor<double>>(score));
+        }
+
         autodiff::eval_vertex(score, autodiff::grad_funcs);
     }
 
     right_boundary_score::right_boundary_score(std::shared_ptr<autodiff::op_t> param,
             std::shared_ptr<autodiff::op_t> frames, int shift)
-        : param(param), frames(frames), shift(shift)
+        : param(param), frames(frames), shift(shift), grad_cells(std::make_shared<util::sparse_grad>())
     {
         score = autodiff::rtmul(param, frames);
         autodiff::eval_vertex(score, autodiff::eval_funcs);
@@ -622,23 +789,27 @@ namespace fscrf {
     {
         auto& m = autodiff::get_output<la::tensor<double>>(score);
 
-        if (score->grad == nullptr) {
-            la::tensor<double> m_grad;
-            la::resize_as(m_grad, m);
-            score->grad = std::make_shared<la::tensor<double>>(std::move(m_grad));
-        }
-
-        auto& m_grad = autodiff::get_grad<la::tensor<double>>(score);
-
         int ell = f.output(e) - 1;
         int tail_time = f.time(f.tail(e));
         int head_time = f.time(f.head(e));
 
-        m_grad({ell, std::min<int>(head_time + shift, m.size(1) - 1)}) += g;
+        grad_cells->add(m, ell, std::min<int>(head_time + shift, m.size(1) - 1), g);
     }
 
     void right_boundary_score::grad() const
     {
+        if (!grad_cells->empty()) {
+            auto& m = autodiff::get_output<la::tensor<double>>(score);
+
+            if (score->grad == nullptr) {
+                la::tensor<double> m_grad;
+                la::resize_as(m_grad, m);
+                score->grad = std::make_shared<la::tensor<double>>(std::move(m_grad));
+            }
+
+            grad_cells->flush(autodiff::get_grad<la::tensor<double>>(score));
+        }
+
         autodiff::eval_vertex(score, autodiff::grad_funcs);
     }
 
@@ -829,6 +1000,16 @@ namespace fscrf {
         autodiff::eval_vertex(pre_length, autodiff::grad_funcs);
     }
 
+    namespace {
+
+        struct segrnn_la {
+            using tensor_like = la::tensor_like<double>;
+            using tensor = la::tensor<double>;
+            using weak_tensor = la::weak_tensor<double>;
+        };
+
+    }
+
     segrnn_score::segrnn_score(std::shared_ptr<tensor_tree::vertex> param,
         std::shared_ptr<autodiff::op_t> frames)
         : segrnn_score(param, frames, 0.0, nullptr)
@@ -840,195 +1021,60 @@ namespace fscrf {
         double dropout,
         std::default_random_engine *gen)
         : param(param), frames(frames), dropout(dropout), gen(gen)
+        , batches(std::make_shared<segrnn::batch_table>())
     {
         assert(0.0 <= dropout && dropout <= 1.0);
 
-        autodiff::computation_graph& graph = *frames->graph;
-
-        std::shared_ptr<autodiff::op_t> frames_tmp = graph.var();
-
         left_end = autodiff::mul(tensor_tree::get_var(param->children[1]), tensor_tree::get_var(param->children[0]));
         right_end = autodiff::mul(tensor_tree::get_var(param->children[3]), tensor_tree::get_var(param->children[2]));
 
-        pre_left = autodiff::mul(frames_tmp, tensor_tree::get_var(param->children[0]));
-        pre_right = autodiff::mul(frames_tmp, tensor_tree::get_var(param->children[2]));
+        pre_left = autodiff::mul(frames, tensor_tree::get_var(param->children[0]));
+        pre_right = autodiff::mul(frames, tensor_tree::get_var(param->children[2]));
         pre_label = autodiff::mul(tensor_tree::get_var(param->children[4]),
             tensor_tree::get_var(param->children[5]));
         pre_length = autodiff::mul(tensor_tree::get_var(param->children[6]),
             tensor_tree::get_var(param->children[7]));
 
-        auto left_embedding = autodiff::row_at(pre_left, 0);
-        auto right_embedding = autodiff::row_at(pre_right, 0);
-        auto label_embedding = autodiff::row_at(pre_label, 0);
-        auto length_embedding = autodiff::row_at(pre_length, 0);
-        auto mask = graph.var();
-
-        score = autodiff::dot(tensor_tree::get_var(param->children[11]),
-            autodiff::emul(mask,
-                autodiff::tanh(
-                    autodiff::add(
-                        tensor_tree::get_var(param->children[10]),
-                        autodiff::mul(
-                            autodiff::relu(
-                                autodiff::add(std::vector<std::shared_ptr<autodiff::op_t>> {
-                                    left_embedding,
-                                    right_embedding,
-                                    label_embedding,
-                                    length_embedding,
-                                    tensor_tree::get_var(param->children[8])
-                                })
-                            ),
-                            tensor_tree::get_var(param->children[9])
-                        )
-                    )
-                )
-            ));
-
-        std::unordered_set<std::shared_ptr<autodiff::op_t>> exclude {
-            pre_left, pre_right, pre_label, pre_length, left_end, right_end, frames_tmp };
-
-        for (int i = 0; i <= 11; ++i) {
-            exclude.insert(tensor_tree::get_var(param->children[i]));
-        }
-
-        std::vector<std::shared_ptr<autodiff::op_t>> topo_order_tmp = autodiff::topo_order(score);
-
-        for (auto& i: topo_order_tmp) {
-            if (ebt::in(i, exclude)) {
-                continue;
-            }
-
-            topo_order_shift.push_back(i->id);
-        }
-
-        graph.adj[pre_left->id][0] = frames->id;
-        graph.adj[pre_right->id][0] = frames->id;
-
         autodiff::eval_vertex(pre_left, autodiff::eval_funcs);
         autodiff::eval_vertex(pre_right, autodiff::eval_funcs);
-        autodiff::eval_vertex(left_end, autodiff::eval_funcs);
-        autodiff::eval_vertex(right_end, autodiff::eval_funcs);
-        autodiff::eval_vertex(pre_label, autodiff::eval_funcs);
-        autodiff::eval_vertex(pre_length, autodiff::eval_funcs);
-    }
-
-    double segrnn_score::operator()(ilat::fst const& f,
-        int e) const
-    {
-        if (edge_scores.size() > e && edge_scores[e] != nullptr && edge_scores[e]->output != nullptr) {
-            return autodiff::get_output<double>(edge_scores[e]);
-        }
-
-        autodiff::computation_graph& comp_graph = *frames->graph;
-
-        auto& m = autodiff::get_output<la::tensor_like<double>>(frames);
-        auto& length_param = autodiff::get_output<la::tensor_like<double>>(
-            tensor_tree::get_var(param->children[6]));
-
-        int ell = f.output(e) - 1;
-        int tail_time = f.time(f.tail(e));
-        int head_time = f.time(f.head(e));
-
-        std::shared_ptr<autodiff::op_t> left_embedding;
-
-        if (std::max<int>(0, tail_time) == 0) {
-            left_embedding = autodiff::add(std::vector<std::shared_ptr<autodiff::op_t>>{ left_end });
-        } else {
-            left_embedding = autodiff::row_at(pre_left, std::max<int>(0, tail_time));
-        }
-
-        std::shared_ptr<autodiff::op_t> right_embedding;
-
-        if (std::min<int>(m.size(0) - 1, head_time) == m.size(0) - 1) {
-            right_embedding = autodiff::add(std::vector<std::shared_ptr<autodiff::op_t>>{ right_end });
-        } else {
-            right_embedding = autodiff::row_at(pre_right, std::min<int>(m.size(0) - 1, head_time));
-        }
-
-        auto label_embedding = autodiff::row_at(pre_label, ell);
-        auto length_embedding = autodiff::row_at(pre_length,
-            std::min<int>(int(std::log(head_time - tail_time) / std::log(1.6)) + 1,
-                 length_param.size(0) - 1));
-
-        auto& theta = autodiff::get_output<la::tensor<double>>(tensor_tree::get_var(param->children[11]));
-        la::tensor<double> mask_vec;
-
-        if (dropout == 0.0) {
-            mask_vec.resize({theta.vec_size()}, 1);
-        } else {
-            mask_vec.resize({theta.vec_size()});
-            std::bernoulli_distribution dist {1 - dropout};
-
-            for (int i = 0; i < mask_vec.vec_size(); ++i) {
-                mask_vec({i}) = dist(*gen) / (1.0 - dropout);
-            }
-        }
-
-        auto mask = comp_graph.var(mask_vec);
-
-        std::shared_ptr<autodiff::op_t> s_e = autodiff::dot(tensor_tree::get_var(param->children[11]),
-            autodiff::emul(mask,
-                autodiff::tanh(
-                    autodiff::add(
-                        tensor_tree::get_var(param->children[10]),
-                        autodiff::mul(
-                            autodiff::relu(
-                                autodiff::add(std::vector<std::shared_ptr<autodiff::op_t>> {
-                                    left_embedding,
-                                    right_embedding,
-                                    label_embedding,
-                                    length_embedding,
-                                    tensor_tree::get_var(param->children[8])
-                                })
-                            ),
-                            tensor_tree::get_var(param->children[9])
-                        )
-                    )
-                )
-            ));
-
-        if (e >= edge_scores.size()) {
-            edge_scores.resize(e + 1, nullptr);
-        }
+        autodiff::eval_vertex(left_end, autodiff::eval_funcs);
+        autodiff::eval_vertex(right_end, autodiff::eval_funcs);
+        autodiff::eval_vertex(pre_label, autodiff::eval_funcs);
+        autodiff::eval_vertex(pre_length, autodiff::eval_funcs);
+    }
 
-        edge_scores[e] = s_e;
+    segrnn::edge_batch& segrnn_score::get_batch(ilat::fst const& f) const
+    {
+        return batches->get(f, [&](segrnn::edge_batch& b) {
+            auto& m = autodiff::get_output<segrnn_la::tensor_like>(frames);
+            auto& length_param = autodiff::get_output<segrnn_la::tensor_like>(
+                tensor_tree::get_var(param->children[6]));
 
-        std::vector<std::shared_ptr<autodiff::op_t>> topo_order;
-        int d = s_e->id - score->id;
-        for (auto& i: topo_order_shift) {
-            topo_order.push_back(comp_graph.vertices[i + d]);
-        }
+            segrnn::add_rows(b, f, m.size(0), length_param.size(0));
+            segrnn::forward<segrnn_la>(b, *this);
+        });
+    }
 
-        autodiff::eval(topo_order, autodiff::eval_funcs);
+    double segrnn_score::operator()(ilat::fst const& f,
+        int e) const
+    {
+        segrnn::edge_batch& b = get_batch(f);
 
-        return autodiff::get_output<double>(s_e);
+        return b.score[b.row[e]];
     }
 
     void segrnn_score::accumulate_grad(double g, ilat::fst const& f,
         int e) const
     {
-        std::shared_ptr<autodiff::op_t> s_e = edge_scores[e];
-        if (s_e->grad == nullptr) {
-            s_e->grad = std::make_shared<double>(0);
-        }
-        autodiff::get_grad<double>(s_e) += g;
+        segrnn::edge_batch& b = get_batch(f);
+
+        b.score_grad[b.row[e]] += g;
     }
 
     void segrnn_score::grad() const
     {
-        autodiff::computation_graph& comp_graph = *frames->graph;
-
-        for (int i = 0; i < edge_scores.size(); ++i) {
-            std::shared_ptr<autodiff::op_t> t = edge_scores.at(i);
-
-            if (t != nullptr && t->grad != nullptr) {
-                std::vector<std::shared_ptr<autodiff::op_t>> topo_order;
-                int d = t->id - score->id;
-                for (auto& i: topo_order_shift) {
-                    topo_order.push_back(comp_graph.vertices[i + d]);
-                }
-                autodiff::grad(topo_order, autodiff::grad_funcs);
-            }
+        if (!segrnn::backward<segrnn_la>(batches->batches, *this)) {
+            return;
         }
 
         auto guarded_grad = [&](std::shared_ptr<autodiff::op_t> t) {
@@ -1281,15 +1327,13 @@ namespace fscrf {
     double external_score_order0::operator()(ilat::fst const& f,
         int e) const
     {
-        auto& feat = f.data->feats.at(e);
-
         la::tensor<double>& v = autodiff::get_output<la::tensor<double>>(param);
 
         assert(indices.size() == v.vec_size());
 
         double sum = 0;
         for (int i = 0; i < indices.size(); ++i) {
-            sum += v({i}) * feat.at(indices.at(i));
+            sum += v({i}) * f.feat(e, indices.at(i));
         }
 
         return sum;
@@ -1298,8 +1342,6 @@ namespace fscrf {
     void external_score_order0::accumulate_grad(double g, ilat::fst const& f,
         int e) const
     {
-        auto& feat = f.data->feats.at(e);
-
         if (param->grad == nullptr) {
             la::tensor<double>& v = autodiff::get_output<la::tensor<double>>(param);
 
@@ -1313,7 +1355,7 @@ namespace fscrf {
         assert(indices.size() == g_v.vec_size());
 
         for (int i = 0; i < indices.size(); ++i) {
-            g_v({i}) += g * feat.at(indices.at(i));
+            g_v({i}) += g * f.feat(e, indices.at(i));
         }
     }
 
@@ -1325,8 +1367,6 @@ namespace fscrf {
     double external_score_order1::operator()(ilat::fst const& f,
         int e) const
     {
-        auto& feat = f.data->feats.at(e);
-
         la::tensor<double>& m = autodiff::get_output<la::tensor<double>>(param);
 
         int ell = f.output(e) - 1;
@@ -1336,7 +1376,7 @@ namespace fscrf {
 
         double sum = 0;
         for (int i = 0; i < indices.size(); ++i) {
-            sum += m({ell, i}) * feat.at(indices.at(i));
+            sum += m({ell, i}) * f.feat(e, indices.at(i));
         }
 
         return sum;
@@ -1345,8 +1385,6 @@ namespace fscrf {
     void external_score_order1::accumulate_grad(double g, ilat::fst const& f,
         int e) const
     {
-        auto& feat = f.data->feats.at(e);
-
         if (param->grad == nullptr) {
             la::tensor<double>& m = autodiff::get_output<la::tensor<double>>(param);
 
@@ -1363,7 +1401,7 @@ namespace fscrf {
         assert(ell < g_mat.size(0));
 
         for (int i = 0; i < indices.size(); ++i) {
-            g_mat({ell, i}) += g * feat.at(indices.at(i));
+            g_mat({ell, i}) += g * f.feat(e, indices.at(i));
         }
     }
 
@@ -1647,16 +1685,83 @@ namespace fscrf {
             i_args.id_label[p.second] = p.first;
         }
 
+        if (ebt::in(std::string("lm"), args)) {
+            std::string lm_file = args.at("lm");
+
+            if (ebt::in(std::string("lm-compiled"), args)) {
+                lm_file = args.at("lm-compiled");
+
+                // Compiled to a file of its own and renamed, so that
+                // processes starting together never map a partial file.
+
+                if (!std::ifstream { lm_file }) {
+                    std::string tmp_file = lm_file + "." + std::to_string(getpid());
+                    ilat::compile_arpa_lm(args.at("lm"), tmp_file, i_args.label_id);
+                    std::rename(tmp_file.c_str(), lm_file.c_str());
+                }
+            }
+
+            ilat::fst lm = ilat::load_arpa_lm(lm_file, i_args.label_id);
+
+            if (lm.data->mapped == nullptr) {
+                lm = ilat::freeze(lm);
+            }
+
+            i_args.lm = std::make_shared<ilat::fst>(lm);
+        }
+
+        if (ebt::in(std::string("lattice-archive"), args)) {
+            i_args.lattices = std::make_shared<ilat::lattice_archive>(
+                ilat::load_lattice_archive(args.at("lattice-archive"), i_args.label_id));
+        }
+
         if (ebt::in(std::string("seed"), args)) {
            i_args.gen = std::default_random_engine { std::stoul(args.at("seed")) };
         }
     }
 
+    ilat::fst load_lattice(std::istream& is, std::string const& name,
+        inference_args const& i_args)
+    {
+        if (i_args.lattices != nullptr) {
+            return i_args.lattices->at(name);
+        }
+
+        ilat::fst lat = ilat::load_lattice(is, i_args.label_id);
+
+        if (lat.data->name != name) {
+            std::cerr << "expected lattice " << name << " but read "
+                << lat.data->name << std::endl;
+            exit(1);
+        }
+
+        return ilat::freeze(lat);
+    }
+
     sample::sample(inference_args const& i_args)
     {
         graph_data.param = i_args.param;
     }
 
+    namespace {
+
+        /*
+         * The graphs of `make_graph` are only read, so one copy is
+         * shared by every sample of the same length.  The budget is
+         * taken from the first call, in megabytes of "graph-cache".
+         *
+         */
+        util::graph_cache<ilat::fst>& shared_graph_cache(inference_args const& i_args)
+        {
+            static util::graph_cache<ilat::fst> cache {
+                (ebt::in(std::string("graph-cache"), i_args.args)
+                    ? std::stoul(i_args.args.at("graph-cache")) : 512ul) << 20 };
+
+            return cache;
+        }
+
+    }
+
     void make_graph(sample& s, inference_args& i_args, int frames)
     {
         if (ebt::in(std::string("edge-drop"), i_args.args)) {
@@ -1666,10 +1771,31 @@ namespace fscrf {
             s.graph_data.topo_order = std::make_shared<std::vector<int>>(
                 ::fst::topo_order(*s.graph_data.fst));
         } else {
-            s.graph_data.fst = make_graph(frames,
-                i_args.label_id, i_args.id_label, i_args.min_seg, i_args.max_seg, i_args.stride);
-            s.graph_data.topo_order = std::make_shared<std::vector<int>>(
-                ::fst::topo_order(*s.graph_data.fst));
+            auto entry = shared_graph_cache(i_args).get(
+                std::make_tuple(frames, i_args.id_label, i_args.min_seg, i_args.max_seg, i_args.stride),
+                [&]() {
+                    util::graph_cache<ilat::fst>::entry e;
+
+                    e.graph = make_graph(frames,
+                        i_args.label_id, i_args.id_label, i_args.min_seg, i_args.max_seg, i_args.stride);
+                    // Segments are at least one frame long, so the
+                    // edges go forward in time and need no check.
+                    ::fst::topo_levels<int> levels;
+                    ::fst::make_time_levels(*e.graph, levels, false);
+                    e.topo_order = std::make_shared<std::vector<int>>(
+                        std::move(levels.order));
+
+                    // The edges of a segment graph are implicit, and
+                    // only its lists take memory.
+                    e.bytes = util::graph_bytes(e.graph->data->vertices.size(),
+                        e.graph->data->segments->edges(), i_args.labels.size(),
+                        sizeof(ilat::vertex_data) + sizeof(int), 0);
+
+                    return e;
+                });
+
+            s.graph_data.fst = entry.graph;
+            s.graph_data.topo_order = entry.topo_order;
         }
     }
 
@@ -1678,6 +1804,120 @@ namespace fscrf {
         make_graph(s, i_args, s.frames.size());
     }
 
+    void make_boundary_graph(sample& s, inference_args& i_args,
+        std::vector<double> const& boundary_score)
+    {
+        double threshold = std::numeric_limits<double>::infinity();
+        if (ebt::in(std::string("boundary-threshold"), i_args.args)) {
+            threshold = std::stod(i_args.args.at("boundary-threshold"));
+        }
+
+        std::vector<int> boundaries = util::select_boundaries(boundary_score,
+            s.frames.size(), threshold, i_args.min_seg, i_args.max_seg);
+
+        s.graph_data.fst = make_boundary_graph(boundaries,
+            i_args.label_id, i_args.id_label, i_args.min_seg, i_args.max_seg);
+
+        ::fst::topo_levels<int> levels;
+        ::fst::make_time_levels(*s.graph_data.fst, levels, false);
+        s.graph_data.topo_order = std::make_shared<std::vector<int>>(
+            std::move(levels.order));
+    }
+
+    std::shared_ptr<ilat::fst> prune_labels(ilat::fst const& graph,
+        scrf::scrf_weight<ilat::fst> const& weight, int top_k, double beam)
+    {
+        ilat::fst_data data;
+
+        data.name = graph.data->name;
+        data.symbol_id = graph.data->symbol_id;
+        data.id_symbol = graph.data->id_symbol;
+
+        for (auto& v: graph.vertices()) {
+            ilat::add_vertex(data, v, ilat::vertex_data { graph.time(v) });
+
+            if (v < graph.data->vertex_attrs.size()) {
+                data.vertex_attrs[v] = graph.data->vertex_attrs[v];
+            }
+        }
+
+        data.initials = graph.initials();
+        data.finals = graph.finals();
+
+        // (head, score, edge), sorted so that each span is a run with
+        // the best labels first
+
+        std::vector<std::tuple<int, double, int>> span;
+
+        for (auto& u: graph.vertices()) {
+            span.clear();
+
+            for (auto& e: graph.out_edges(u)) {
+                span.push_back(std::make_tuple(graph.head(e), -weight(graph, e), e));
+            }
+
+            std::sort(span.begin(), span.end());
+
+            for (int i = 0; i < span.size(); ) {
+                int v = std::get<0>(span[i]);
+                double best = -std::get<1>(span[i]);
+                int k = 0;
+
+                for (; i < span.size() && std::get<0>(span[i]) == v; ++i, ++k) {
+                    int e = std::get<2>(span[i]);
+
+                    if ((top_k > 0 && k >= top_k) || -std::get<1>(span[i]) < best - beam) {
+                        continue;
+                    }
+
+                    int f = data.edges.size();
+
+                    ilat::add_edge(data, f, ilat::edge_data { u, v,
+                        graph.weight(e), graph.input(e), graph.output(e) });
+
+                    // Lattices carry features and attributes that the
+                    // second pass may score, as in `ilat_path_maker`.
+
+                    if (e < graph.data->edge_attrs.size()) {
+                        data.edge_attrs[f] = graph.data->edge_attrs[e];
+                        data.feats[f] = graph.data->feats[e];
+                    } else {
+                        for (int j = 0; j < graph.feat_size(e); ++j) {
+                            data.feats[f].push_back(graph.feat(e, j));
+                        }
+                    }
+                }
+            }
+        }
+
+        ilat::fst result;
+        result.data = std::make_shared<ilat::fst_data>(std::move(data));
+
+        return std::make_shared<ilat::fst>(result);
+    }
+
+    void prune_graph(sample& s, inference_args const& i_args,
+        scrf::scrf_weight<ilat::fst> const& weight)
+    {
+        int top_k = 0;
+        if (ebt::in(std::string("label-top-k"), i_args.args)) {
+            top_k = std::stoi(i_args.args.at("label-top-k"));
+        }
+
+        double beam = std::numeric_limits<double>::infinity();
+        if (ebt::in(std::string("label-beam"), i_args.args)) {
+            beam = std::stod(i_args.args.at("label-beam"));
+        }
+
+        if (top_k <= 0 && beam == std::numeric_limits<double>::infinity()) {
+            return;
+        }
+
+        // The vertices are kept as they are, so the topological order
+        // of the full graph still applies.
+        s.graph_data.fst = prune_labels(*s.graph_data.fst, weight, top_k, beam);
+    }
+
     void parse_learning_args(learning_args& l_args,
         std::unordered_map<std::string, std::string> const& args)
     {
@@ -1732,6 +1972,12 @@ namespace fscrf {
         if (ebt::in(std::string("adam-beta2"), args)) {
             l_args.adam_beta2 = std::stod(args.at("adam-beta2"));
         }
+
+        l_args.batch_size = 1;
+        if (ebt::in(std::string("batch-size"), args)) {
+            l_args.batch_size = std::stoi(args.at("batch-size"));
+            assert(l_args.batch_size >= 1);
+        }
     }
 
     learning_sample::learning_sample(learning_args const& l_args)
@@ -1740,20 +1986,229 @@ namespace fscrf {
         gold_data.param = l_args.param;
     }
 
+    std::vector<std::shared_ptr<tensor_tree::vertex>> minibatch_grad(learning_args const& l_args,
+        std::function<std::vector<std::shared_ptr<tensor_tree::vertex>>(int)> const& sample_grad)
+    {
+        return util::minibatch_grad(l_args.batch_size, sample_grad);
+    }
+
     loss_func::~loss_func()
     {}
 
+    std::vector<int> best_path_edges(fscrf_data const& graph_data)
+    {
+        fscrf_fst graph { graph_data };
+
+        if (graph_data.fst->data->segments != nullptr) {
+            return ilat::segment_best_path(*graph_data.fst,
+                fst::make_weight_array(graph));
+        }
+
+        fst::forward_one_best<fscrf_fst> one_best;
+        for (auto& v: graph.initials()) {
+            one_best.extra[v] = { -1, 0 };
+        }
+        one_best.merge(graph, graph.topo_order());
+
+        return one_best.best_path(graph);
+    }
+
+    std::shared_ptr<ilat::fst> shortest_path(fscrf_data const& graph_data)
+    {
+        return ilat::ilat_path_maker()(best_path_edges(graph_data), *graph_data.fst);
+    }
+
+    std::shared_ptr<ilat::fst> beam_shortest_path(fscrf_data const& graph_data,
+        double beam, int max_active)
+    {
+        fscrf_fst graph { graph_data };
+
+        fst::forward_one_best<fscrf_fst> one_best;
+        one_best.beam_merge(graph, *graph_data.topo_order, beam, max_active);
+
+        return ilat::ilat_path_maker()(one_best.best_path(graph), *graph_data.fst);
+    }
+
+    std::shared_ptr<ilat::fst> decode(fscrf_data const& graph_data,
+        inference_args const& i_args)
+    {
+        if (!ebt::in(std::string("decode-beam"), i_args.args)) {
+            return shortest_path(graph_data);
+        }
+
+        int max_active = 0;
+        if (ebt::in(std::string("max-active"), i_args.args)) {
+            max_active = std::stoi(i_args.args.at("max-active"));
+        }
+
+        return beam_shortest_path(graph_data,
+            std::stod(i_args.args.at("decode-beam")), max_active);
+    }
+
+    void log_sum(fst::forward_log_sum<fscrf_weight_array_fst>& forward,
+        fst::backward_log_sum<fscrf_weight_array_fst>& backward,
+        fscrf_data const& graph_data, std::vector<double> const& weights)
+    {
+        if (graph_data.fst->data->segments != nullptr) {
+            std::vector<double> alpha = ilat::segment_forward_log_sum(*graph_data.fst, weights);
+            std::vector<double> beta = ilat::segment_backward_log_sum(*graph_data.fst, weights);
+
+            for (int v = 0; v < alpha.size(); ++v) {
+                forward.extra[v] = alpha[v];
+                backward.extra[v] = beta[v];
+            }
+
+            return;
+        }
+
+        fscrf_fst graph { graph_data };
+        fscrf_weight_array_fst weighted_graph { graph, weights };
+
+        auto levels = fst::make_topo_levels(weighted_graph, *graph_data.topo_order);
+
+        forward.merge(weighted_graph, levels);
+        backward.merge(weighted_graph, levels);
+    }
+
+    max_marginal_lattice_t max_marginal_lattice(fscrf_data const& graph_data,
+        double threshold)
+    {
+        fscrf_fst graph { graph_data };
+
+        std::vector<double> weights = fst::make_weight_array(graph);
+        fscrf_weight_array_fst weighted_graph { graph, weights };
+
+        auto levels = fst::make_topo_levels(weighted_graph, *graph_data.topo_order);
+
+        fst::forward_one_best<fscrf_weight_array_fst> forward;
+        fst::backward_one_best<fscrf_weight_array_fst> backward;
+
+        forward.merge(weighted_graph, levels);
+        backward.merge(weighted_graph, levels);
+
+        double inf = std::numeric_limits<double>::infinity();
+
+        double best = -inf;
+        for (auto& f: graph.finals()) {
+            best = std::max(best, forward.extra.at(f).value);
+        }
+
+        double cutoff = best + std::log(threshold);
+
+        ilat::fst_data data;
+        data.name = graph_data.fst->data->name;
+        data.symbol_id = graph_data.fst->data->symbol_id;
+        data.id_symbol = graph_data.fst->data->id_symbol;
+
+        ilat::fst_data const& graph_fst_data = *graph_data.fst->data;
+
+        max_marginal_lattice_t result;
+
+        std::vector<int> vertex_map(graph.vertices().size(), -1);
+
+        auto lattice_vertex = [&](int v) {
+            if (vertex_map[v] == -1) {
+                vertex_map[v] = data.vertices.size();
+                ilat::add_vertex(data, vertex_map[v], ilat::vertex_data { graph.time(v) });
+
+                if (v < graph_fst_data.vertex_attrs.size()) {
+                    data.vertex_attrs[vertex_map[v]] = graph_fst_data.vertex_attrs[v];
+                }
+            }
+
+            return vertex_map[v];
+        };
+
+        for (auto& u: *graph_data.topo_order) {
+            if (std::isinf(forward.extra.at(u).value)) {
+                continue;
+            }
+
+            for (auto& e: graph.out_edges(u)) {
+                int v = graph.head(e);
+
+                if (std::isinf(backward.extra.at(v).value)
+                        || forward.extra.at(u).value + weights[e] + backward.extra.at(v).value < cutoff) {
+                    continue;
+                }
+
+                int f = data.edges.size();
+
+                ilat::add_edge(data, f, ilat::edge_data { lattice_vertex(u),
+                    lattice_vertex(v), graph_data.fst->weight(e), graph.input(e), graph.output(e) });
+                result.edge_map.push_back(e);
+
+                if (e < graph_fst_data.edge_attrs.size()) {
+                    data.edge_attrs[f] = graph_fst_data.edge_attrs[e];
+                    data.feats[f] = graph_fst_data.feats[e];
+                } else {
+                    for (int j = 0; j < graph_data.fst->feat_size(e); ++j) {
+                        data.feats[f].push_back(graph_data.fst->feat(e, j));
+                    }
+                }
+            }
+        }
+
+        for (auto& v: graph.initials()) {
+            if (vertex_map[v] != -1) {
+                data.initials.push_back(vertex_map[v]);
+            }
+        }
+
+        for (auto& v: graph.finals()) {
+            if (vertex_map[v] != -1) {
+                data.finals.push_back(vertex_map[v]);
+            }
+        }
+
+        ilat::fst lattice;
+        lattice.data = std::make_shared<ilat::fst_data>(std::move(data));
+        result.fst = std::make_shared<ilat::fst>(lattice);
+
+        result.topo_order = std::make_shared<std::vector<int>>(
+            ::fst::timed_topo_order(*result.fst));
+
+        return result;
+    }
+
+    rescored_path_t rescore_shortest_path(fscrf_data const& graph_data,
+        std::shared_ptr<scrf::scrf_weight<ilat::fst>> weight_func,
+        double threshold)
+    {
+        max_marginal_lattice_t lattice = max_marginal_lattice(graph_data, threshold);
+
+        fscrf_data lattice_data;
+        lattice_data.fst = lattice.fst;
+        lattice_data.topo_order = lattice.topo_order;
+        lattice_data.weight_func = weight_func;
+        lattice_data.param = graph_data.param;
+
+        rescored_path_t result;
+        result.fst = shortest_path(lattice_data);
+        result.edge_map = std::move(lattice.edge_map);
+
+        return result;
+    }
+
     hinge_loss::hinge_loss(fscrf_data& graph_data,
             std::vector<segcost::segment<int>> const& gt_segs,
             std::vector<int> const& sils,
-            double cost_scale)
+            double cost_scale,
+            util::oracle_cache *oracle,
+            util::oracle_cache::key const& oracle_key)
         : graph_data(graph_data), sils(sils), cost_scale(cost_scale)
     {
         auto old_weight_func = graph_data.weight_func;
         graph_data.weight_func = std::make_shared<scrf::mul<ilat::fst>>(
             scrf::mul<ilat::fst>(std::make_shared<scrf::seg_cost<ilat::fst>>(
                 scrf::make_overlap_cost<ilat::fst>(gt_segs, sils)), -1));
-        gold_path_data.fst = scrf::shortest_path(graph_data);
+        util::oracle_cache::key cost_key = oracle_key;
+        std::get<6>(cost_key) = util::oracle_cache::cost_key("overlap", sils);
+
+        gold_path_data.fst = ilat::ilat_path_maker()(oracle == nullptr
+            ? best_path_edges(graph_data)
+            : oracle->get(cost_key, [&]() { return best_path_edges(graph_data); }),
+            *graph_data.fst);
         graph_data.weight_func = old_weight_func;
         gold_path_data.weight_func = graph_data.weight_func;
 
@@ -1792,7 +2247,7 @@ namespace fscrf {
         weight_cost.weights.push_back(graph_data.cost_func);
         weight_cost.weights.push_back(graph_data.weight_func);
         graph_data.weight_func = std::make_shared<scrf::composite_weight<ilat::fst>>(weight_cost);
-        graph_path_data.fst = scrf::shortest_path(graph_data);
+        graph_path_data.fst = shortest_path(graph_data);
         graph_path_data.weight_func = graph_data.weight_func;
 
         fscrf_fst graph_path { graph_path_data };
@@ -1904,7 +2359,7 @@ namespace fscrf {
         weight_cost.weights.push_back(graph_data.cost_func);
         weight_cost.weights.push_back(graph_data.weight_func);
         graph_data.weight_func = std::make_shared<scrf::composite_weight<ilat::fst>>(weight_cost);
-        graph_path_data.fst = scrf::shortest_path(graph_data);
+        graph_path_data.fst = shortest_path(graph_data);
         graph_path_data.weight_func = graph_data.weight_func;
 
         fscrf_fst graph_path { graph_path_data };
@@ -1959,14 +2414,22 @@ namespace fscrf {
 
     log_loss::log_loss(fscrf_data& graph_data,
         std::vector<segcost::segment<int>> const& gt_segs,
-        std::vector<int> const& sils)
+        std::vector<int> const& sils,
+        util::oracle_cache *oracle,
+        util::oracle_cache::key const& oracle_key)
         : graph_data(graph_data)
     {
         auto old_weight_func = graph_data.weight_func;
         graph_data.weight_func = std::make_shared<scrf::mul<ilat::fst>>(
             scrf::mul<ilat::fst>(std::make_shared<scrf::seg_cost<ilat::fst>>(
                 scrf::make_overlap_cost<ilat::fst>(gt_segs, sils)), -1));
-        gold_path_data.fst = scrf::shortest_path(graph_data);
+        util::oracle_cache::key cost_key = oracle_key;
+        std::get<6>(cost_key) = util::oracle_cache::cost_key("overlap", sils);
+
+        gold_path_data.fst = ilat::ilat_path_maker()(oracle == nullptr
+            ? best_path_edges(graph_data)
+            : oracle->get(cost_key, [&]() { return best_path_edges(graph_data); }),
+            *graph_data.fst);
         graph_data.weight_func = old_weight_func;
         gold_path_data.weight_func = graph_data.weight_func;
 
@@ -2001,12 +2464,9 @@ namespace fscrf {
 
         fscrf_fst graph { graph_data };
 
-        forward.merge(graph, *graph_data.topo_order);
-
-        auto rev_topo_order = *graph_data.topo_order;
-        std::reverse(rev_topo_order.begin(), rev_topo_order.end());
+        weights = fst::make_weight_array(graph);
 
-        backward.merge(graph, rev_topo_order);
+        log_sum(forward, backward, graph_data, weights);
 
         for (auto& f: graph.finals()) {
             std::cout << "forward: " << forward.extra[f] << std::endl;
@@ -2048,7 +2508,7 @@ namespace fscrf {
 
         for (auto& e: graph.edges()) {
             graph_data.weight_func->accumulate_grad(
-                std::exp(forward.extra.at(graph.tail(e)) + graph.weight(e)
+                std::exp(forward.extra.at(graph.tail(e)) + weights[e]
                     + backward.extra.at(graph.head(e)) - logZ), *graph_data.fst, e);
         }
     }
@@ -2091,12 +2551,9 @@ namespace fscrf {
     {
         fscrf_fst graph { graph_data };
 
-        forward_graph.merge(graph, *graph_data.topo_order);
-
-        auto rev_topo_order = *graph_data.topo_order;
-        std::reverse(rev_topo_order.begin(), rev_topo_order.end());
+        weights = fst::make_weight_array(graph);
 
-        backward_graph.merge(graph, rev_topo_order);
+        log_sum(forward_graph, backward_graph, graph_data, weights);
 
         for (auto& f: graph.finals()) {
             std::cout << "forward: " << forward_graph.extra[f] << std::endl;
@@ -2118,7 +2575,7 @@ namespace fscrf {
         pair_data.weight_func = std::make_shared<mode2_weight>(
             mode2_weight { graph_data.weight_func });
         pair_data.topo_order = std::make_shared<std::vector<std::tuple<int, int>>>(
-            fst::topo_order(composed_fst));
+            fst::timed_topo_order(composed_fst));
 
         fscrf_pair_fst pair { pair_data };
 
@@ -2160,8 +2617,8 @@ namespace fscrf {
         double logZ1 = forward_label.extra.at(pair.finals().front());
 
         for (auto& e: pair.edges()) {
-            if (!ebt::in(pair.tail(e), forward_label.extra) ||
-                    !ebt::in(pair.head(e), backward_label.extra)) {
+            if (!forward_label.extra.has(pair.tail(e)) ||
+                    !backward_label.extra.has(pair.head(e))) {
                 continue;
             }
 
@@ -2176,7 +2633,7 @@ namespace fscrf {
 
         for (auto& e: graph.edges()) {
             graph_data.weight_func->accumulate_grad(
-                std::exp(forward_graph.extra.at(graph.tail(e)) + graph.weight(e)
+                std::exp(forward_graph.extra.at(graph.tail(e)) + weights[e]
                     + backward_graph.extra.at(graph.head(e)) - logZ2), *graph_data.fst, e);
         }
     }
@@ -2199,7 +2656,7 @@ namespace fscrf {
         pair_data.weight_func = std::make_shared<mode2_weight>(
             mode2_weight { graph_data.weight_func });
         pair_data.topo_order = std::make_shared<std::vector<std::tuple<int, int>>>(
-            fst::topo_order(composed_fst));
+            fst::timed_topo_order(composed_fst));
 
         fscrf_pair_fst pair { pair_data };
 
@@ -2235,7 +2692,7 @@ namespace fscrf {
         weight_cost.weights.push_back(graph_data.cost_func);
         weight_cost.weights.push_back(graph_data.weight_func);
         graph_data.weight_func = std::make_shared<scrf::composite_weight<ilat::fst>>(weight_cost);
-        graph_path_data.fst = scrf::shortest_path(graph_data);
+        graph_path_data.fst = shortest_path(graph_data);
         graph_path_data.weight_func = graph_data.weight_func;
 
         fscrf_fst graph_path { graph_path_data };
@@ -2561,20 +3018,56 @@ namespace fscrf {
 
     mode13_weight::mode13_weight(std::shared_ptr<scrf::scrf_weight<ilat::pair_fst>> weight)
         : weight(weight)
-    {}
+    {
+        std::vector<std::shared_ptr<scrf::scrf_weight<ilat::pair_fst>>> parts { weight };
+
+        auto comp = std::dynamic_pointer_cast<scrf::composite_weight<ilat::pair_fst>>(weight);
+
+        if (comp != nullptr) {
+            parts = comp->weights;
+        }
+
+        for (auto& w: parts) {
+            auto lm_weight = std::dynamic_pointer_cast<mode2_weight>(w);
+
+            if (lm_weight != nullptr) {
+                backoff_weights.push_back(lm_weight->weight);
+            }
+        }
+    }
 
     double mode13_weight::operator()(ilat::triple_fst const& fst,
         std::tuple<int, int, int> e) const
     {
         ilat::lazy_pair_mode1 composed_fst { fst.fst1(), fst.fst3() };
-        return (*weight)(composed_fst, std::make_tuple(std::get<0>(e), std::get<2>(e)));
+        double result = (*weight)(composed_fst, std::make_tuple(std::get<0>(e), fst.fst3_edge(e)));
+
+        std::vector<int> failures;
+        fst.fst3_failures(e, failures);
+
+        for (auto& f: failures) {
+            for (auto& w: backoff_weights) {
+                result += (*w)(fst.fst3(), f);
+            }
+        }
+
+        return result;
     }
 
     void mode13_weight::accumulate_grad(double g, ilat::triple_fst const& fst,
         std::tuple<int, int, int> e) const
     {
         ilat::lazy_pair_mode1 composed_fst { fst.fst1(), fst.fst3() };
-        weight->accumulate_grad(g, composed_fst, std::make_tuple(std::get<0>(e), std::get<2>(e)));
+        weight->accumulate_grad(g, composed_fst, std::make_tuple(std::get<0>(e), fst.fst3_edge(e)));
+
+        std::vector<int> failures;
+        fst.fst3_failures(e, failures);
+
+        for (auto& f: failures) {
+            for (auto& w: backoff_weights) {
+                w->accumulate_grad(g, fst.fst3(), f);
+            }
+        }
     }
 
     void mode13_weight::grad() const
@@ -2599,14 +3092,14 @@ namespace fscrf {
 
         double graph_forward_logZ = -inf;
         for (auto& f: graph.finals()) {
-            if (ebt::in(f, forward_graph.extra) && !std::isinf(forward_graph.extra.at(f))) {
+            if (forward_graph.extra.has(f) && !std::isinf(forward_graph.extra.at(f))) {
                 graph_forward_logZ = ebt::log_add(forward_graph.extra.at(f), graph_forward_logZ);
             }
         }
 
         double graph_backward_logZ = -inf;
         for (auto& i: graph.initials()) {
-            if (ebt::in(i, backward_graph.extra) && !std::isinf(backward_graph.extra.at(i))) {
+            if (backward_graph.extra.has(i) && !std::isinf(backward_graph.extra.at(i))) {
                 graph_backward_logZ = ebt::log_add(backward_graph.extra.at(i), graph_backward_logZ);
             }
         }
@@ -2619,15 +3112,17 @@ namespace fscrf {
         auto& id_label = *graph_fst.data->id_symbol;
 
         ilat::fst label_fst = make_label_fst(label_seq, label_id, id_label);
-        ilat::add_eps_loops(label_fst);
 
-        ilat::lazy_triple_mode2 composed_fst { graph_fst, label_fst, lm };
+        // Backoffs of the LM are followed as failure edges, so the
+        // label fst needs no epsilon loops to get past them.
+        ilat::lazy_triple_backoff_mode2 composed_fst { graph_fst, label_fst, lm,
+            label_id.at("<eps>") };
 
-        label_graph_data.fst = std::make_shared<ilat::lazy_triple_mode2>(composed_fst);
+        label_graph_data.fst = std::make_shared<ilat::lazy_triple_backoff_mode2>(composed_fst);
         label_graph_data.weight_func = std::make_shared<mode13_weight>(
             mode13_weight { graph_data.weight_func });
         label_graph_data.topo_order = std::make_shared<std::vector<std::tuple<int, int, int>>>(
-            fst::topo_order(composed_fst));
+            fst::timed_topo_order(composed_fst));
 
         fscrf_triple_fst label_graph { label_graph_data };
 
@@ -2639,14 +3134,14 @@ namespace fscrf {
 
         double label_forward_logZ = -inf;
         for (auto& f: label_graph.finals()) {
-            if (ebt::in(f, forward_label.extra) && !std::isinf(forward_label.extra.at(f))) {
+            if (forward_label.extra.has(f) && !std::isinf(forward_label.extra.at(f))) {
                 label_forward_logZ = ebt::log_add(forward_label.extra.at(f), label_forward_logZ);
             }
         }
 
         double label_backward_logZ = -inf;
         for (auto& i: label_graph.initials()) {
-            if (ebt::in(i, backward_label.extra) && !std::isinf(backward_label.extra.at(i))) {
+            if (backward_label.extra.has(i) && !std::isinf(backward_label.extra.at(i))) {
                 label_backward_logZ = ebt::log_add(backward_label.extra.at(i), label_backward_logZ);
             }
         }
@@ -2664,7 +3159,7 @@ namespace fscrf {
 
         double label_forward_logZ = -inf;
         for (auto& f: label_graph.finals()) {
-            if (ebt::in(f, forward_label.extra) && !std::isinf(forward_label.extra.at(f))) {
+            if (forward_label.extra.has(f) && !std::isinf(forward_label.extra.at(f))) {
                 label_forward_logZ = ebt::log_add(forward_label.extra.at(f), label_forward_logZ);
             }
         }
@@ -2675,7 +3170,7 @@ namespace fscrf {
 
         double graph_forward_logZ = -inf;
         for (auto& f: graph.finals()) {
-            if (ebt::in(f, forward_graph.extra) && !std::isinf(forward_graph.extra.at(f))) {
+            if (forward_graph.extra.has(f) && !std::isinf(forward_graph.extra.at(f))) {
                 graph_forward_logZ = ebt::log_add(forward_graph.extra.at(f), graph_forward_logZ);
             }
         }
@@ -2693,15 +3188,15 @@ namespace fscrf {
 
         double logZ1 = -inf;
         for (auto& f: label_graph.finals()) {
-            if (ebt::in(f, forward_label.extra) && !std::isinf(forward_label.extra.at(f))) {
+            if (forward_label.extra.has(f) && !std::isinf(forward_label.extra.at(f))) {
                 logZ1 = ebt::log_add(forward_label.extra.at(f), logZ1);
             }
         }
 
         if (!std::isinf(logZ1)) {
             for (auto& e: label_graph.edges()) {
-                if (!ebt::in(label_graph.tail(e), forward_label.extra) ||
-                        !ebt::in(label_graph.head(e), backward_label.extra)) {
+                if (!forward_label.extra.has(label_graph.tail(e)) ||
+                        !backward_label.extra.has(label_graph.head(e))) {
                     continue;
                 }
 
@@ -2715,14 +3210,14 @@ namespace fscrf {
 
         double logZ2 = -inf;
         for (auto& f: graph.finals()) {
-            if (ebt::in(f, forward_graph.extra) && !std::isinf(forward_graph.extra.at(f))) {
+            if (forward_graph.extra.has(f) && !std::isinf(forward_graph.extra.at(f))) {
                 logZ2 = ebt::log_add(forward_graph.extra.at(f), logZ2);
             }
         }
 
         for (auto& e: graph.edges()) {
-            if (!ebt::in(graph.tail(e), forward_graph.extra) ||
-                    !ebt::in(graph.head(e), backward_graph.extra)) {
+            if (!forward_graph.extra.has(graph.tail(e)) ||
+                    !backward_graph.extra.has(graph.head(e))) {
                 continue;
             }
 
@@ -5,10 +5,13 @@
 #include "seg/scrf_weight.h"
 #include "seg/segcost.h"
 #include "seg/scrf_cost.h"
+#include "seg/util.h"
+#include "seg/segrnn.h"
 #include "autodiff/autodiff.h"
 #include "nn/tensor-tree.h"
 #include "nn/lstm.h"
 #include <random>
+#include <functional>
 
 namespace fscrf {
 
@@ -22,6 +25,8 @@ namespace fscrf {
 
     using fscrf_fst = scrf::scrf_fst<fscrf_data>;
 
+    using fscrf_weight_array_fst = fst::weight_array_fst<fscrf_fst>;
+
     struct fscrf_pair_data {
         std::shared_ptr<ilat::pair_fst> fst;
         std::shared_ptr<std::vector<std::tuple<int, int>>> topo_order;
@@ -96,6 +101,14 @@ namespace fscrf {
         double dropout = 0.0,
         std::default_random_engine *gen = nullptr);
 
+    /*
+     * `cumsum` holds, for every label, the prefix sums of `score`
+     * over time, so that the average over a segment takes two
+     * lookups.  Gradients of a segment are added to the two ends
+     * of `grad_diff`, and `grad` turns the differences back into
+     * per-frame gradients in one pass.
+     *
+     */
     struct frame_avg_score
         : public scrf::scrf_weight<ilat::fst> {
 
@@ -103,6 +116,9 @@ namespace fscrf {
         std::shared_ptr<autodiff::op_t> frames;
         std::shared_ptr<autodiff::op_t> score;
 
+        std::vector<double> cumsum;
+        mutable std::vector<double> grad_diff;
+
         frame_avg_score(std::shared_ptr<autodiff::op_t> param,
             std::shared_ptr<autodiff::op_t> frames);
 
@@ -116,6 +132,22 @@ namespace fscrf {
 
     };
 
+    /*
+     * The attention-weighted average is a ratio of two sums over the
+     * segment, of `exp(att) + 0.01` and of the same weights times
+     * `score`, and both are read off per-label prefix sums.  The
+     * gradient of a segment is a constant times the frame value plus a
+     * constant, so the two constants are spread over the segment with
+     * difference arrays and resolved in `grad`.
+     *
+     * A plain prefix sum over a whole utterance loses the low digits
+     * of a short segment once the sum is much larger than the segment,
+     * which happens when a few frames have large `exp(att)`.  The
+     * prefix sums and the running sums in `grad` therefore carry their
+     * rounding error in a second array, and a segment sum is the
+     * difference of both.
+     *
+     */
     struct frame_weighted_avg_score
         : public scrf::scrf_weight<ilat::fst> {
 
@@ -126,6 +158,13 @@ namespace fscrf {
         std::shared_ptr<autodiff::op_t> att_exp;
         std::shared_ptr<autodiff::op_t> score;
 
+        std::vector<double> z_cumsum;
+        std::vector<double> z_cumsum_err;
+        std::vector<double> sum_cumsum;
+        std::vector<double> sum_cumsum_err;
+        mutable std::vector<double> scale_diff;
+        mutable std::vector<double> shift_diff;
+
         frame_weighted_avg_score(std::shared_ptr<autodiff::op_t> param,
             std::shared_ptr<autodiff::op_t> att_param,
             std::shared_ptr<autodiff::op_t> frame);
@@ -147,6 +186,7 @@ namespace fscrf {
         std::shared_ptr<autodiff::op_t> frames;
         std::shared_ptr<autodiff::op_t> score;
         double scale;
+        std::shared_ptr<util::sparse_grad> grad_cells;
 
         frame_samples_score(std::shared_ptr<autodiff::op_t> param,
             std::shared_ptr<autodiff::op_t> frames, double scale);
@@ -168,6 +208,7 @@ namespace fscrf {
         std::shared_ptr<autodiff::op_t> frames;
         std::shared_ptr<autodiff::op_t> score;
         int shift;
+        std::shared_ptr<util::sparse_grad> grad_cells;
 
         left_boundary_score(std::shared_ptr<autodiff::op_t> param,
             std::shared_ptr<autodiff::op_t> frames, int shift);
@@ -189,6 +230,7 @@ namespace fscrf {
         std::shared_ptr<autodiff::op_t> frames;
         std::shared_ptr<autodiff::op_t> score;
         int shift;
+        std::shared_ptr<util::sparse_grad> grad_cells;
 
         right_boundary_score(std::shared_ptr<autodiff::op_t> param,
             std::shared_ptr<autodiff::op_t> frames, int shift);
@@ -252,14 +294,10 @@ namespace fscrf {
         std::shared_ptr<autodiff::op_t> pre_label;
         std::shared_ptr<autodiff::op_t> pre_length;
 
-        std::shared_ptr<autodiff::op_t> score;
-
-        std::vector<int> topo_order_shift;
-
         mutable std::default_random_engine *gen;
         double dropout;
 
-        mutable std::vector<std::shared_ptr<autodiff::op_t>> edge_scores;
+        std::shared_ptr<segrnn::batch_table> batches;
 
         segrnn_score(std::shared_ptr<tensor_tree::vertex> param,
             std::shared_ptr<autodiff::op_t> frames);
@@ -269,6 +307,8 @@ namespace fscrf {
             double dropout,
             std::default_random_engine *gen);
 
+        segrnn::edge_batch& get_batch(ilat::fst const& f) const;
+
         virtual double operator()(ilat::fst const& f,
             int e) const override;
 
@@ -448,6 +488,9 @@ namespace fscrf {
         std::vector<std::string> features;
         std::unordered_map<std::string, std::string> args;
 
+        std::shared_ptr<ilat::fst> lm;
+        std::shared_ptr<ilat::lattice_archive> lattices;
+
         std::default_random_engine gen;
     };
 
@@ -476,9 +519,26 @@ namespace fscrf {
         std::shared_ptr<tensor_tree::vertex> nn_param,
         std::string filename);
 
+    /*
+     * Besides the graph and model arguments, `parse_inference_args`
+     * loads the LM of "lm" on the labels, either a text ARPA file or
+     * one written by `ilat::compile_arpa_lm`.  If "lm-compiled" names
+     * a file, the text LM is compiled there the first time and mapped
+     * from then on, so that training processes share it.  A text LM
+     * is frozen after loading.  "lattice-archive" opens an archive
+     * written by `ilat::compile_lattice_archive`.
+     *
+     * `load_lattice` gives the lattice of utterance `name` from the
+     * archive if one is open, and otherwise reads the next lattice of
+     * `is` in the text format and freezes it.
+     *
+     */
     void parse_inference_args(inference_args& l_args,
         std::unordered_map<std::string, std::string> const& args);
 
+    ilat::fst load_lattice(std::istream& is, std::string const& name,
+        inference_args const& i_args);
+
     struct sample {
         std::vector<std::vector<double>> frames;
         fscrf_data graph_data;
@@ -489,6 +549,48 @@ namespace fscrf {
     void make_graph(sample& s, inference_args& i_args);
     void make_graph(sample& s, inference_args& i_args, int frames);
 
+    /*
+     * Graphs on boundary candidates.  `make_boundary_graph` places
+     * vertices only at `boundaries`, as chosen by
+     * `util::select_boundaries`, and connects those between `min_seg`
+     * and `max_seg` frames apart.  The graph grows with the number of
+     * boundaries instead of the number of frames.  The sample version
+     * takes a score per frame and the threshold "boundary-threshold",
+     * which defaults to keeping local peaks only.  The boundaries
+     * follow the scores, so oracle paths of these graphs must not be
+     * kept in a `util::oracle_cache`.
+     *
+     */
+    std::shared_ptr<ilat::fst> make_boundary_graph(std::vector<int> const& boundaries,
+        std::unordered_map<std::string, int> const& label_id,
+        std::vector<std::string> const& id_label,
+        int min_seg_len, int max_seg_len);
+
+    void make_boundary_graph(sample& s, inference_args& i_args,
+        std::vector<double> const& boundary_score);
+
+    /*
+     * Two-stage graphs.  `prune_labels` scores every edge of `graph`
+     * with a cheap `weight`, such as frame averages, and keeps on each
+     * span only the `top_k` best labels and those within `beam` of the
+     * best.  The result is an explicit graph on the same vertices, so
+     * expensive features are only evaluated on the surviving edges.
+     * The surviving edges keep their features and attributes, so
+     * lattices can be pruned as well.
+     * A `top_k` of 0 keeps any number of labels.
+     *
+     * `prune_graph` applies it to a sample with "label-top-k" and
+     * "label-beam" from the arguments, and leaves the graph alone when
+     * neither is given.  The surviving edges change with `weight`,
+     * so pruned graphs must not use a `util::oracle_cache` either.
+     *
+     */
+    std::shared_ptr<ilat::fst> prune_labels(ilat::fst const& graph,
+        scrf::scrf_weight<ilat::fst> const& weight, int top_k, double beam);
+
+    void prune_graph(sample& s, inference_args const& i_args,
+        scrf::scrf_weight<ilat::fst> const& weight);
+
     struct learning_args
         : public inference_args {
 
@@ -507,6 +609,7 @@ namespace fscrf {
         double adam_beta1;
         double adam_beta2;
         int time;
+        int batch_size;
     };
 
     void parse_learning_args(learning_args& l_args,
@@ -521,6 +624,83 @@ namespace fscrf {
         learning_sample(learning_args const& args);
     };
 
+    /*
+     * Sums the gradient trees of a minibatch of "batch-size" samples
+     * with `util::minibatch_grad`.
+     *
+     */
+    std::vector<std::shared_ptr<tensor_tree::vertex>> minibatch_grad(learning_args const& l_args,
+        std::function<std::vector<std::shared_ptr<tensor_tree::vertex>>(int)> const& sample_grad);
+
+    /*
+     * `shortest_path` and `log_sum` run the semi-Markov recursions in
+     * ilat.h when the graph is a complete segment graph, and fall
+     * back to the generic sweeps otherwise.  The weights passed to
+     * `log_sum` are indexed by edge id.  `best_path_edges` returns the
+     * edges of the shortest path in the graph itself.
+     *
+     */
+    std::vector<int> best_path_edges(fscrf_data const& graph_data);
+
+    std::shared_ptr<ilat::fst> shortest_path(fscrf_data const& graph_data);
+
+    void log_sum(fst::forward_log_sum<fscrf_weight_array_fst>& forward,
+        fst::backward_log_sum<fscrf_weight_array_fst>& backward,
+        fscrf_data const& graph_data, std::vector<double> const& weights);
+
+    /*
+     * Viterbi decoding with `beam_merge`.  Weights are only evaluated
+     * on edges leaving vertices still on the frontier, which saves
+     * feature computation on long segments out of poorly scoring
+     * vertices, including on graphs from `make_graph`.  The path
+     * found is not always the best one.
+     *
+     * `decode` uses it when "decode-beam" is given, with
+     * "max-active" if given, and `shortest_path` otherwise.
+     *
+     */
+    std::shared_ptr<ilat::fst> beam_shortest_path(fscrf_data const& graph_data,
+        double beam, int max_active = 0);
+
+    std::shared_ptr<ilat::fst> decode(fscrf_data const& graph_data,
+        inference_args const& i_args);
+
+    /*
+     * Two-pass decoding.  `max_marginal_lattice` scores a graph with
+     * cheap features and keeps, as an explicit lattice, the edges on
+     * some path whose score is within log(`threshold`) of the best
+     * path.  The pruning uses the max-marginal of each edge, the
+     * score of the best path through it from the forward and
+     * backward Viterbi passes, not its posterior, so every kept edge
+     * lies on a kept path from an initial to a final vertex, and the
+     * best path is always kept.  The kept edges keep their features
+     * and attributes.  `edge_map` takes the edges of the lattice back
+     * to those of the graph.
+     *
+     * `rescore_shortest_path` decodes such a lattice with the full
+     * weight, so expensive features such as segrnn only see the edges
+     * that survived the first pass.  The path is on the edges of the
+     * lattice, and `edge_map` of the lattice comes with it.
+     *
+     */
+    struct max_marginal_lattice_t {
+        std::shared_ptr<ilat::fst> fst;
+        std::shared_ptr<std::vector<int>> topo_order;
+        std::vector<int> edge_map;
+    };
+
+    max_marginal_lattice_t max_marginal_lattice(fscrf_data const& graph_data,
+        double threshold);
+
+    struct rescored_path_t {
+        std::shared_ptr<ilat::fst> fst;
+        std::vector<int> edge_map;
+    };
+
+    rescored_path_t rescore_shortest_path(fscrf_data const& graph_data,
+        std::shared_ptr<scrf::scrf_weight<ilat::fst>> weight_func,
+        double threshold);
+
     struct loss_func {
         virtual ~loss_func();
 
@@ -543,7 +723,9 @@ namespace fscrf {
         hinge_loss(fscrf_data& graph_data,
             std::vector<segcost::segment<int>> const& gt_segs,
             std::vector<int> const& sils,
-            double cost_scale);
+            double cost_scale,
+            util::oracle_cache *oracle=nullptr,
+            util::oracle_cache::key const& oracle_key=util::oracle_cache::key{});
 
         virtual double loss() const override;
 
@@ -581,12 +763,16 @@ namespace fscrf {
         fscrf_data gold_path_data;
         std::vector<segcost::segment<int>> gold_segs;
 
-        fst::forward_log_sum<fscrf_fst> forward;
-        fst::backward_log_sum<fscrf_fst> backward;
+        std::vector<double> weights;
+
+        fst::forward_log_sum<fscrf_weight_array_fst> forward;
+        fst::backward_log_sum<fscrf_weight_array_fst> backward;
 
         log_loss(fscrf_data& graph_data,
             std::vector<segcost::segment<int>> const& gt_segs,
-            std::vector<int> const& sils);
+            std::vector<int> const& sils,
+            util::oracle_cache *oracle=nullptr,
+            util::oracle_cache::key const& oracle_key=util::oracle_cache::key{});
 
         virtual double loss() const override;
 
@@ -603,8 +789,10 @@ namespace fscrf {
 
         fscrf_data& graph_data;
 
-        fst::forward_log_sum<fscrf_fst> forward_graph;
-        fst::backward_log_sum<fscrf_fst> backward_graph;
+        std::vector<double> weights;
+
+        fst::forward_log_sum<fscrf_weight_array_fst> forward_graph;
+        fst::backward_log_sum<fscrf_weight_array_fst> backward_graph;
 
         fscrf_pair_data pair_data;
 
@@ -708,10 +896,22 @@ namespace fscrf {
 
     };
 
+    /*
+     * `mode13_weight` scores an edge of a graph composed with a label
+     * fst and an LM by the pair weight of its graph edge and the LM
+     * edge that reads the label.  When the LM backs off, the failure
+     * edges taken are scored by the LM features of the pair weight,
+     * its `mode2_weight`s, collected in `backoff_weights`.  An edge
+     * then scores as the path through the backoff edges of the
+     * explicit composition, and the "lm" feature sees the backoff
+     * weights as well as the final LM edge.
+     *
+     */
     struct mode13_weight
         : public scrf::scrf_weight<ilat::triple_fst> {
 
         std::shared_ptr<scrf::scrf_weight<ilat::pair_fst>> weight;
+        std::vector<std::shared_ptr<scrf::scrf_weight<ilat::fst>>> backoff_weights;
 
         mode13_weight(std::shared_ptr<scrf::scrf_weight<ilat::pair_fst>> weight);
 
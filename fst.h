@@ -2,12 +2,14 @@
 #define FST_H
 
 #include <unordered_map>
+#include <unordered_set>
 #include <tuple>
 #include <vector>
 #include <limits>
 #include <algorithm>
 #include <memory>
 #include "ebt/ebt.h"
+#include "seg/semiring.h"
 
 namespace fst {
 
@@ -95,39 +97,35 @@ namespace fst {
     template <class fst>
     std::vector<typename fst::vertex> topo_order(fst const& f);
 
+    /*
+     * Same as `topo_order` for a timed fst, but sorts the vertices by
+     * time with `make_time_levels` when every edge goes forward in
+     * time, which avoids the search and its hash set.  Unlike
+     * `topo_order`, unreachable vertices are included then.
+     *
+     */
     template <class fst>
-    struct forward_one_best {
+    std::vector<typename fst::vertex> timed_topo_order(fst const& f);
+
+    template <class fst>
+    struct forward_one_best
+        : public shortest_distance<fst, tropical_semiring<fst>, forward_sweep<fst>> {
 
         using vertex = typename fst::vertex;
         using edge = typename fst::edge;
-
-        struct extra_data {
-            edge pi;
-            double value;
-        };
-
-        std::unordered_map<vertex, extra_data> extra;
-
-        void merge(fst const& f, std::vector<vertex> const& order);
+        using extra_data = typename tropical_semiring<fst>::extra_data;
 
         std::vector<typename fst::edge> best_path(fst const& f);
 
     };
 
     template <class fst>
-    struct backward_one_best {
+    struct backward_one_best
+        : public shortest_distance<fst, tropical_semiring<fst>, backward_sweep<fst>> {
 
         using vertex = typename fst::vertex;
         using edge = typename fst::edge;
-
-        struct extra_data {
-            edge pi;
-            double value;
-        };
-
-        std::unordered_map<vertex, extra_data> extra;
-
-        void merge(fst const& f, std::vector<vertex> const& order);
+        using extra_data = typename tropical_semiring<fst>::extra_data;
 
         std::vector<typename fst::edge> best_path(fst const& f);
 
@@ -151,8 +149,8 @@ namespace fst {
             int top;
         };
 
-        std::unordered_map<edge, edge_data> edge_extra;
-        std::unordered_map<vertex, vertex_data> vertex_extra;
+        state_map<edge, edge_data> edge_extra;
+        state_map<vertex, vertex_data> vertex_extra;
 
         void first_best(fst const& f, std::vector<vertex> const& order);
         void next_best(fst const& f, vertex const& final, int k);
@@ -161,27 +159,13 @@ namespace fst {
     };
 
     template <class fst>
-    struct forward_log_sum {
-
-        using vertex = typename fst::vertex;
-        using edge = typename fst::edge;
-
-        std::unordered_map<vertex, double> extra;
-
-        void merge(fst const& f, std::vector<vertex> const& order);
-
+    struct forward_log_sum
+        : public shortest_distance<fst, log_semiring<fst>, forward_sweep<fst>> {
     };
 
     template <class fst>
-    struct backward_log_sum {
-
-        using vertex = typename fst::vertex;
-        using edge = typename fst::edge;
-
-        std::unordered_map<vertex, double> extra;
-
-        void merge(fst const& f, std::vector<vertex> const& order);
-
+    struct backward_log_sum
+        : public shortest_distance<fst, log_semiring<fst>, backward_sweep<fst>> {
     };
 
 }
@@ -242,45 +226,14 @@ namespace fst {
     }
 
     template <class fst>
-    void forward_one_best<fst>::merge(fst const& f, std::vector<typename fst::vertex> const& order)
+    std::vector<typename fst::vertex> timed_topo_order(fst const& f)
     {
-        double inf = std::numeric_limits<double>::infinity();
-
-        auto get_value = [&](vertex v) {
-            if (!ebt::in(v, extra)) {
-                return -inf;
-            } else {
-                return extra.at(v).value;
-            }
-        };
-
-        for (auto& u: order) {
-            double max = get_value(u);
-            typename fst::edge argmax;
-            bool update = false;
-
-            std::vector<edge> edges = f.in_edges(u);
-            std::vector<double> candidate_value;
-            candidate_value.resize(edges.size());
+        topo_levels<typename fst::vertex> levels;
 
-            #pragma omp parallel for
-            for (int i = 0; i < edges.size(); ++i) {
-                typename fst::edge& e = edges[i];
-                typename fst::vertex v = f.tail(e);
-                candidate_value[i] = get_value(v) + f.weight(e);
-            }
-
-            for (int i = 0; i < edges.size(); ++i) {
-                if (candidate_value[i] > max) {
-                    max = candidate_value[i];
-                    argmax = edges[i];
-                    update = true;
-                }
-            }
-
-            if (update) {
-                extra[u] = extra_data { argmax, max };
-            }
+        if (make_time_levels(f, levels)) {
+            return std::move(levels.order);
+        } else {
+            return topo_order(f);
         }
     }
 
@@ -292,8 +245,8 @@ namespace fst {
         typename fst::vertex argmax;
 
         for (auto v: f.finals()) {
-            if (ebt::in(v, extra) && extra.at(v).value > max) {
-                max = extra.at(v).value;
+            if (this->extra.has(v) && this->extra.at(v).value > max) {
+                max = this->extra.at(v).value;
                 argmax = v;
             }
         }
@@ -310,7 +263,7 @@ namespace fst {
         std::unordered_set<typename fst::vertex> initial_set { initials.begin(), initials.end() };
 
         while (!ebt::in(u, initial_set)) {
-            edge e = extra.at(u).pi;
+            edge e = this->extra.at(u).pi;
             vertex v = f.tail(e);
             result.push_back(e);
             u = v;
@@ -321,52 +274,6 @@ namespace fst {
         return result;
     }
 
-    template <class fst>
-    void backward_one_best<fst>::merge(fst const& f, std::vector<typename fst::vertex> const& order)
-    {
-        double inf = std::numeric_limits<double>::infinity();
-
-        auto get_value = [&](vertex v) {
-            if (!ebt::in(v, extra)) {
-                return -inf;
-            } else {
-                return extra.at(v).value;
-            }
-        };
-
-        auto rev_order = order;
-        std::reverse(rev_order.begin(), rev_order.end());
-
-        for (auto& u: rev_order) {
-            double max = get_value(u);
-            typename fst::edge argmax;
-            bool update = false;
-
-            std::vector<edge> edges = f.out_edges(u);
-            std::vector<double> candidate_value;
-            candidate_value.resize(edges.size());
-
-            #pragma omp parallel for
-            for (int i = 0; i < edges.size(); ++i) {
-                typename fst::edge& e = edges[i];
-                typename fst::vertex v = f.head(e);
-                candidate_value[i] = get_value(v) + f.weight(e);
-            }
-
-            for (int i = 0; i < edges.size(); ++i) {
-                if (candidate_value[i] > max) {
-                    max = candidate_value[i];
-                    argmax = edges[i];
-                    update = true;
-                }
-            }
-
-            if (update) {
-                extra[u] = extra_data { argmax, max };
-            }
-        }
-    }
-
     template <class fst>
     std::vector<typename fst::edge> backward_one_best<fst>::best_path(fst const& f)
     {
@@ -375,8 +282,8 @@ namespace fst {
         typename fst::vertex argmax;
 
         for (auto v: f.initials()) {
-            if (ebt::in(v, extra) && extra.at(v).value > max) {
-                max = extra.at(v).value;
+            if (this->extra.has(v) && this->extra.at(v).value > max) {
+                max = this->extra.at(v).value;
                 argmax = v;
             }
         }
@@ -393,7 +300,7 @@ namespace fst {
         std::unordered_set<typename fst::vertex> final_set { finals.begin(), finals.end() };
 
         while (!ebt::in(u, final_set)) {
-            edge e = extra.at(u).pi;
+            edge e = this->extra.at(u).pi;
             vertex v = f.head(e);
             result.push_back(e);
             u = v;
@@ -495,7 +402,7 @@ namespace fst {
         }
 
         auto get_top = [&](typename fst::edge const& e) {
-            if (ebt::in(e, edge_extra)) {
+            if (edge_extra.has(e)) {
                 return edge_extra.at(e).top;
             } else {
                 return -1;
@@ -564,88 +471,6 @@ namespace fst {
         return result;
     }
 
-    template <class fst>
-    void forward_log_sum<fst>::merge(fst const& f, std::vector<typename fst::vertex> const& order)
-    {
-        for (auto& v: f.initials()) {
-            extra[v] = 0;
-        }
-
-        double inf = std::numeric_limits<double>::infinity();
-
-        auto get_value = [&](vertex v) {
-            if (!ebt::in(v, extra)) {
-                return -inf;
-            } else {
-                return extra.at(v);
-            }
-        };
-
-        for (auto& u: order) {
-            double s = get_value(u);
-
-            std::vector<edge> edges = f.in_edges(u);
-            std::vector<double> candidate_value;
-            candidate_value.resize(edges.size());
-
-            #pragma omp parallel for
-            for (int i = 0; i < edges.size(); ++i) {
-                typename fst::edge& e = edges[i];
-                typename fst::vertex v = f.tail(e);
-                candidate_value[i] = get_value(v) + f.weight(e);
-            }
-
-            for (int i = 0; i < edges.size(); ++i) {
-                if (candidate_value[i] != -inf) {
-                    s = ebt::log_add(s, candidate_value[i]);
-                }
-            }
-
-            extra[u] = s;
-        }
-    }
-
-    template <class fst>
-    void backward_log_sum<fst>::merge(fst const& f, std::vector<typename fst::vertex> const& order)
-    {
-        for (auto& v: f.finals()) {
-            extra[v] = 0;
-        }
-
-        double inf = std::numeric_limits<double>::infinity();
-
-        auto get_value = [&](vertex v) {
-            if (!ebt::in(v, extra)) {
-                return -inf;
-            } else {
-                return extra.at(v);
-            }
-        };
-
-        for (auto& u: order) {
-            double s = get_value(u);
-
-            std::vector<edge> edges = f.out_edges(u);
-            std::vector<double> candidate_value;
-            candidate_value.resize(edges.size());
-
-            #pragma omp parallel for
-            for (int i = 0; i < edges.size(); ++i) {
-                typename fst::edge& e = edges[i];
-                typename fst::vertex v = f.head(e);
-                candidate_value[i] = get_value(v) + f.weight(e);
-            }
-
-            for (int i = 0; i < edges.size(); ++i) {
-                if (candidate_value[i] != -inf) {
-                    s = ebt::log_add(s, candidate_value[i]);
-                }
-            }
-
-            extra[u] = s;
-        }
-    }
-
 }
 
 #endif
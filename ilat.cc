@@ -3,6 +3,13 @@
 #include <algorithm>
 #include <cassert>
 #include <fstream>
+#include <limits>
+#include <cmath>
+#include <cstring>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 namespace ilat {
 
@@ -40,6 +47,9 @@ namespace ilat {
 
     void add_edge(fst_data& data, int e, edge_data e_data)
     {
+        assert(data.segments == nullptr);
+        assert(data.mapped == nullptr);
+        assert(data.frozen == nullptr);
         assert(ebt::in(e_data.head, data.vertex_set));
         assert(ebt::in(e_data.tail, data.vertex_set));
 
@@ -62,48 +72,618 @@ namespace ilat {
         }
     }
 
+    int segment_data::edges() const
+    {
+        return out_begin.back();
+    }
+
+    int segment_data::tail(int e) const
+    {
+        return std::upper_bound(out_begin.begin(), out_begin.end(), e) - out_begin.begin() - 1;
+    }
+
+    int segment_data::head(int e) const
+    {
+        int u = tail(e);
+        return first_head[u] + (e - out_begin[u]) / labels.size();
+    }
+
+    int const& segment_data::label(int e) const
+    {
+        return labels[(e - out_begin[tail(e)]) % labels.size()];
+    }
+
+    int segment_data::edge(int u, int v, int k) const
+    {
+        return out_begin[u] + (v - first_head[u]) * labels.size() + k;
+    }
+
+    int mapped_data::find(int u, int symbol) const
+    {
+        int64_t lo = out_begin[u];
+        int64_t hi = out_begin[u + 1];
+
+        while (lo < hi) {
+            int64_t mid = (lo + hi) / 2;
+
+            if (input[mid] < symbol) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+
+        return (lo < out_begin[u + 1] && input[lo] == symbol) ? lo : -1;
+    }
+
+    int frozen_data::find(int u, int symbol) const
+    {
+        auto first = out_edge.begin() + out_begin[u];
+        auto last = out_edge.begin() + out_begin[u + 1];
+
+        auto i = std::lower_bound(first, last, symbol,
+            [&](int e, int symbol) { return input[e] < symbol; });
+
+        return (i != last && input[*i] == symbol) ? *i : -1;
+    }
+
+    void add_segments(fst_data& data, std::vector<int> const& labels,
+        int min_seg_len, int max_seg_len)
+    {
+        assert(data.edges.size() == 0);
+
+        int n = data.vertices.size();
+
+        auto seg = std::make_shared<segment_data>();
+
+        seg->labels = labels;
+        seg->out_begin.resize(n + 1);
+        seg->first_head.resize(n);
+        seg->last_head.resize(n);
+        seg->first_tail.resize(n, n);
+        seg->last_tail.resize(n, 0);
+
+        int first = 0;
+        int last = 0;
+
+        for (int u = 0; u < n; ++u) {
+            first = std::max(first, u + 1);
+            while (first < n && data.vertices[first].time - data.vertices[u].time < min_seg_len) {
+                ++first;
+            }
+
+            last = std::max(last, first);
+            while (last < n && data.vertices[last].time - data.vertices[u].time <= max_seg_len) {
+                ++last;
+            }
+
+            seg->first_head[u] = first;
+            seg->last_head[u] = last;
+            seg->out_begin[u + 1] = seg->out_begin[u] + (last - first) * labels.size();
+
+            for (int v = first; v < last; ++v) {
+                seg->first_tail[v] = std::min(seg->first_tail[v], u);
+                seg->last_tail[v] = u + 1;
+            }
+        }
+
+        seg->in_edges.resize(n);
+        seg->out_edges.resize(n);
+        seg->in_edges_map.resize(n);
+        seg->out_edges_map.resize(n);
+
+        seg->in_edges_once.reset(new std::once_flag[n]);
+        seg->out_edges_once.reset(new std::once_flag[n]);
+        seg->in_edges_map_once.reset(new std::once_flag[n]);
+        seg->out_edges_map_once.reset(new std::once_flag[n]);
+
+        data.segments = seg;
+    }
+
+    namespace {
+
+        /*
+         * Reductions over the contiguous label block of one (u, v)
+         * pair.  They are written as simd reductions so that the
+         * label loop vectorizes when built with -fopenmp or
+         * -fopenmp-simd; the exp in label_exp_sum also needs a vector
+         * math library, e.g., glibc's libmvec under -ffast-math, and
+         * stays a scalar call otherwise.
+         *
+         */
+        double label_max(double const* w, int nlabels)
+        {
+            double m = -std::numeric_limits<double>::infinity();
+
+            #pragma omp simd reduction(max: m)
+            for (int k = 0; k < nlabels; ++k) {
+                m = w[k] > m ? w[k] : m;
+            }
+
+            return m;
+        }
+
+        double label_exp_sum(double const* w, int nlabels, double shift)
+        {
+            double sum = 0;
+
+            #pragma omp simd reduction(+: sum)
+            for (int k = 0; k < nlabels; ++k) {
+                sum += std::exp(shift + w[k]);
+            }
+
+            return sum;
+        }
+
+    }
+
+    std::vector<double> segment_forward_log_sum(fst const& f,
+        std::vector<double> const& weights)
+    {
+        double inf = std::numeric_limits<double>::infinity();
+
+        segment_data const& seg = *f.data->segments;
+        int n = f.data->vertices.size();
+        int nlabels = seg.labels.size();
+
+        std::vector<double> alpha;
+        alpha.resize(n, -inf);
+
+        for (auto& i: f.initials()) {
+            alpha[i] = 0;
+        }
+
+        for (int v = 0; v < n; ++v) {
+            double max = alpha[v];
+
+            for (int u = seg.first_tail[v]; u < seg.last_tail[v]; ++u) {
+                if (alpha[u] == -inf) {
+                    continue;
+                }
+
+                double const* w = weights.data() + seg.edge(u, v, 0);
+                max = std::max(max, alpha[u] + label_max(w, nlabels));
+            }
+
+            if (max == -inf) {
+                continue;
+            }
+
+            double sum = std::exp(alpha[v] - max);
+
+            for (int u = seg.first_tail[v]; u < seg.last_tail[v]; ++u) {
+                if (alpha[u] == -inf) {
+                    continue;
+                }
+
+                double const* w = weights.data() + seg.edge(u, v, 0);
+                sum += label_exp_sum(w, nlabels, alpha[u] - max);
+            }
+
+            alpha[v] = max + std::log(sum);
+        }
+
+        return alpha;
+    }
+
+    std::vector<double> segment_backward_log_sum(fst const& f,
+        std::vector<double> const& weights)
+    {
+        double inf = std::numeric_limits<double>::infinity();
+
+        segment_data const& seg = *f.data->segments;
+        int n = f.data->vertices.size();
+        int nlabels = seg.labels.size();
+
+        std::vector<double> beta;
+        beta.resize(n, -inf);
+
+        for (auto& i: f.finals()) {
+            beta[i] = 0;
+        }
+
+        for (int u = n - 1; u >= 0; --u) {
+            double max = beta[u];
+
+            for (int v = seg.first_head[u]; v < seg.last_head[u]; ++v) {
+                if (beta[v] == -inf) {
+                    continue;
+                }
+
+                double const* w = weights.data() + seg.edge(u, v, 0);
+                max = std::max(max, beta[v] + label_max(w, nlabels));
+            }
+
+            if (max == -inf) {
+                continue;
+            }
+
+            double sum = std::exp(beta[u] - max);
+
+            for (int v = seg.first_head[u]; v < seg.last_head[u]; ++v) {
+                if (beta[v] == -inf) {
+                    continue;
+                }
+
+                double const* w = weights.data() + seg.edge(u, v, 0);
+                sum += label_exp_sum(w, nlabels, beta[v] - max);
+            }
+
+            beta[u] = max + std::log(sum);
+        }
+
+        return beta;
+    }
+
+    std::vector<int> segment_best_path(fst const& f,
+        std::vector<double> const& weights)
+    {
+        double inf = std::numeric_limits<double>::infinity();
+
+        segment_data const& seg = *f.data->segments;
+        int n = f.data->vertices.size();
+        int nlabels = seg.labels.size();
+
+        std::vector<double> value;
+        value.resize(n, -inf);
+        std::vector<int> pi;
+        pi.resize(n, -1);
+
+        for (auto& i: f.initials()) {
+            value[i] = 0;
+        }
+
+        for (int v = 0; v < n; ++v) {
+            for (int u = seg.first_tail[v]; u < seg.last_tail[v]; ++u) {
+                if (value[u] == -inf) {
+                    continue;
+                }
+
+                int base = seg.edge(u, v, 0);
+                double const* w = weights.data() + base;
+                double m = label_max(w, nlabels);
+
+                if (value[u] + m > value[v]) {
+                    value[v] = value[u] + m;
+                    pi[v] = base + (std::find(w, w + nlabels, m) - w);
+                }
+            }
+        }
+
+        double max = -inf;
+        int argmax = -1;
+
+        for (auto& v: f.finals()) {
+            if (value[v] > max) {
+                max = value[v];
+                argmax = v;
+            }
+        }
+
+        std::vector<int> result;
+
+        if (argmax == -1) {
+            return result;
+        }
+
+        for (int v = argmax; pi[v] != -1; v = seg.tail(pi[v])) {
+            result.push_back(pi[v]);
+        }
+
+        std::reverse(result.begin(), result.end());
+
+        return result;
+    }
+
     std::vector<int> const& fst::vertices() const
     {
+        if (data->mapped != nullptr) {
+            mapped_data& m = *data->mapped;
+
+            std::call_once(m.vertices_once, [&]() {
+                data->vertex_indices.resize(m.vertices);
+
+                for (int v = 0; v < m.vertices; ++v) {
+                    data->vertex_indices[v] = v;
+                }
+            });
+        }
+
         return data->vertex_indices;
     }
 
     std::vector<int> const& fst::edges() const
     {
+        if (data->mapped != nullptr) {
+            mapped_data& m = *data->mapped;
+
+            std::call_once(m.edges_once, [&]() {
+                data->edge_indices.resize(m.edges);
+
+                for (int e = 0; e < m.edges; ++e) {
+                    data->edge_indices[e] = e;
+                }
+            });
+        }
+
+        if (data->segments != nullptr) {
+            segment_data& seg = *data->segments;
+
+            std::call_once(seg.edges_once, [&]() {
+                seg.edge_indices.resize(seg.edges());
+
+                for (int e = 0; e < seg.edges(); ++e) {
+                    seg.edge_indices[e] = e;
+                }
+            });
+
+            return seg.edge_indices;
+        }
+
         return data->edge_indices;
     }
 
     double fst::weight(int e) const
     {
+        if (data->segments != nullptr) {
+            return 0;
+        }
+
+        if (data->mapped != nullptr) {
+            return data->mapped->weight[e];
+        }
+
+        if (data->frozen != nullptr) {
+            return data->frozen->weight[e];
+        }
+
         return data->edges.at(e).weight;
     }
 
     std::vector<int> const& fst::in_edges(int v) const
     {
+        if (data->mapped != nullptr) {
+            mapped_data& m = *data->mapped;
+
+            return m.in_edges.get(v, [&](int u) {
+                return std::vector<int> { m.in_edge + m.in_begin[u], m.in_edge + m.in_begin[u + 1] };
+            });
+        }
+
+        if (data->frozen != nullptr) {
+            return data->frozen->in_edges.get(v, [&](int u) {
+                edge_range r = in_edge_range(u);
+                return std::vector<int> { r.begin(), r.end() };
+            });
+        }
+
+        if (data->segments != nullptr) {
+            segment_data& seg = *data->segments;
+
+            std::call_once(seg.in_edges_once[v], [&]() {
+                auto& edges = seg.in_edges[v];
+
+                for (int u = seg.first_tail[v]; u < seg.last_tail[v]; ++u) {
+                    for (int k = 0; k < seg.labels.size(); ++k) {
+                        edges.push_back(seg.edge(u, v, k));
+                    }
+                }
+            });
+
+            return seg.in_edges[v];
+        }
+
         return data->in_edges.at(v);
     }
 
     std::vector<int> const& fst::out_edges(int v) const
     {
+        if (data->mapped != nullptr) {
+            mapped_data& m = *data->mapped;
+
+            return m.out_edges.get(v, [&](int u) {
+                std::vector<int> edges;
+
+                for (int e = m.out_begin[u]; e < m.out_begin[u + 1]; ++e) {
+                    edges.push_back(e);
+                }
+
+                return edges;
+            });
+        }
+
+        if (data->frozen != nullptr) {
+            return data->frozen->out_edges.get(v, [&](int u) {
+                edge_range r = out_edge_range(u);
+                return std::vector<int> { r.begin(), r.end() };
+            });
+        }
+
+        if (data->segments != nullptr) {
+            segment_data& seg = *data->segments;
+
+            std::call_once(seg.out_edges_once[v], [&]() {
+                auto& edges = seg.out_edges[v];
+
+                for (int e = seg.out_begin[v]; e < seg.out_begin[v + 1]; ++e) {
+                    edges.push_back(e);
+                }
+            });
+
+            return seg.out_edges[v];
+        }
+
         return data->out_edges.at(v);
     }
 
     std::unordered_map<int, std::vector<int>> const& fst::in_edges_map(int v) const
     {
+        if (data->mapped != nullptr) {
+            mapped_data& m = *data->mapped;
+
+            return m.in_edges_map.get(v, [&](int u) {
+                std::unordered_map<int, std::vector<int>> edge_map;
+
+                for (auto& e: in_edges(u)) {
+                    edge_map[m.input[e]].push_back(e);
+                }
+
+                return edge_map;
+            });
+        }
+
+        if (data->frozen != nullptr) {
+            frozen_data& z = *data->frozen;
+
+            return z.in_edges_map.get(v, [&](int u) {
+                std::unordered_map<int, std::vector<int>> edge_map;
+
+                for (auto& e: in_edge_range(u)) {
+                    edge_map[z.input[e]].push_back(e);
+                }
+
+                return edge_map;
+            });
+        }
+
+        if (data->segments != nullptr) {
+            segment_data& seg = *data->segments;
+
+            std::call_once(seg.in_edges_map_once[v], [&]() {
+                auto& edge_map = seg.in_edges_map[v];
+
+                for (auto& e: in_edges(v)) {
+                    edge_map[seg.label(e)].push_back(e);
+                }
+            });
+
+            return seg.in_edges_map[v];
+        }
+
         return data->in_edges_map.at(v);
     }
 
     std::unordered_map<int, std::vector<int>> const& fst::out_edges_map(int v) const
     {
+        if (data->mapped != nullptr) {
+            mapped_data& m = *data->mapped;
+
+            return m.out_edges_map.get(v, [&](int u) {
+                std::unordered_map<int, std::vector<int>> edge_map;
+
+                for (int e = m.out_begin[u]; e < m.out_begin[u + 1]; ++e) {
+                    edge_map[m.input[e]].push_back(e);
+                }
+
+                return edge_map;
+            });
+        }
+
+        if (data->frozen != nullptr) {
+            frozen_data& z = *data->frozen;
+
+            return z.out_edges_map.get(v, [&](int u) {
+                std::unordered_map<int, std::vector<int>> edge_map;
+
+                for (auto& e: out_edge_range(u)) {
+                    edge_map[z.input[e]].push_back(e);
+                }
+
+                return edge_map;
+            });
+        }
+
+        if (data->segments != nullptr) {
+            segment_data& seg = *data->segments;
+
+            std::call_once(seg.out_edges_map_once[v], [&]() {
+                auto& edge_map = seg.out_edges_map[v];
+
+                for (auto& e: out_edges(v)) {
+                    edge_map[seg.label(e)].push_back(e);
+                }
+            });
+
+            return seg.out_edges_map[v];
+        }
+
         return data->out_edges_map.at(v);
     }
 
+    int fst::out_edge(int v, int symbol) const
+    {
+        if (data->mapped != nullptr) {
+            return data->mapped->find(v, symbol);
+        }
+
+        if (data->frozen != nullptr) {
+            return data->frozen->find(v, symbol);
+        }
+
+        auto& edge_map = out_edges_map(v);
+        auto i = edge_map.find(symbol);
+
+        return (i == edge_map.end() || i->second.size() == 0) ? -1 : i->second.front();
+    }
+
+    edge_range fst::in_edge_range(int v) const
+    {
+        if (data->frozen != nullptr) {
+            frozen_data const& z = *data->frozen;
+            return edge_range { z.in_edge.data() + z.in_begin[v], z.in_edge.data() + z.in_begin[v + 1] };
+        }
+
+        if (data->mapped != nullptr) {
+            mapped_data const& m = *data->mapped;
+            return edge_range { m.in_edge + m.in_begin[v], m.in_edge + m.in_begin[v + 1] };
+        }
+
+        auto& edges = in_edges(v);
+        return edge_range { edges.data(), edges.data() + edges.size() };
+    }
+
+    edge_range fst::out_edge_range(int v) const
+    {
+        if (data->frozen != nullptr) {
+            frozen_data const& z = *data->frozen;
+            return edge_range { z.out_edge.data() + z.out_begin[v], z.out_edge.data() + z.out_begin[v + 1] };
+        }
+
+        auto& edges = out_edges(v);
+        return edge_range { edges.data(), edges.data() + edges.size() };
+    }
+
     int fst::tail(int e) const
     {
+        if (data->segments != nullptr) {
+            return data->segments->tail(e);
+        }
+
+        if (data->mapped != nullptr) {
+            return data->mapped->tail[e];
+        }
+
+        if (data->frozen != nullptr) {
+            return data->frozen->tail[e];
+        }
+
         return data->edges.at(e).tail;
     }
 
     int fst::head(int e) const
     {
+        if (data->segments != nullptr) {
+            return data->segments->head(e);
+        }
+
+        if (data->mapped != nullptr) {
+            return data->mapped->head[e];
+        }
+
+        if (data->frozen != nullptr) {
+            return data->frozen->head[e];
+        }
+
         return data->edges.at(e).head;
     }
 
@@ -119,19 +699,83 @@ namespace ilat {
 
     int const& fst::input(int e) const
     {
+        if (data->segments != nullptr) {
+            return data->segments->label(e);
+        }
+
+        if (data->mapped != nullptr) {
+            return data->mapped->input[e];
+        }
+
+        if (data->frozen != nullptr) {
+            return data->frozen->input[e];
+        }
+
         return data->edges.at(e).input;
     }
 
     int const& fst::output(int e) const
     {
+        if (data->segments != nullptr) {
+            return data->segments->label(e);
+        }
+
+        if (data->mapped != nullptr) {
+            return data->mapped->output[e];
+        }
+
+        if (data->frozen != nullptr) {
+            return data->frozen->output[e];
+        }
+
         return data->edges.at(e).output;
     }
 
     long fst::time(int v) const
     {
+        if (data->mapped != nullptr) {
+            return data->mapped->time[v];
+        }
+
+        if (data->frozen != nullptr) {
+            return data->frozen->time[v];
+        }
+
         return data->vertices.at(v).time;
     }
 
+    int fst::feat_size(int e) const
+    {
+        if (data->mapped != nullptr) {
+            return data->mapped->feat_dim;
+        }
+
+        if (data->frozen != nullptr) {
+            return data->frozen->feat_begin[e + 1] - data->frozen->feat_begin[e];
+        }
+
+        if (data->segments != nullptr) {
+            return 0;
+        }
+
+        return data->feats.at(e).size();
+    }
+
+    double fst::feat(int e, int i) const
+    {
+        if (data->mapped != nullptr) {
+            assert(i < data->mapped->feat_dim);
+            return data->mapped->feat[e * data->mapped->feat_dim + i];
+        }
+
+        if (data->frozen != nullptr) {
+            assert(i < feat_size(e));
+            return data->frozen->feat[data->frozen->feat_begin[e] + i];
+        }
+
+        return data->feats.at(e).at(i);
+    }
+
     fst load_lattice(std::istream& is, std::unordered_map<std::string, int> const& symbol_id)
     {
         fst_data result;
@@ -291,12 +935,20 @@ namespace ilat {
         }
 
         for (auto& v: data.vertex_indices) {
-            data.vertex_attrs[v] = f.data->vertex_attrs[v];
+            if (v < f.data->vertex_attrs.size()) {
+                data.vertex_attrs[v] = f.data->vertex_attrs[v];
+            }
         }
 
         for (auto& e: data.edge_indices) {
-            data.edge_attrs[e] = f.data->edge_attrs[e];
-            data.feats[e] = f.data->feats[e];
+            if (e < f.data->edge_attrs.size()) {
+                data.edge_attrs[e] = f.data->edge_attrs[e];
+                data.feats[e] = f.data->feats[e];
+            } else {
+                for (int i = 0; i < f.feat_size(e); ++i) {
+                    data.feats[e].push_back(f.feat(e, i));
+                }
+            }
         }
 
         fst result;
@@ -417,118 +1069,626 @@ namespace ilat {
         return f;
     }
 
+    namespace {
+
+        struct mapped_header {
+            char magic[8];
+            int64_t vertices;
+            int64_t edges;
+            int64_t symbols;
+            int64_t initials;
+            int64_t finals;
+            int64_t feat_dim;
+        };
+
+        char const mapped_magic[8] = { 'i', 'l', 'a', 't', 'f', 's', 't', '1' };
+        char const archive_magic[8] = { 'i', 'l', 'a', 't', 'a', 'r', 'c', '1' };
+
+        template <class T>
+        int64_t write_array(std::ostream& os, std::vector<T> const& v)
+        {
+            os.write(reinterpret_cast<char const*>(v.data()), v.size() * sizeof(T));
+
+            return v.size() * sizeof(T);
+        }
+
+        size_t mapped_size(mapped_header const& h)
+        {
+            return sizeof(h) + h.edges * sizeof(double)
+                + (3 * h.vertices + 2) * sizeof(int64_t)
+                + h.edges * h.feat_dim * sizeof(float)
+                + (5 * h.edges + h.initials + h.finals) * sizeof(int);
+        }
+
+        // Returns the number of bytes written.
+        int64_t write_image(std::ostream& os, fst const& f)
+        {
+            int n = f.vertices().size();
+
+            int max_edge = -1;
+            for (auto& e: f.edges()) {
+                max_edge = std::max(max_edge, e);
+            }
+
+            std::vector<int> old_id;
+            std::vector<int> new_id;
+            new_id.resize(max_edge + 1, -1);
+
+            std::vector<int64_t> out_begin;
+            out_begin.push_back(0);
+
+            for (int u = 0; u < n; ++u) {
+                edge_range r = f.out_edge_range(u);
+                std::vector<int> edges { r.begin(), r.end() };
+
+                std::stable_sort(edges.begin(), edges.end(),
+                    [&](int e1, int e2) { return f.input(e1) < f.input(e2); });
+
+                for (auto& e: edges) {
+                    new_id[e] = old_id.size();
+                    old_id.push_back(e);
+                }
+
+                out_begin.push_back(old_id.size());
+            }
+
+            int m = old_id.size();
+            int feat_dim = (m == 0 ? 0 : f.feat_size(old_id.front()));
+
+            std::vector<double> weight;
+            std::vector<float> feat;
+            std::vector<int> tail;
+            std::vector<int> head;
+            std::vector<int> input;
+            std::vector<int> output;
+
+            for (auto& e: old_id) {
+                weight.push_back(f.weight(e));
+                tail.push_back(f.tail(e));
+                head.push_back(f.head(e));
+                input.push_back(f.input(e));
+                output.push_back(f.output(e));
+
+                if (f.feat_size(e) != feat_dim) {
+                    std::cerr << f.data->name << ": edges have " << feat_dim
+                        << " and " << f.feat_size(e) << " features" << std::endl;
+                    exit(1);
+                }
+
+                for (int i = 0; i < feat_dim; ++i) {
+                    feat.push_back(f.feat(e, i));
+                }
+            }
+
+            std::vector<int64_t> time;
+            for (int v = 0; v < n; ++v) {
+                time.push_back(f.time(v));
+            }
+
+            std::vector<int64_t> in_begin;
+            in_begin.resize(n + 1, 0);
+
+            for (int e = 0; e < m; ++e) {
+                ++in_begin[head[e] + 1];
+            }
+
+            for (int v = 0; v < n; ++v) {
+                in_begin[v + 1] += in_begin[v];
+            }
+
+            std::vector<int> in_edge;
+            in_edge.resize(m);
+
+            std::vector<int64_t> fill { in_begin.begin(), in_begin.end() - 1 };
+
+            for (int e = 0; e < m; ++e) {
+                in_edge[fill[head[e]]++] = e;
+            }
+
+            mapped_header h;
+            std::memcpy(h.magic, mapped_magic, sizeof(h.magic));
+            h.vertices = n;
+            h.edges = m;
+            h.symbols = f.data->symbol_id == nullptr ? 0 : f.data->symbol_id->size();
+            h.initials = f.initials().size();
+            h.finals = f.finals().size();
+            h.feat_dim = feat_dim;
+
+            os.write(reinterpret_cast<char const*>(&h), sizeof(h));
+
+            int64_t size = sizeof(h);
+
+            size += write_array(os, weight);
+            size += write_array(os, out_begin);
+            size += write_array(os, in_begin);
+            size += write_array(os, time);
+            size += write_array(os, feat);
+            size += write_array(os, in_edge);
+            size += write_array(os, tail);
+            size += write_array(os, head);
+            size += write_array(os, input);
+            size += write_array(os, output);
+            size += write_array(os, f.initials());
+            size += write_array(os, f.finals());
+
+            return size;
+        }
+
+        // `image` points to `size` bytes written by `write_image` inside `region`.
+        fst read_image(std::shared_ptr<void const> region, char const* image, size_t size,
+            std::shared_ptr<std::unordered_map<std::string, int>> symbol_id,
+            std::shared_ptr<std::vector<std::string>> id_symbol,
+            std::string const& name)
+        {
+            mapped_header const& h = *reinterpret_cast<mapped_header const*>(image);
+
+            if (size < sizeof(h) || std::memcmp(h.magic, mapped_magic, sizeof(h.magic)) != 0) {
+                std::cerr << name << " is not a mapped fst" << std::endl;
+                exit(1);
+            }
+
+            if (size != mapped_size(h)) {
+                std::cerr << name << " is truncated" << std::endl;
+                exit(1);
+            }
+
+            if (symbol_id != nullptr && h.symbols != symbol_id->size()) {
+                std::cerr << name << " was written with " << h.symbols
+                    << " symbols, but " << symbol_id->size() << " are given" << std::endl;
+                exit(1);
+            }
+
+            auto m = std::make_shared<mapped_data>();
+            m->region = region;
+            m->vertices = h.vertices;
+            m->edges = h.edges;
+            m->feat_dim = h.feat_dim;
+
+            char const* ptr = image + sizeof(h);
+
+            m->weight = reinterpret_cast<double const*>(ptr);
+            ptr += h.edges * sizeof(double);
+            m->out_begin = reinterpret_cast<int64_t const*>(ptr);
+            ptr += (h.vertices + 1) * sizeof(int64_t);
+            m->in_begin = reinterpret_cast<int64_t const*>(ptr);
+            ptr += (h.vertices + 1) * sizeof(int64_t);
+            m->time = reinterpret_cast<int64_t const*>(ptr);
+            ptr += h.vertices * sizeof(int64_t);
+            m->feat = reinterpret_cast<float const*>(ptr);
+            ptr += h.edges * h.feat_dim * sizeof(float);
+
+            int const* q = reinterpret_cast<int const*>(ptr);
+
+            m->in_edge = q;
+            m->tail = q + h.edges;
+            m->head = q + 2 * h.edges;
+            m->input = q + 3 * h.edges;
+            m->output = q + 4 * h.edges;
+
+            q += 5 * h.edges;
+
+            fst_data result;
+
+            result.name = name;
+            result.symbol_id = symbol_id;
+            result.id_symbol = id_symbol;
+
+            result.initials = std::vector<int> { q, q + h.initials };
+            q += h.initials;
+            result.finals = std::vector<int> { q, q + h.finals };
+
+            result.mapped = m;
+
+            fst f;
+            f.data = std::make_shared<fst_data>(std::move(result));
+
+            return f;
+        }
+
+        std::shared_ptr<void const> map_file(std::string filename, size_t& size)
+        {
+            int fd = open(filename.c_str(), O_RDONLY);
+
+            if (fd == -1) {
+                std::cerr << "unable to open " << filename << std::endl;
+                exit(1);
+            }
+
+            struct stat st;
+            fstat(fd, &st);
+            size = st.st_size;
+
+            void* base = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+            close(fd);
+
+            if (base == MAP_FAILED) {
+                std::cerr << "unable to map " << filename << std::endl;
+                exit(1);
+            }
+
+            return std::shared_ptr<void const>(base,
+                [size](void const* p) { munmap(const_cast<void*>(p), size); });
+        }
+
+        std::shared_ptr<std::vector<std::string>> make_id_symbol(
+            std::unordered_map<std::string, int> const& symbol_id)
+        {
+            std::vector<std::string> id_symbol;
+            id_symbol.resize(symbol_id.size());
+            for (auto& p: symbol_id) {
+                id_symbol[p.second] = p.first;
+            }
+
+            return std::make_shared<std::vector<std::string>>(std::move(id_symbol));
+        }
+
+    }
+
+    void write_mapped_fst(std::ostream& os, fst const& f)
+    {
+        write_image(os, f);
+    }
+
+    fst load_mapped_fst(std::string filename,
+        std::unordered_map<std::string, int> const& symbol_id)
+    {
+        size_t size;
+        std::shared_ptr<void const> region = map_file(filename, size);
+
+        return read_image(region, static_cast<char const*>(region.get()), size,
+            std::make_shared<std::unordered_map<std::string, int>>(symbol_id),
+            make_id_symbol(symbol_id), filename);
+    }
+
     fst load_arpa_lm(std::string filename,
         std::unordered_map<std::string, int> const& symbol_id)
     {
-        std::ifstream ifs { filename };
+        std::ifstream ifs { filename, std::ios::binary };
+
+        char magic[sizeof(mapped_magic)] = {};
+        ifs.read(magic, sizeof(magic));
+
+        if (ifs && std::memcmp(magic, mapped_magic, sizeof(magic)) == 0) {
+            return load_mapped_fst(filename, symbol_id);
+        }
+
+        ifs.clear();
+        ifs.seekg(0);
+
         return load_arpa_lm(ifs, symbol_id);
     }
 
-    lazy_pair_mode1::lazy_pair_mode1(ilat::fst fst1, ilat::fst fst2)
-        : fst1_(fst1), fst2_(fst2)
-        , vertices_cache(nullptr), edges_cache(nullptr)
-        , initials_cache(nullptr), finals_cache(nullptr)
-        , in_edges_vertex(nullptr), in_edges_cache(nullptr)
-        , out_edges_vertex(nullptr), out_edges_cache(nullptr)
+    void compile_arpa_lm(std::string arpa_file, std::string output_file,
+        std::unordered_map<std::string, int> const& symbol_id)
     {
+        fst lm = load_arpa_lm(arpa_file, symbol_id);
+
+        std::ofstream ofs { output_file, std::ios::binary };
+        write_mapped_fst(ofs, lm);
     }
 
-    std::vector<lazy_pair_mode1::vertex> const& lazy_pair_mode1::vertices() const
+    fst freeze(fst const& f)
     {
-        if (vertices_cache == nullptr) {
-            std::vector<std::tuple<int, int>> result;
-            for (int u: fst1_.vertices()) {
-                for (int v: fst2_.vertices()) {
-                    result.push_back(std::make_tuple(u, v));
-                }
+        auto z = std::make_shared<frozen_data>();
+
+        auto const& vertices = f.vertices();
+        auto const& edges = f.edges();
+
+        int n = 0;
+        for (auto& v: vertices) {
+            n = std::max(n, v + 1);
+        }
+
+        int m = 0;
+        for (auto& e: edges) {
+            m = std::max(m, e + 1);
+        }
+
+        z->time.resize(n);
+        for (auto& v: vertices) {
+            z->time[v] = f.time(v);
+        }
+
+        z->weight.resize(m);
+        z->tail.resize(m, -1);
+        z->head.resize(m, -1);
+        z->input.resize(m);
+        z->output.resize(m);
+        z->feat_begin.resize(m + 1, 0);
+
+        for (auto& e: edges) {
+            z->weight[e] = f.weight(e);
+            z->tail[e] = f.tail(e);
+            z->head[e] = f.head(e);
+            z->input[e] = f.input(e);
+            z->output[e] = f.output(e);
+            z->feat_begin[e + 1] = f.feat_size(e);
+        }
+
+        for (int e = 0; e < m; ++e) {
+            z->feat_begin[e + 1] += z->feat_begin[e];
+        }
+
+        z->feat.resize(z->feat_begin[m]);
+
+        for (auto& e: edges) {
+            for (int i = 0; i < z->feat_begin[e + 1] - z->feat_begin[e]; ++i) {
+                z->feat[z->feat_begin[e] + i] = f.feat(e, i);
             }
+        }
 
-            vertices_cache = std::make_shared<std::vector<std::tuple<int, int>>>(
-                std::move(result));
+        // Counting sorts on tails and heads, in the order of `edges`,
+        // so the adjacency keeps the order of the lists of `f`.
+
+        z->out_begin.resize(n + 1, 0);
+        z->in_begin.resize(n + 1, 0);
+
+        for (auto& e: edges) {
+            ++z->out_begin[z->tail[e] + 1];
+            ++z->in_begin[z->head[e] + 1];
         }
 
-        return *vertices_cache;
+        for (int v = 0; v < n; ++v) {
+            z->out_begin[v + 1] += z->out_begin[v];
+            z->in_begin[v + 1] += z->in_begin[v];
+        }
+
+        z->out_edge.resize(edges.size());
+        z->in_edge.resize(edges.size());
+
+        std::vector<int> out_fill { z->out_begin.begin(), z->out_begin.end() - 1 };
+        std::vector<int> in_fill { z->in_begin.begin(), z->in_begin.end() - 1 };
+
+        for (auto& e: edges) {
+            z->out_edge[out_fill[z->tail[e]]++] = e;
+            z->in_edge[in_fill[z->head[e]]++] = e;
+        }
+
+        for (int u = 0; u < n; ++u) {
+            std::stable_sort(z->out_edge.begin() + z->out_begin[u],
+                z->out_edge.begin() + z->out_begin[u + 1],
+                [&](int e1, int e2) { return z->input[e1] < z->input[e2]; });
+        }
+
+        fst_data result;
+
+        result.name = f.data->name;
+        result.symbol_id = f.data->symbol_id;
+        result.id_symbol = f.data->id_symbol;
+        result.initials = f.initials();
+        result.finals = f.finals();
+        result.vertex_indices = vertices;
+        result.edge_indices = edges;
+        result.frozen = z;
+
+        fst frozen;
+        frozen.data = std::make_shared<fst_data>(std::move(result));
+
+        return frozen;
     }
 
-    std::vector<lazy_pair_mode1::edge> const& lazy_pair_mode1::edges() const
+    fst lattice_archive::at(int i) const
     {
-        if (edges_cache == nullptr) {
-            std::vector<std::tuple<int, int>> result;
+        return read_image(region, static_cast<char const*>(region.get()) + offsets.at(i),
+            sizes.at(i), symbol_id, id_symbol, names.at(i));
+    }
 
-            for (int e1: fst1_.edges()) {
-                for (int e2: fst2_.edges()) {
-                    if (fst1_.output(e1) == fst2_.input(e2)) {
-                        result.push_back(std::make_tuple(e1, e2));
-                    }
-                }
-            }
+    fst lattice_archive::at(std::string const& name) const
+    {
+        auto i = name_index.find(name);
 
-            edges_cache = std::make_shared<std::vector<std::tuple<int, int>>>(
-                std::move(result));
+        if (i == name_index.end()) {
+            std::cerr << "lattice " << name << " not found" << std::endl;
+            exit(1);
         }
 
-        return *edges_cache;
+        return at(i->second);
     }
 
-    double lazy_pair_mode1::weight(lazy_pair_mode1::edge e) const
+    lattice_archive load_lattice_archive(std::string filename,
+        std::unordered_map<std::string, int> const& symbol_id)
     {
-        return fst1_.weight(std::get<0>(e)) + fst2_.weight(std::get<1>(e));
+        lattice_archive result;
+
+        result.region = map_file(filename, result.size);
+        result.symbol_id = std::make_shared<std::unordered_map<std::string, int>>(symbol_id);
+        result.id_symbol = make_id_symbol(symbol_id);
+
+        char const* base = static_cast<char const*>(result.region.get());
+
+        // The file starts with the magic and ends with the number of
+        // lattices and the offset of the index.
+
+        if (result.size < sizeof(archive_magic) + 2 * sizeof(int64_t)
+                || std::memcmp(base, archive_magic, sizeof(archive_magic)) != 0) {
+            std::cerr << filename << " is not a lattice archive" << std::endl;
+            exit(1);
+        }
+
+        int64_t const* trailer = reinterpret_cast<int64_t const*>(
+            base + result.size - 2 * sizeof(int64_t));
+
+        int64_t count = trailer[0];
+        char const* ptr = base + trailer[1];
+
+        for (int i = 0; i < count; ++i) {
+            int64_t const* entry = reinterpret_cast<int64_t const*>(ptr);
+
+            result.offsets.push_back(entry[0]);
+            result.sizes.push_back(entry[1]);
+            result.names.push_back(std::string { ptr + 3 * sizeof(int64_t), size_t(entry[2]) });
+            result.name_index[result.names.back()] = i;
+
+            // Entries are padded to 8 bytes.
+            ptr += 3 * sizeof(int64_t) + (entry[2] + 7) / 8 * 8;
+        }
+
+        return result;
     }
 
-    std::vector<lazy_pair_mode1::edge> const& lazy_pair_mode1::in_edges(lazy_pair_mode1::vertex v) const
+    void compile_lattice_archive(std::string lattice_file, std::string output_file,
+        std::unordered_map<std::string, int> const& symbol_id)
     {
-        if (in_edges_vertex == nullptr || *in_edges_vertex != v) {
-            in_edges_vertex = std::make_shared<std::tuple<int, int>>(v);
+        std::ifstream ifs { lattice_file };
+        std::ofstream ofs { output_file, std::ios::binary };
 
-            std::vector<std::tuple<int, int>> result;
+        std::vector<std::string> names;
+        std::vector<int64_t> offsets;
+        std::vector<int64_t> sizes;
 
-            for (int e1: fst1_.in_edges(std::get<0>(v))) {
-                auto& edge_map = fst2_.in_edges_map(std::get<1>(v));
+        char const zeros[8] = {};
 
-                // FIXME: assumes edge_map is indexed by output symbols but it's actually indexed by input symbols.
+        ofs.write(archive_magic, sizeof(archive_magic));
+        int64_t pos = sizeof(archive_magic);
 
-                if (edge_map.size() == 0 || !ebt::in(fst1_.output(e1), edge_map)) {
-                    continue;
+        while (1) {
+            fst f = load_lattice(ifs, symbol_id);
+
+            if (f.data->name == "") {
+                break;
+            }
+
+            int64_t size = write_image(ofs, f);
+
+            names.push_back(f.data->name);
+            offsets.push_back(pos);
+            sizes.push_back(size);
+
+            // Images are padded to 8 bytes, so that every one is aligned.
+            int64_t pad = (8 - size % 8) % 8;
+            ofs.write(zeros, pad);
+            pos += size + pad;
+        }
+
+        int64_t index_offset = pos;
+
+        for (int i = 0; i < names.size(); ++i) {
+            int64_t entry[3] = { offsets[i], sizes[i], int64_t(names[i].size()) };
+            ofs.write(reinterpret_cast<char const*>(entry), sizeof(entry));
+            ofs.write(names[i].data(), names[i].size());
+            ofs.write(zeros, (8 - names[i].size() % 8) % 8);
+        }
+
+        int64_t trailer[2] = { int64_t(names.size()), index_offset };
+        ofs.write(reinterpret_cast<char const*>(trailer), sizeof(trailer));
+    }
+
+    namespace {
+
+        template <class composition, class fst, class expand_func>
+        void compose_reachable(composition& comp, fst const& f,
+            expand_func expand)
+        {
+            auto index = [&](typename fst::vertex const& v) {
+                auto i = comp.vertex_index.find(v);
+
+                if (i != comp.vertex_index.end()) {
+                    return i->second;
                 }
 
-                for (auto& e2: edge_map.at(fst1_.output(e1))) {
-                    result.push_back(std::make_tuple(e1, e2));
+                int id = comp.vertices.size();
+                comp.vertex_index[v] = id;
+                comp.vertices.push_back(v);
+                comp.in_edges.push_back(std::vector<typename fst::edge>{});
+                comp.out_edges.push_back(std::vector<typename fst::edge>{});
+
+                return id;
+            };
+
+            for (auto& v: f.initials()) {
+                index(v);
+            }
+
+            // `comp.vertices` grows as new pairs are found, so this is
+            // a breadth-first search from the initial pairs.
+
+            for (int i = 0; i < comp.vertices.size(); ++i) {
+                for (auto& e: expand(comp.vertices[i])) {
+                    int h = index(f.head(e));
+
+                    comp.edges.push_back(e);
+                    comp.out_edges[i].push_back(e);
+                    comp.in_edges[h].push_back(e);
                 }
             }
+        }
 
-            in_edges_cache = std::make_shared<std::vector<std::tuple<int, int>>>(
-                std::move(result));
+    }
+
+    lazy_pair_mode1::lazy_pair_mode1(ilat::fst fst1, ilat::fst fst2)
+        : fst1_(fst1), fst2_(fst2)
+        , initials_cache(nullptr), finals_cache(nullptr)
+        , composition(std::make_shared<pair_composition>())
+    {
+        // Filled here so that the accessors only read afterwards.
+        initials();
+        finals();
+    }
+
+    std::vector<lazy_pair_mode1::edge> lazy_pair_mode1::expand(lazy_pair_mode1::vertex v) const
+    {
+        std::vector<std::tuple<int, int>> result;
+
+        auto& edge_map = fst2_.out_edges_map(std::get<1>(v));
+
+        if (edge_map.size() == 0) {
+            return result;
+        }
+
+        for (int e1: fst1_.out_edge_range(std::get<0>(v))) {
+            auto i = edge_map.find(fst1_.output(e1));
+
+            if (i == edge_map.end()) {
+                continue;
+            }
+
+            for (auto& e2: i->second) {
+                result.push_back(std::make_tuple(e1, e2));
+            }
         }
 
-        return *in_edges_cache;
+        return result;
     }
 
-    std::vector<lazy_pair_mode1::edge> const& lazy_pair_mode1::out_edges(lazy_pair_mode1::vertex v) const
+    pair_composition const& lazy_pair_mode1::composed() const
     {
-        if (out_edges_vertex == nullptr || *out_edges_vertex != v) {
-            out_edges_vertex = std::make_shared<std::tuple<int, int>>(v);
+        std::call_once(composition->once, [&]() {
+            compose_reachable(*composition, *this,
+                [&](vertex const& v) { return expand(v); });
+        });
 
-            std::vector<std::tuple<int, int>> result;
+        return *composition;
+    }
 
-            for (int e1: fst1_.out_edges(std::get<0>(v))) {
-                auto& edge_map = fst2_.out_edges_map(std::get<1>(v));
+    std::vector<lazy_pair_mode1::vertex> const& lazy_pair_mode1::vertices() const
+    {
+        return composed().vertices;
+    }
 
-                // FIXME: assumes edge_map is indexed by output symbols but it's actually indexed by input symbols.
+    std::vector<lazy_pair_mode1::edge> const& lazy_pair_mode1::edges() const
+    {
+        return composed().edges;
+    }
 
-                if (edge_map.size() == 0 || !ebt::in(fst1_.output(e1), edge_map)) {
-                    continue;
-                }
+    double lazy_pair_mode1::weight(lazy_pair_mode1::edge e) const
+    {
+        return fst1_.weight(std::get<0>(e)) + fst2_.weight(std::get<1>(e));
+    }
+
+    std::vector<lazy_pair_mode1::edge> const& lazy_pair_mode1::in_edges(lazy_pair_mode1::vertex v) const
+    {
+        auto& comp = composed();
+        auto i = comp.vertex_index.find(v);
 
-                for (auto& e2: edge_map.at(fst1_.output(e1))) {
-                    result.push_back(std::make_tuple(e1, e2));
-                }
-            }
+        return i == comp.vertex_index.end() ? comp.empty : comp.in_edges[i->second];
+    }
 
-            out_edges_cache = std::make_shared<std::vector<std::tuple<int, int>>>(
-                std::move(result));
-        }
+    std::vector<lazy_pair_mode1::edge> const& lazy_pair_mode1::out_edges(lazy_pair_mode1::vertex v) const
+    {
+        auto& comp = composed();
+        auto i = comp.vertex_index.find(v);
 
-        return *out_edges_cache;
+        return i == comp.vertex_index.end() ? comp.empty : comp.out_edges[i->second];
     }
 
     lazy_pair_mode1::vertex lazy_pair_mode1::tail(lazy_pair_mode1::edge e) const
@@ -614,48 +1774,57 @@ namespace ilat {
 
     lazy_pair_mode2::lazy_pair_mode2(ilat::fst fst1, ilat::fst fst2)
         : fst1_(fst1), fst2_(fst2)
-        , vertices_cache(nullptr), edges_cache(nullptr)
         , initials_cache(nullptr), finals_cache(nullptr)
-        , in_edges_vertex(nullptr), in_edges_cache(nullptr)
-        , out_edges_vertex(nullptr), out_edges_cache(nullptr)
+        , composition(std::make_shared<pair_composition>())
     {
+        // Filled here so that the accessors only read afterwards.
+        initials();
+        finals();
     }
 
-    std::vector<lazy_pair_mode2::vertex> const& lazy_pair_mode2::vertices() const
+    std::vector<lazy_pair_mode2::edge> lazy_pair_mode2::expand(lazy_pair_mode2::vertex v) const
     {
-        if (vertices_cache == nullptr) {
-            std::vector<std::tuple<int, int>> result;
-            for (int u: fst1_.vertices()) {
-                for (int v: fst2_.vertices()) {
-                    result.push_back(std::make_tuple(u, v));
-                }
+        std::vector<std::tuple<int, int>> result;
+
+        auto& edge_map = fst1_.out_edges_map(std::get<0>(v));
+
+        if (edge_map.size() == 0) {
+            return result;
+        }
+
+        for (int e2: fst2_.out_edge_range(std::get<1>(v))) {
+            auto i = edge_map.find(fst2_.input(e2));
+
+            if (i == edge_map.end()) {
+                continue;
             }
 
-            vertices_cache = std::make_shared<std::vector<std::tuple<int, int>>>(
-                std::move(result));
+            for (auto& e1: i->second) {
+                result.push_back(std::make_tuple(e1, e2));
+            }
         }
 
-        return *vertices_cache;
+        return result;
     }
 
-    std::vector<lazy_pair_mode2::edge> const& lazy_pair_mode2::edges() const
+    pair_composition const& lazy_pair_mode2::composed() const
     {
-        if (edges_cache == nullptr) {
-            std::vector<std::tuple<int, int>> result;
+        std::call_once(composition->once, [&]() {
+            compose_reachable(*composition, *this,
+                [&](vertex const& v) { return expand(v); });
+        });
 
-            for (int e1: fst1_.edges()) {
-                for (int e2: fst2_.edges()) {
-                    if (fst1_.output(e1) == fst2_.input(e2)) {
-                        result.push_back(std::make_tuple(e1, e2));
-                    }
-                }
-            }
+        return *composition;
+    }
 
-            edges_cache = std::make_shared<std::vector<std::tuple<int, int>>>(
-                std::move(result));
-        }
+    std::vector<lazy_pair_mode2::vertex> const& lazy_pair_mode2::vertices() const
+    {
+        return composed().vertices;
+    }
 
-        return *edges_cache;
+    std::vector<lazy_pair_mode2::edge> const& lazy_pair_mode2::edges() const
+    {
+        return composed().edges;
     }
 
     double lazy_pair_mode2::weight(lazy_pair_mode2::edge e) const
@@ -665,56 +1834,18 @@ namespace ilat {
 
     std::vector<lazy_pair_mode2::edge> const& lazy_pair_mode2::in_edges(lazy_pair_mode2::vertex v) const
     {
-        if (in_edges_vertex == nullptr || *in_edges_vertex != v) {
-            in_edges_vertex = std::make_shared<std::tuple<int, int>>(v);
-
-            std::vector<std::tuple<int, int>> result;
-
-            auto& edge_map = fst1_.in_edges_map(std::get<0>(v));
-
-            for (int e2: fst2_.in_edges(std::get<1>(v))) {
-
-                if (edge_map.size() == 0 || !ebt::in(fst2_.input(e2), edge_map)) {
-                    continue;
-                }
-
-                for (auto& e1: edge_map.at(fst2_.input(e2))) {
-                    result.push_back(std::make_tuple(e1, e2));
-                }
-            }
+        auto& comp = composed();
+        auto i = comp.vertex_index.find(v);
 
-            in_edges_cache = std::make_shared<std::vector<std::tuple<int, int>>>(
-                std::move(result));
-        }
-
-        return *in_edges_cache;
+        return i == comp.vertex_index.end() ? comp.empty : comp.in_edges[i->second];
     }
 
     std::vector<lazy_pair_mode2::edge> const& lazy_pair_mode2::out_edges(lazy_pair_mode2::vertex v) const
     {
-        if (out_edges_vertex == nullptr || *out_edges_vertex != v) {
-            out_edges_vertex = std::make_shared<std::tuple<int, int>>(v);
-
-            std::vector<std::tuple<int, int>> result;
-
-            auto& edge_map = fst1_.out_edges_map(std::get<0>(v));
-
-            for (int e2: fst2_.out_edges(std::get<1>(v))) {
-
-                if (edge_map.size() == 0 || !ebt::in(fst2_.input(e2), edge_map)) {
-                    continue;
-                }
-
-                for (auto& e1: edge_map.at(fst2_.input(e2))) {
-                    result.push_back(std::make_tuple(e1, e2));
-                }
-            }
-
-            out_edges_cache = std::make_shared<std::vector<std::tuple<int, int>>>(
-                std::move(result));
-        }
+        auto& comp = composed();
+        auto i = comp.vertex_index.find(v);
 
-        return *out_edges_cache;
+        return i == comp.vertex_index.end() ? comp.empty : comp.out_edges[i->second];
     }
 
     lazy_pair_mode2::vertex lazy_pair_mode2::tail(lazy_pair_mode2::edge e) const
@@ -925,16 +2056,22 @@ namespace ilat {
 
     lazy_triple_mode2::lazy_triple_mode2(ilat::fst fst1, ilat::fst fst2, ilat::fst fst3)
         : fst1_(fst1), fst2_(fst2), fst3_(fst3)
-        , vertices_cache(nullptr), edges_cache(nullptr)
+        , vertices_cache(std::make_shared<std::vector<vertex>>())
+        , edges_cache(std::make_shared<std::vector<edge>>())
         , initials_cache(nullptr), finals_cache(nullptr)
-        , in_edges_vertex(nullptr), in_edges_cache(nullptr)
-        , out_edges_vertex(nullptr), out_edges_cache(nullptr)
+        , vertices_once(std::make_shared<std::once_flag>())
+        , edges_once(std::make_shared<std::once_flag>())
+        , in_edges_memo(std::make_shared<adjacency_memo<vertex, edge>>())
+        , out_edges_memo(std::make_shared<adjacency_memo<vertex, edge>>())
     {
+        // Filled here so that the accessors only read afterwards.
+        initials();
+        finals();
     }
 
     std::vector<lazy_triple_mode2::vertex> const& lazy_triple_mode2::vertices() const
     {
-        if (vertices_cache == nullptr) {
+        std::call_once(*vertices_once, [&]() {
             std::vector<std::tuple<int, int, int>> result;
             for (int u: fst1_.vertices()) {
                 for (int v: fst2_.vertices()) {
@@ -944,16 +2081,15 @@ namespace ilat {
                 }
             }
 
-            vertices_cache = std::make_shared<std::vector<std::tuple<int, int, int>>>(
-                std::move(result));
-        }
+            *vertices_cache = std::move(result);
+        });
 
         return *vertices_cache;
     }
 
     std::vector<lazy_triple_mode2::edge> const& lazy_triple_mode2::edges() const
     {
-        if (edges_cache == nullptr) {
+        std::call_once(*edges_once, [&]() {
             std::vector<std::tuple<int, int, int>> result;
 
             for (int e1: fst1_.edges()) {
@@ -967,9 +2103,8 @@ namespace ilat {
                 }
             }
 
-            edges_cache = std::make_shared<std::vector<std::tuple<int, int, int>>>(
-                std::move(result));
-        }
+            *edges_cache = std::move(result);
+        });
 
         return *edges_cache;
     }
@@ -982,70 +2117,66 @@ namespace ilat {
 
     std::vector<lazy_triple_mode2::edge> const& lazy_triple_mode2::in_edges(lazy_triple_mode2::vertex v) const
     {
-        if (in_edges_vertex == nullptr || *in_edges_vertex != v) {
-            in_edges_vertex = std::make_shared<std::tuple<int, int, int>>(v);
+        return in_edges_memo->get(v, [&](vertex const& u) { return expand_in(u); });
+    }
 
-            std::vector<std::tuple<int, int, int>> result;
+    std::vector<lazy_triple_mode2::edge> lazy_triple_mode2::expand_in(lazy_triple_mode2::vertex v) const
+    {
+        std::vector<std::tuple<int, int, int>> result;
 
-            auto& fst1_edge_map = fst1_.in_edges_map(std::get<0>(v));
-            auto& fst3_edge_map = fst3_.in_edges_map(std::get<2>(v));
+        auto& fst1_edge_map = fst1_.in_edges_map(std::get<0>(v));
+        auto& fst3_edge_map = fst3_.in_edges_map(std::get<2>(v));
 
-            for (int e2: fst2_.in_edges(std::get<1>(v))) {
+        for (int e2: fst2_.in_edge_range(std::get<1>(v))) {
 
-                // FIXME: assumes edge_map is indexed by output symbols but it's actually indexed by input symbols.
+            // FIXME: assumes edge_map is indexed by output symbols but it's actually indexed by input symbols.
 
-                if (fst1_edge_map.size() == 0 || fst3_edge_map.size() == 0
-                        || !ebt::in(fst2_.input(e2), fst1_edge_map)
-                        || !ebt::in(fst2_.output(e2), fst3_edge_map)) {
-                    continue;
-                }
+            if (fst1_edge_map.size() == 0 || fst3_edge_map.size() == 0
+                    || !ebt::in(fst2_.input(e2), fst1_edge_map)
+                    || !ebt::in(fst2_.output(e2), fst3_edge_map)) {
+                continue;
+            }
 
-                for (auto& e1: fst1_edge_map.at(fst2_.input(e2))) {
-                    for (auto& e3: fst3_edge_map.at(fst2_.output(e2))) {
-                        result.push_back(std::make_tuple(e1, e2, e3));
-                    }
+            for (auto& e1: fst1_edge_map.at(fst2_.input(e2))) {
+                for (auto& e3: fst3_edge_map.at(fst2_.output(e2))) {
+                    result.push_back(std::make_tuple(e1, e2, e3));
                 }
             }
-
-            in_edges_cache = std::make_shared<std::vector<std::tuple<int, int, int>>>(
-                std::move(result));
         }
 
-        return *in_edges_cache;
+        return result;
     }
 
     std::vector<lazy_triple_mode2::edge> const& lazy_triple_mode2::out_edges(lazy_triple_mode2::vertex v) const
     {
-        if (out_edges_vertex == nullptr || *out_edges_vertex != v) {
-            out_edges_vertex = std::make_shared<std::tuple<int, int, int>>(v);
+        return out_edges_memo->get(v, [&](vertex const& u) { return expand_out(u); });
+    }
 
-            std::vector<std::tuple<int, int, int>> result;
+    std::vector<lazy_triple_mode2::edge> lazy_triple_mode2::expand_out(lazy_triple_mode2::vertex v) const
+    {
+        std::vector<std::tuple<int, int, int>> result;
 
-            auto& fst1_edge_map = fst1_.out_edges_map(std::get<0>(v));
-            auto& fst3_edge_map = fst3_.out_edges_map(std::get<2>(v));
+        auto& fst1_edge_map = fst1_.out_edges_map(std::get<0>(v));
+        auto& fst3_edge_map = fst3_.out_edges_map(std::get<2>(v));
 
-            for (int e2: fst2_.out_edges(std::get<1>(v))) {
+        for (int e2: fst2_.out_edge_range(std::get<1>(v))) {
 
-                // FIXME: assumes edge_map is indexed by output symbols but it's actually indexed by input symbols.
+            // FIXME: assumes edge_map is indexed by output symbols but it's actually indexed by input symbols.
 
-                if (fst1_edge_map.size() == 0 || fst3_edge_map.size() == 0
-                        || !ebt::in(fst2_.input(e2), fst1_edge_map)
-                        || !ebt::in(fst2_.output(e2), fst3_edge_map)) {
-                    continue;
-                }
+            if (fst1_edge_map.size() == 0 || fst3_edge_map.size() == 0
+                    || !ebt::in(fst2_.input(e2), fst1_edge_map)
+                    || !ebt::in(fst2_.output(e2), fst3_edge_map)) {
+                continue;
+            }
 
-                for (auto& e1: fst1_edge_map.at(fst2_.input(e2))) {
-                    for (auto& e3: fst3_edge_map.at(fst2_.output(e2))) {
-                        result.push_back(std::make_tuple(e1, e2, e3));
-                    }
+            for (auto& e1: fst1_edge_map.at(fst2_.input(e2))) {
+                for (auto& e3: fst3_edge_map.at(fst2_.output(e2))) {
+                    result.push_back(std::make_tuple(e1, e2, e3));
                 }
             }
-
-            out_edges_cache = std::make_shared<std::vector<std::tuple<int, int, int>>>(
-                std::move(result));
         }
 
-        return *out_edges_cache;
+        return result;
     }
 
     lazy_triple_mode2::vertex lazy_triple_mode2::tail(lazy_triple_mode2::edge e) const
@@ -1145,6 +2276,320 @@ namespace ilat {
         return fst3_;
     }
 
+    int lazy_triple_mode2::fst3_edge(lazy_triple_mode2::edge e) const
+    {
+        return std::get<2>(e);
+    }
+
+    void triple_fst::fst3_failures(triple_fst::edge e, std::vector<int>& failures) const
+    {
+        failures.clear();
+    }
+
+    // lazy_triple_backoff_mode2
+
+    backoff_table::backoff_table()
+        : ready(false)
+    {}
+
+    lazy_triple_backoff_mode2::lazy_triple_backoff_mode2(ilat::fst fst1, ilat::fst fst2,
+            ilat::fst fst3, int failure)
+        : fst1_(fst1), fst2_(fst2), fst3_(fst3), failure(failure)
+        , initials_cache(std::make_shared<std::vector<vertex>>())
+        , finals_cache(std::make_shared<std::vector<vertex>>())
+        , composition(std::make_shared<triple_composition>())
+        , resolved(std::make_shared<backoff_table>())
+    {
+        for (int i: fst1_.initials()) {
+            for (int j: fst2_.initials()) {
+                for (int k: fst3_.initials()) {
+                    initials_cache->push_back(std::make_tuple(i, j, k));
+                }
+            }
+        }
+    }
+
+    int lazy_triple_backoff_mode2::match(int u, int symbol, int& first, double& backoff) const
+    {
+        first = -1;
+        backoff = 0;
+
+        while (1) {
+            int e = fst3_.out_edge(u, symbol);
+
+            if (e != -1) {
+                if (first == -1) {
+                    first = e;
+                }
+
+                return e;
+            }
+
+            e = fst3_.out_edge(u, failure);
+
+            if (e == -1) {
+                return -1;
+            }
+
+            if (first == -1) {
+                first = e;
+            }
+
+            backoff += fst3_.weight(e);
+            u = fst3_.head(e);
+        }
+    }
+
+    int lazy_triple_backoff_mode2::resolve(lazy_triple_backoff_mode2::edge const& e,
+        double& backoff) const
+    {
+        int e3 = std::get<2>(e);
+
+        backoff = 0;
+
+        if (fst3_.output(e3) != failure) {
+            return e3;
+        }
+
+        if (resolved->ready.load(std::memory_order_acquire)) {
+            auto i = resolved->backoff_index.find(e);
+
+            if (i != resolved->backoff_index.end()) {
+                backoff = resolved->backoffs[i->second];
+                return resolved->arcs[i->second];
+            }
+        }
+
+        int first;
+
+        return match(fst3_.tail(e3), fst2_.output(std::get<1>(e)), first, backoff);
+    }
+
+    std::vector<lazy_triple_backoff_mode2::edge> lazy_triple_backoff_mode2::expand(
+        lazy_triple_backoff_mode2::vertex v) const
+    {
+        std::vector<std::tuple<int, int, int>> result;
+
+        auto& fst1_edge_map = fst1_.out_edges_map(std::get<0>(v));
+
+        if (fst1_edge_map.size() == 0) {
+            return result;
+        }
+
+        for (int e2: fst2_.out_edge_range(std::get<1>(v))) {
+            if (fst2_.output(e2) == failure) {
+                continue;
+            }
+
+            auto i = fst1_edge_map.find(fst2_.input(e2));
+
+            if (i == fst1_edge_map.end()) {
+                continue;
+            }
+
+            int first;
+            double backoff;
+
+            if (match(std::get<2>(v), fst2_.output(e2), first, backoff) == -1) {
+                continue;
+            }
+
+            for (auto& e1: i->second) {
+                result.push_back(std::make_tuple(e1, e2, first));
+            }
+        }
+
+        return result;
+    }
+
+    triple_composition const& lazy_triple_backoff_mode2::composed() const
+    {
+        std::call_once(composition->once, [&]() {
+            compose_reachable(*composition, *this,
+                [&](vertex const& v) { return expand(v); });
+
+            auto& finals1 = fst1_.finals();
+            auto& finals2 = fst2_.finals();
+            auto& finals3 = fst3_.finals();
+
+            std::unordered_set<int> final_set1 { finals1.begin(), finals1.end() };
+            std::unordered_set<int> final_set2 { finals2.begin(), finals2.end() };
+            std::unordered_set<int> final_set3 { finals3.begin(), finals3.end() };
+
+            for (auto& v: composition->vertices) {
+                if (ebt::in(std::get<0>(v), final_set1)
+                        && ebt::in(std::get<1>(v), final_set2)
+                        && ebt::in(std::get<2>(v), final_set3)) {
+                    finals_cache->push_back(v);
+                }
+            }
+
+            auto& edges = composition->edges;
+
+            resolved->arcs.resize(edges.size());
+            resolved->backoffs.resize(edges.size());
+
+            for (int i = 0; i < edges.size(); ++i) {
+                int e3 = std::get<2>(edges[i]);
+
+                if (fst3_.output(e3) != failure) {
+                    resolved->arcs[i] = e3;
+                    resolved->backoffs[i] = 0;
+                    continue;
+                }
+
+                int first;
+
+                resolved->arcs[i] = match(fst3_.tail(e3), fst2_.output(std::get<1>(edges[i])),
+                    first, resolved->backoffs[i]);
+                resolved->backoff_index[edges[i]] = i;
+            }
+
+            resolved->ready.store(true, std::memory_order_release);
+        });
+
+        return *composition;
+    }
+
+    std::vector<lazy_triple_backoff_mode2::vertex> const& lazy_triple_backoff_mode2::vertices() const
+    {
+        return composed().vertices;
+    }
+
+    std::vector<lazy_triple_backoff_mode2::edge> const& lazy_triple_backoff_mode2::edges() const
+    {
+        return composed().edges;
+    }
+
+    double lazy_triple_backoff_mode2::weight(lazy_triple_backoff_mode2::edge e) const
+    {
+        double backoff;
+        int e3 = resolve(e, backoff);
+
+        return fst1_.weight(std::get<0>(e)) + fst2_.weight(std::get<1>(e))
+            + backoff + fst3_.weight(e3);
+    }
+
+    std::vector<lazy_triple_backoff_mode2::edge> const& lazy_triple_backoff_mode2::in_edges(
+        lazy_triple_backoff_mode2::vertex v) const
+    {
+        auto& comp = composed();
+        auto i = comp.vertex_index.find(v);
+
+        return i == comp.vertex_index.end() ? comp.empty : comp.in_edges[i->second];
+    }
+
+    std::vector<lazy_triple_backoff_mode2::edge> const& lazy_triple_backoff_mode2::out_edges(
+        lazy_triple_backoff_mode2::vertex v) const
+    {
+        auto& comp = composed();
+        auto i = comp.vertex_index.find(v);
+
+        return i == comp.vertex_index.end() ? comp.empty : comp.out_edges[i->second];
+    }
+
+    lazy_triple_backoff_mode2::vertex lazy_triple_backoff_mode2::tail(
+        lazy_triple_backoff_mode2::edge e) const
+    {
+        return std::make_tuple(fst1_.tail(std::get<0>(e)),
+            fst2_.tail(std::get<1>(e)), fst3_.tail(std::get<2>(e)));
+    }
+
+    lazy_triple_backoff_mode2::vertex lazy_triple_backoff_mode2::head(
+        lazy_triple_backoff_mode2::edge e) const
+    {
+        return std::make_tuple(fst1_.head(std::get<0>(e)),
+            fst2_.head(std::get<1>(e)), fst3_.head(fst3_edge(e)));
+    }
+
+    std::vector<lazy_triple_backoff_mode2::vertex> const& lazy_triple_backoff_mode2::initials() const
+    {
+        return *initials_cache;
+    }
+
+    std::vector<lazy_triple_backoff_mode2::vertex> const& lazy_triple_backoff_mode2::finals() const
+    {
+        composed();
+
+        return *finals_cache;
+    }
+
+    int const& lazy_triple_backoff_mode2::input(lazy_triple_backoff_mode2::edge e) const
+    {
+        return fst1_.input(std::get<0>(e));
+    }
+
+    int const& lazy_triple_backoff_mode2::output(lazy_triple_backoff_mode2::edge e) const
+    {
+        return fst3_.output(fst3_edge(e));
+    }
+
+    long lazy_triple_backoff_mode2::time(lazy_triple_backoff_mode2::vertex v) const
+    {
+        return fst1_.time(std::get<0>(v));
+    }
+
+    ilat::fst const& lazy_triple_backoff_mode2::fst1() const
+    {
+        return fst1_;
+    }
+
+    ilat::fst const& lazy_triple_backoff_mode2::fst2() const
+    {
+        return fst2_;
+    }
+
+    ilat::fst const& lazy_triple_backoff_mode2::fst3() const
+    {
+        return fst3_;
+    }
+
+    ilat::fst& lazy_triple_backoff_mode2::fst1()
+    {
+        return fst1_;
+    }
+
+    ilat::fst& lazy_triple_backoff_mode2::fst2()
+    {
+        return fst2_;
+    }
+
+    ilat::fst& lazy_triple_backoff_mode2::fst3()
+    {
+        return fst3_;
+    }
+
+    int lazy_triple_backoff_mode2::fst3_edge(lazy_triple_backoff_mode2::edge e) const
+    {
+        double backoff;
+
+        return resolve(e, backoff);
+    }
+
+    void lazy_triple_backoff_mode2::fst3_failures(lazy_triple_backoff_mode2::edge e,
+        std::vector<int>& failures) const
+    {
+        failures.clear();
+
+        int e3 = std::get<2>(e);
+
+        if (fst3_.output(e3) != failure) {
+            return;
+        }
+
+        int symbol = fst2_.output(std::get<1>(e));
+        int u = fst3_.tail(e3);
+
+        while (fst3_.out_edge(u, symbol) == -1) {
+            int f = fst3_.out_edge(u, failure);
+
+            assert(f != -1);
+
+            failures.push_back(f);
+            u = fst3_.head(f);
+        }
+    }
+
 }
 
 namespace fst {
@@ -5,7 +5,11 @@
 #include <vector>
 #include <unordered_map>
 #include <unordered_set>
+#include <cstdint>
 #include <memory>
+#include <mutex>
+#include <atomic>
+#include <deque>
 #include "ebt/ebt.h"
 #include "seg/fst.h"
 
@@ -26,6 +30,212 @@ namespace ilat {
     bool operator==(vertex_data const& v1, vertex_data const& v2);
     bool operator==(edge_data const& e1, edge_data const& e2);
 
+    /*
+     * `adjacency_memo` remembers the adjacency lists of the vertices of
+     * a lazy fst once they are computed, for every vertex asked for.
+     * The lists are spread over shards.  Each shard publishes a bucket
+     * table through an atomic pointer, and a bucket is a chain of
+     * links that is only ever extended at its head, so readers of
+     * known vertices follow pointers without taking any lock.  A
+     * missing list is computed outside the lock and inserted under
+     * the mutex of its shard; if two threads race on it, the first one
+     * inserted wins.  When a table fills up, a larger one is built
+     * and published, and the old one is kept for readers still on it.
+     *
+     * Lists are never evicted, because the fst interface hands them out
+     * by reference, and they live in a deque so references stay valid
+     * when other lists are added.  `list` can be any container, such as
+     * the symbol-indexed maps of `fst::out_edges_map`.
+     *
+     */
+    template <class vertex, class edge, class list = std::vector<edge>>
+    struct adjacency_memo {
+
+        static constexpr int shard_count = 64;
+
+        struct node {
+            vertex v;
+            list value;
+        };
+
+        struct link {
+            node const *n;
+            link const *next;
+        };
+
+        struct table {
+            std::unique_ptr<std::atomic<link const*>[]> buckets;
+            size_t size;
+
+            table(size_t size);
+        };
+
+        struct shard {
+            std::atomic<table const*> current;
+
+            std::mutex mutex;
+            std::deque<node> nodes;
+            std::deque<link> links;
+            std::vector<std::unique_ptr<table>> tables;
+
+            shard();
+        };
+
+        std::unique_ptr<shard[]> shards;
+
+        adjacency_memo();
+
+        template <class compute_func>
+        list const& get(vertex const& v, compute_func compute);
+
+    };
+
+    /*
+     * `segment_data` describes a complete segment graph without
+     * storing its edges.  For every vertex u, the heads are the
+     * vertices in [first_head[u], last_head[u]), and the edge from
+     * u to v with the k-th label has id
+     *
+     *     out_begin[u] + (v - first_head[u]) * labels.size() + k
+     *
+     * so tail, head and label are computed from the id.  The fst
+     * interface returns adjacency lists by reference, so they are
+     * kept here, next to their once flags, and each is filled the
+     * first time its vertex is asked for.  Copies of the `fst_data`
+     * share them along with the rest of the graph.
+     *
+     */
+    struct segment_data {
+        std::vector<int> labels;
+
+        std::vector<int> out_begin;
+        std::vector<int> first_head;
+        std::vector<int> last_head;
+        std::vector<int> first_tail;
+        std::vector<int> last_tail;
+
+        std::vector<int> edge_indices;
+        std::vector<std::vector<int>> in_edges;
+        std::vector<std::vector<int>> out_edges;
+        std::vector<std::unordered_map<int, std::vector<int>>> in_edges_map;
+        std::vector<std::unordered_map<int, std::vector<int>>> out_edges_map;
+
+        std::once_flag edges_once;
+        std::unique_ptr<std::once_flag[]> in_edges_once;
+        std::unique_ptr<std::once_flag[]> out_edges_once;
+        std::unique_ptr<std::once_flag[]> in_edges_map_once;
+        std::unique_ptr<std::once_flag[]> out_edges_map_once;
+
+        int edges() const;
+        int tail(int e) const;
+        int head(int e) const;
+        int const& label(int e) const;
+        int edge(int u, int v, int k) const;
+    };
+
+    /*
+     * `mapped_data` is an fst read from a file written by
+     * `write_mapped_fst` or from a lattice archive, mapped read-only
+     * into memory, so processes loading the same file share its pages.
+     * `region` keeps the mapping alive, and is shared by the fsts of
+     * an archive.  The vertices are
+     * 0, ..., vertices - 1, and the out edges of a vertex u are the
+     * ids in [out_begin[u], out_begin[u + 1]), sorted by input symbol,
+     * so `find` is a binary search.  The in edges of v are
+     * in_edge[in_begin[v]], ..., in_edge[in_begin[v + 1] - 1].
+     * The features of edge e are feat[e * feat_dim], ...,
+     * feat[(e + 1) * feat_dim - 1].
+     *
+     * The fst interface hands out adjacency lists and maps by
+     * reference, so they are copied out of the arrays into an
+     * `adjacency_memo` per vertex the first time they are asked for,
+     * and kept for the life of the fst.
+     *
+     */
+    struct mapped_data {
+        std::shared_ptr<void const> region;
+
+        long vertices;
+        long edges;
+        long feat_dim;
+
+        double const* weight;
+        int64_t const* out_begin;
+        int64_t const* in_begin;
+        int64_t const* time;
+        float const* feat;
+        int const* in_edge;
+        int const* tail;
+        int const* head;
+        int const* input;
+        int const* output;
+
+        std::once_flag vertices_once;
+        std::once_flag edges_once;
+
+        adjacency_memo<int, int> in_edges;
+        adjacency_memo<int, int> out_edges;
+        adjacency_memo<int, int, std::unordered_map<int, std::vector<int>>> in_edges_map;
+        adjacency_memo<int, int, std::unordered_map<int, std::vector<int>>> out_edges_map;
+
+        int find(int u, int symbol) const;
+    };
+
+    /*
+     * `frozen_data` is an fst copied by `freeze` into flat arrays
+     * indexed by the vertex and edge ids of the original, which are
+     * kept.  The out edges of a vertex u are out_edge[out_begin[u]],
+     * ..., out_edge[out_begin[u + 1] - 1], sorted by input symbol, so
+     * `find` is a binary search, and the in edges of v are laid out
+     * the same way in `in_begin` and `in_edge`.  The features of edge
+     * e are feat[feat_begin[e]], ..., feat[feat_begin[e + 1] - 1].
+     * Slots of ids that the original does not use have a tail of -1.
+     *
+     * The adjacency is read from the arrays by `fst::in_edge_range`
+     * and `fst::out_edge_range`.  The lists and maps of the generic
+     * interface are only built, per vertex, for callers that ask for
+     * them.
+     *
+     */
+    struct frozen_data {
+        std::vector<long> time;
+
+        std::vector<double> weight;
+        std::vector<int> tail;
+        std::vector<int> head;
+        std::vector<int> input;
+        std::vector<int> output;
+
+        std::vector<int> out_begin;
+        std::vector<int> out_edge;
+        std::vector<int> in_begin;
+        std::vector<int> in_edge;
+
+        std::vector<int> feat_begin;
+        std::vector<double> feat;
+
+        adjacency_memo<int, int> in_edges;
+        adjacency_memo<int, int> out_edges;
+        adjacency_memo<int, int, std::unordered_map<int, std::vector<int>>> in_edges_map;
+        adjacency_memo<int, int, std::unordered_map<int, std::vector<int>>> out_edges_map;
+
+        int find(int u, int symbol) const;
+    };
+
+    /*
+     * A run of edge ids stored contiguously, as the adjacency of a
+     * vertex in one of the layouts above.
+     *
+     */
+    struct edge_range {
+        int const* first;
+        int const* last;
+
+        int const* begin() const { return first; }
+        int const* end() const { return last; }
+        int size() const { return last - first; }
+    };
+
     struct fst_data {
         std::string name;
 
@@ -54,11 +264,53 @@ namespace ilat {
         std::vector<std::vector<std::pair<std::string, std::string>>> edge_attrs;
 
         std::vector<std::vector<double>> feats;
+
+        std::shared_ptr<segment_data> segments;
+        std::shared_ptr<mapped_data> mapped;
+        std::shared_ptr<frozen_data> frozen;
     };
 
     void add_vertex(fst_data& data, int v, vertex_data v_data);
     void add_edge(fst_data& data, int e, edge_data e_data);
 
+    /*
+     * Connect every pair of vertices whose duration is within
+     * [min_seg_len, max_seg_len] with an edge for each label, the
+     * same way a loop over `add_edge` would, but implicitly.  The
+     * vertices have to be 0, ..., n - 1 in increasing order of time,
+     * and no edges can be added afterwards.  The edges have weight 0,
+     * and carry no attributes or features.
+     *
+     */
+    void add_segments(fst_data& data, std::vector<int> const& labels,
+        int min_seg_len, int max_seg_len);
+
+    struct fst;
+
+    /*
+     * Semi-Markov recursions on a graph built by `add_segments`,
+     * given the weights indexed by edge id.  The weights of the edges
+     * from u to v form a contiguous block over the labels, so these
+     * loops reduce over the label dimension of a (time x duration x
+     * label) array instead of walking the adjacency lists.  The label
+     * max and exp sum are simd reductions over that block; the best
+     * path takes the block max first and only scans for its label
+     * when the max improves on the head.
+     *
+     * The log sums are indexed by vertex, and are -inf for vertices
+     * that cannot be reached.  `segment_best_path` returns the edges
+     * of the best path from the initial to the final vertex.
+     *
+     */
+    std::vector<double> segment_forward_log_sum(fst const& f,
+        std::vector<double> const& weights);
+
+    std::vector<double> segment_backward_log_sum(fst const& f,
+        std::vector<double> const& weights);
+
+    std::vector<int> segment_best_path(fst const& f,
+        std::vector<double> const& weights);
+
     /*
      * The class `fst_data` is separated instead of inlined in `fst`,
      * because we want to separate data (`fst_data`) that can be manipulated
@@ -94,6 +346,17 @@ namespace ilat {
 
         virtual std::unordered_map<int, std::vector<int>> const& in_edges_map(int v) const;
         virtual std::unordered_map<int, std::vector<int>> const& out_edges_map(int v) const;
+
+        // The first out edge of `v` with input `symbol`, or -1.
+        int out_edge(int v, int symbol) const;
+
+        // The same edges as `in_edges` and `out_edges`, without
+        // building a list when the fst is frozen.
+        edge_range in_edge_range(int v) const;
+        edge_range out_edge_range(int v) const;
+
+        int feat_size(int e) const;
+        double feat(int e, int i) const;
     };
 
     /*
@@ -112,12 +375,83 @@ namespace ilat {
             std::vector<int> const& edges, fst const& f) const override;
     };
 
+    /*
+     * The file version also takes an LM written by `compile_arpa_lm`,
+     * and maps it with `load_mapped_fst` instead of parsing it.
+     *
+     */
     fst load_arpa_lm(std::istream& is,
         std::unordered_map<std::string, int> const& symbol_id);
 
     fst load_arpa_lm(std::string filename,
         std::unordered_map<std::string, int> const& symbol_id);
 
+    /*
+     * The binary format of `mapped_data`.  Edges are renumbered so
+     * that the out edges of each vertex are contiguous and sorted by
+     * input symbol.  The graph, times, weights, symbols and features
+     * are written, the latter as floats; attributes are dropped.  The
+     * file is in the byte order of the machine that wrote it.
+     *
+     * `compile_arpa_lm` loads a text LM with `load_arpa_lm` once and
+     * writes it, so that training can use `load_mapped_fst` instead.
+     *
+     */
+    void write_mapped_fst(std::ostream& os, fst const& f);
+
+    fst load_mapped_fst(std::string filename,
+        std::unordered_map<std::string, int> const& symbol_id);
+
+    void compile_arpa_lm(std::string arpa_file, std::string output_file,
+        std::unordered_map<std::string, int> const& symbol_id);
+
+    /*
+     * `freeze` copies a built fst into a `frozen_data`: flat arrays
+     * for times, tails, heads, symbols, weights and features, and
+     * offsets for the adjacency, with the out edges sorted by input
+     * symbol in place of the hash maps.  Vertex and edge ids are those
+     * of `f`, and features stay doubles.  The sets, per-vertex vectors
+     * and maps of `fst_data` are not kept, and neither are attributes,
+     * so the result takes a few dozen bytes per edge.  No edges can be
+     * added afterwards.  `f` may itself be mapped or frozen.
+     *
+     */
+    fst freeze(fst const& f);
+
+    /*
+     * A lattice archive is a file of mapped fsts, one per utterance,
+     * followed by an index of their names and offsets.  Opening one
+     * maps the whole file and reads the index; `at` then gives an fst
+     * whose arrays, features included, point into the mapping, so no
+     * lattice is parsed or copied.
+     *
+     * `compile_lattice_archive` converts a file in the text format of
+     * `load_lattice`.  All edges of a lattice must have the same
+     * number of features.
+     *
+     */
+    struct lattice_archive {
+        std::shared_ptr<void const> region;
+        size_t size;
+
+        std::shared_ptr<std::unordered_map<std::string, int>> symbol_id;
+        std::shared_ptr<std::vector<std::string>> id_symbol;
+
+        std::vector<std::string> names;
+        std::vector<int64_t> offsets;
+        std::vector<int64_t> sizes;
+        std::unordered_map<std::string, int> name_index;
+
+        fst at(int i) const;
+        fst at(std::string const& name) const;
+    };
+
+    lattice_archive load_lattice_archive(std::string filename,
+        std::unordered_map<std::string, int> const& symbol_id);
+
+    void compile_lattice_archive(std::string lattice_file, std::string output_file,
+        std::unordered_map<std::string, int> const& symbol_id);
+
     /*
      * We allow multiple ways to implement a pair of `fst`.
      * The class `lazy_pair` is used for lazy composition, and
@@ -143,6 +477,40 @@ namespace ilat {
 
     };
 
+    /*
+     * `reachable_composition` is the part of a composed fst reachable
+     * from its initial vertices.  Vertices and edges are listed in the
+     * order they are found, and the adjacency lists are indexed by the
+     * position of the vertex, so a lookup costs one hash of the tuple.
+     *
+     * `lazy_pair_mode1` and `lazy_pair_mode2` build it the first time
+     * their vertices, edges or adjacency lists are asked for.  They
+     * differ in which fst is walked and which one is looked up by
+     * symbol: mode 1 walks the edges of `fst1` and finds the matching
+     * edges of `fst2` in `out_edges_map`, and mode 2 does the reverse.
+     * The composition is shared by the copies of an fst.
+     *
+     */
+    template <class vertex, class edge>
+    struct reachable_composition {
+        std::once_flag once;
+
+        std::vector<vertex> vertices;
+        std::vector<edge> edges;
+
+        std::unordered_map<vertex, int> vertex_index;
+        std::vector<std::vector<edge>> in_edges;
+        std::vector<std::vector<edge>> out_edges;
+
+        std::vector<edge> empty;
+    };
+
+    using pair_composition = reachable_composition<std::tuple<int, int>,
+        std::tuple<int, int>>;
+
+    using triple_composition = reachable_composition<std::tuple<int, int, int>,
+        std::tuple<int, int, int>>;
+
     struct lazy_pair_mode1
         : public pair_fst {
 
@@ -153,17 +521,16 @@ namespace ilat {
         ilat::fst fst1_;
         ilat::fst fst2_;
 
-        mutable std::shared_ptr<std::vector<vertex>> vertices_cache;
-        mutable std::shared_ptr<std::vector<edge>> edges_cache;
         mutable std::shared_ptr<std::vector<vertex>> initials_cache;
         mutable std::shared_ptr<std::vector<vertex>> finals_cache;
-        mutable std::shared_ptr<vertex> in_edges_vertex;
-        mutable std::shared_ptr<std::vector<edge>> in_edges_cache;
-        mutable std::shared_ptr<vertex> out_edges_vertex;
-        mutable std::shared_ptr<std::vector<edge>> out_edges_cache;
+
+        std::shared_ptr<pair_composition> composition;
 
         lazy_pair_mode1(ilat::fst fst1, ilat::fst fst2);
 
+        std::vector<edge> expand(vertex v) const;
+        pair_composition const& composed() const;
+
         virtual std::vector<vertex> const& vertices() const override;
         virtual std::vector<edge> const& edges() const override;
         virtual double weight(edge e) const override;
@@ -193,17 +560,16 @@ namespace ilat {
         ilat::fst fst1_;
         ilat::fst fst2_;
 
-        mutable std::shared_ptr<std::vector<vertex>> vertices_cache;
-        mutable std::shared_ptr<std::vector<edge>> edges_cache;
         mutable std::shared_ptr<std::vector<vertex>> initials_cache;
         mutable std::shared_ptr<std::vector<vertex>> finals_cache;
-        mutable std::shared_ptr<vertex> in_edges_vertex;
-        mutable std::shared_ptr<std::vector<edge>> in_edges_cache;
-        mutable std::shared_ptr<vertex> out_edges_vertex;
-        mutable std::shared_ptr<std::vector<edge>> out_edges_cache;
+
+        std::shared_ptr<pair_composition> composition;
 
         lazy_pair_mode2(ilat::fst fst1, ilat::fst fst2);
 
+        std::vector<edge> expand(vertex v) const;
+        pair_composition const& composed() const;
+
         virtual std::vector<vertex> const& vertices() const override;
         virtual std::vector<edge> const& edges() const override;
         virtual double weight(edge e) const override;
@@ -288,6 +654,13 @@ namespace ilat {
         virtual ilat::fst& fst1() = 0;
         virtual ilat::fst& fst2() = 0;
         virtual ilat::fst& fst3() = 0;
+
+        // The edge of `fst3` that reads the output symbol of `e`.
+        virtual int fst3_edge(edge e) const = 0;
+
+        // The failure edges of `fst3` that `e` takes before
+        // `fst3_edge(e)`, in order.  None unless `fst3` has backoffs.
+        virtual void fst3_failures(edge e, std::vector<int>& failures) const;
     };
 
     struct lazy_triple_mode2
@@ -305,13 +678,17 @@ namespace ilat {
         mutable std::shared_ptr<std::vector<edge>> edges_cache;
         mutable std::shared_ptr<std::vector<vertex>> initials_cache;
         mutable std::shared_ptr<std::vector<vertex>> finals_cache;
-        mutable std::shared_ptr<vertex> in_edges_vertex;
-        mutable std::shared_ptr<std::vector<edge>> in_edges_cache;
-        mutable std::shared_ptr<vertex> out_edges_vertex;
-        mutable std::shared_ptr<std::vector<edge>> out_edges_cache;
+        std::shared_ptr<std::once_flag> vertices_once;
+        std::shared_ptr<std::once_flag> edges_once;
+
+        std::shared_ptr<adjacency_memo<vertex, edge>> in_edges_memo;
+        std::shared_ptr<adjacency_memo<vertex, edge>> out_edges_memo;
 
         lazy_triple_mode2(ilat::fst fst1, ilat::fst fst2, ilat::fst fst3);
 
+        std::vector<edge> expand_in(vertex v) const;
+        std::vector<edge> expand_out(vertex v) const;
+
         virtual std::vector<vertex> const& vertices() const override;
         virtual std::vector<edge> const& edges() const override;
         virtual double weight(edge e) const override;
@@ -332,7 +709,187 @@ namespace ilat {
         virtual ilat::fst& fst1();
         virtual ilat::fst& fst2();
         virtual ilat::fst& fst3();
+
+        virtual int fst3_edge(edge e) const override;
+    };
+
+    /*
+     * The backoff walks of the edges of a composition.  `arcs` holds
+     * the edge of `fst3` that reads the symbol and `backoffs` the sum
+     * of the failure weights taken before it, both indexed like the
+     * edges of the composition.  `backoff_index` maps the edges that
+     * take a failure edge to their position.  `ready` is set once the
+     * table is filled.
+     *
+     */
+    struct backoff_table {
+        std::atomic<bool> ready;
+
+        std::vector<int> arcs;
+        std::vector<double> backoffs;
+        std::unordered_map<std::tuple<int, int, int>, int> backoff_index;
+
+        backoff_table();
     };
+
+    /*
+     * `lazy_triple_backoff_mode2` composes the three fsts the way
+     * `lazy_triple_mode2` does, except that the edges of `fst3` labeled
+     * `failure` are failure transitions, as the backoffs of an n-gram
+     * LM from `load_arpa_lm` are meant to be read.  A failure edge is
+     * only taken when the current state of `fst3` has no edge for the
+     * symbol, so the state of `fst3` never moves on its own, and the
+     * weights of the failure edges taken are added to the edge weight.
+     *
+     * The third element of an edge is the first edge of `fst3` taken
+     * from its tail, which is a failure edge if the symbol is backed
+     * off; `fst3_edge` gives the edge that reads the symbol.  `fst3` is
+     * assumed deterministic, and symbols of `fst2` equal to `failure`
+     * are skipped.
+     *
+     * Only the triples reachable from the initial ones are built, the
+     * first time the graph is walked.  The backoff walk of every
+     * composed edge is then resolved once into `resolved`, and
+     * `weight`, `head`, `output` and `fst3_edge` read it instead of
+     * walking `fst3` again; before the composition is built they fall
+     * back to `match`.  `fst3_failures` walks the failure edges again,
+     * for weights that score them one by one.
+     *
+     */
+    struct lazy_triple_backoff_mode2
+        : public triple_fst {
+
+        using vertex = std::tuple<int, int, int>;
+        using edge = std::tuple<int, int, int>;
+        using symbol = int;
+
+        ilat::fst fst1_;
+        ilat::fst fst2_;
+        ilat::fst fst3_;
+
+        int failure;
+
+        std::shared_ptr<std::vector<vertex>> initials_cache;
+        std::shared_ptr<std::vector<vertex>> finals_cache;
+
+        std::shared_ptr<triple_composition> composition;
+        std::shared_ptr<backoff_table> resolved;
+
+        lazy_triple_backoff_mode2(ilat::fst fst1, ilat::fst fst2, ilat::fst fst3,
+            int failure = 0);
+
+        int match(int u, int symbol, int& first, double& backoff) const;
+        int resolve(edge const& e, double& backoff) const;
+        std::vector<edge> expand(vertex v) const;
+        triple_composition const& composed() const;
+
+        virtual std::vector<vertex> const& vertices() const override;
+        virtual std::vector<edge> const& edges() const override;
+        virtual double weight(edge e) const override;
+        virtual std::vector<edge> const& in_edges(vertex v) const override;
+        virtual std::vector<edge> const& out_edges(vertex v) const override;
+        virtual vertex tail(edge e) const override;
+        virtual vertex head(edge e) const override;
+        virtual std::vector<vertex> const& initials() const override;
+        virtual std::vector<vertex> const& finals() const override;
+        virtual int const& input(edge e) const override;
+        virtual int const& output(edge e) const override;
+        virtual long time(vertex v) const override;
+
+        virtual ilat::fst const& fst1() const;
+        virtual ilat::fst const& fst2() const;
+        virtual ilat::fst const& fst3() const;
+
+        virtual ilat::fst& fst1();
+        virtual ilat::fst& fst2();
+        virtual ilat::fst& fst3();
+
+        virtual int fst3_edge(edge e) const override;
+        virtual void fst3_failures(edge e, std::vector<int>& failures) const override;
+    };
+
+    template <class vertex, class edge, class list>
+    adjacency_memo<vertex, edge, list>::table::table(size_t size)
+        : buckets(new std::atomic<link const*>[size]), size(size)
+    {
+        for (size_t i = 0; i < size; ++i) {
+            buckets[i].store(nullptr, std::memory_order_relaxed);
+        }
+    }
+
+    template <class vertex, class edge, class list>
+    adjacency_memo<vertex, edge, list>::shard::shard()
+        : current(nullptr)
+    {}
+
+    template <class vertex, class edge, class list>
+    adjacency_memo<vertex, edge, list>::adjacency_memo()
+        : shards(new shard[shard_count])
+    {}
+
+    template <class vertex, class edge, class list>
+    template <class compute_func>
+    list const& adjacency_memo<vertex, edge, list>::get(vertex const& v,
+        compute_func compute)
+    {
+        size_t h = std::hash<vertex>{}(v);
+        shard& s = shards[h % shard_count];
+        h /= shard_count;
+
+        auto find = [&](table const *t) -> node const* {
+            if (t == nullptr) {
+                return nullptr;
+            }
+
+            for (link const *k = t->buckets[h % t->size].load(std::memory_order_acquire);
+                    k != nullptr; k = k->next) {
+                if (k->n->v == v) {
+                    return k->n;
+                }
+            }
+
+            return nullptr;
+        };
+
+        if (node const *n = find(s.current.load(std::memory_order_acquire))) {
+            return n->value;
+        }
+
+        list result = compute(v);
+
+        std::lock_guard<std::mutex> lock { s.mutex };
+
+        table const *t = s.current.load(std::memory_order_relaxed);
+
+        if (node const *n = find(t)) {
+            return n->value;
+        }
+
+        s.nodes.push_back(node { v, std::move(result) });
+        node const& n = s.nodes.back();
+
+        auto push = [&](table const& t, node const& n, size_t h) {
+            std::atomic<link const*>& head = t.buckets[h % t.size];
+            s.links.push_back(link { &n, head.load(std::memory_order_relaxed) });
+            head.store(&s.links.back(), std::memory_order_release);
+        };
+
+        if (t == nullptr || s.nodes.size() > t->size) {
+            std::unique_ptr<table> bigger { new table(t == nullptr ? 16 : 2 * t->size) };
+
+            for (auto& m: s.nodes) {
+                push(*bigger, m, std::hash<vertex>{}(m.v) / shard_count);
+            }
+
+            s.current.store(bigger.get(), std::memory_order_release);
+            s.tables.push_back(std::move(bigger));
+        } else {
+            push(*t, n, h);
+        }
+
+        return n.value;
+    }
+
 }
 
 namespace fst {
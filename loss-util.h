@@ -2,6 +2,7 @@
 #define LOSS_UTIL_H
 
 #include <unordered_map>
+#include "seg/semiring.h"
 
 namespace seg {
 
@@ -22,40 +23,39 @@ namespace seg {
 
     };
 
+    /*
+     * The forward (backward) pass in the expectation semiring.  For
+     * every vertex it computes the log sum of the paths from the
+     * initials (to the finals) together with the expected risk of
+     * those paths, in a single sweep.  The risk may be defined on
+     * a base of `fst_type`, e.g., when the sweep runs on a weight
+     * array.
+     *
+     */
+    template <class fst_type, class risk_fst = fst_type>
+    using forward_exp_risk = fst::shortest_distance<fst_type,
+        fst::expectation_semiring<fst_type, risk_func<risk_fst>>,
+        fst::forward_sweep<fst_type>>;
+
+    template <class fst_type, class risk_fst = fst_type>
+    using backward_exp_risk = fst::shortest_distance<fst_type,
+        fst::expectation_semiring<fst_type, risk_func<risk_fst>>,
+        fst::backward_sweep<fst_type>>;
+
+    /*
+     * The forward (backward) log sum on the sweep of semiring.h.
+     * Unlike `fst::forward_log_sum` of fst-algo.h, it can also sweep
+     * the levels of a `topo_levels`.
+     *
+     */
     template <class fst_type>
-    struct forward_exp_risk {
-
-        using vertex = typename fst_type::vertex;
-
-        std::unordered_map<vertex, double> extra;
-
-        std::shared_ptr<risk_func<fst_type>> risk;
-
-        forward_exp_risk(std::shared_ptr<risk_func<fst_type>> risk);
-
-        void merge(fst_type const& f, std::vector<vertex> order,
-            std::unordered_map<vertex, double> const& forward_log_sum);
-
-    };
+    using forward_log_sum = fst::shortest_distance<fst_type,
+        fst::log_semiring<fst_type>, fst::forward_sweep<fst_type>>;
 
     template <class fst_type>
-    struct backward_exp_risk {
-
-        using vertex = typename fst_type::vertex;
-
-        std::unordered_map<vertex, double> extra;
-
-        std::shared_ptr<risk_func<fst_type>> risk;
-
-        backward_exp_risk(std::shared_ptr<risk_func<fst_type>> risk);
-
-        void merge(fst_type const& f, std::vector<vertex> order,
-            std::unordered_map<vertex, double> const& forward_log_sum);
-
-    };
+    using backward_log_sum = fst::shortest_distance<fst_type,
+        fst::log_semiring<fst_type>, fst::backward_sweep<fst_type>>;
 
 }
 
-#include "seg/loss-util-impl.h"
-
 #endif
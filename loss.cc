@@ -2,37 +2,63 @@
 #include "seg/seg-util.h"
 #include "ebt/ebt.h"
 #include "seg/seg-weight.h"
+#include "seg/segcost.h"
 
 namespace seg {
 
+    namespace {
+
+        segcost::cost_table<int> make_cost_table(std::vector<cost::segment<int>> const& segs)
+        {
+            std::vector<segcost::segment<int>> result;
+
+            for (auto& s: segs) {
+                result.push_back(segcost::segment<int> { s.start_time, s.end_time, s.label });
+            }
+
+            return segcost::cost_table<int> { result };
+        }
+
+    }
+
     loss_func::~loss_func()
     {}
 
     hinge_loss::hinge_loss(iseg_data& graph_data,
         std::vector<cost::segment<int>> const& gt_segs,
-        std::vector<int> const& sils, double cost_scale)
+        std::vector<int> const& sils, double cost_scale,
+        util::oracle_cache *oracle, util::oracle_cache::key const& oracle_key)
         : graph_data(graph_data)
         , cost_scale(cost_scale)
     {
         seg_fst<iseg_data> graph { graph_data };
 
-        cost::overlap_cost<int> cost_func { sils };
+        segcost::overlap_cost<int> cost_func { sils };
+        segcost::cost_table<int> gt_table = make_cost_table(gt_segs);
 
         auto old_weight_func = graph_data.weight_func;
 
         graph_data.weight_func = make_weight<ifst::fst>([&](ifst::fst const& f, int e) {
             int tail_time = graph.time(graph.tail(e));
             int head_time = graph.time(graph.head(e));
-            cost::segment<int> s { tail_time, head_time, graph.output(e) };
-            return -cost_func(gt_segs, s);
+            segcost::segment<int> s { tail_time, head_time, graph.output(e) };
+            return -cost_func(gt_table, s);
         });
 
-        fst::forward_one_best<seg_fst<iseg_data>> min_cost_one_best;
-        for (auto& i: graph.initials()) {
-            min_cost_one_best.extra[i] = {-1, 0};
-        }
-        min_cost_one_best.merge(graph, *graph_data.topo_order);
-        min_cost_path = min_cost_one_best.best_path(graph);
+        auto min_cost_search = [&]() {
+            fst::forward_one_best<seg_fst<iseg_data>> min_cost_one_best;
+            for (auto& i: graph.initials()) {
+                min_cost_one_best.extra[i] = {-1, 0};
+            }
+            min_cost_one_best.merge(graph, *graph_data.topo_order);
+            return min_cost_one_best.best_path(graph);
+        };
+
+        util::oracle_cache::key cost_key = oracle_key;
+        std::get<6>(cost_key) = util::oracle_cache::cost_key("overlap", sils);
+
+        min_cost_path = (oracle == nullptr ? min_cost_search()
+            : oracle->get(cost_key, min_cost_search));
 
         for (auto& e: min_cost_path) {
             int tail_time = graph.time(graph.tail(e));
@@ -41,6 +67,8 @@ namespace seg {
             min_cost_segs.push_back(cost::segment<int> { tail_time, head_time, graph.output(e) });
         }
 
+        segcost::cost_table<int> min_cost_table = make_cost_table(min_cost_segs);
+
         auto& id_symbol = *graph_data.fst->data->id_symbol;
 
         double gold_cost = 0;
@@ -49,8 +77,8 @@ namespace seg {
         for (auto& e: min_cost_path) {
             int tail_time = graph.time(graph.tail(e));
             int head_time = graph.time(graph.head(e));
-            cost::segment<int> s { tail_time, head_time, graph.output(e) };
-            double c = cost_func(gt_segs, s);
+            segcost::segment<int> s { tail_time, head_time, graph.output(e) };
+            double c = cost_func(gt_table, s);
             gold_cost += c;
             gold_weight += (*old_weight_func)(*graph_data.fst, e);
 
@@ -63,8 +91,8 @@ namespace seg {
         graph_data.weight_func = make_weight<ifst::fst>([&](ifst::fst const& f, int e) {
             int tail_time = graph.time(graph.tail(e));
             int head_time = graph.time(graph.head(e));
-            cost::segment<int> s { tail_time, head_time, graph.output(e) };
-            return cost_func(min_cost_segs, s) * cost_scale + (*old_weight_func)(f, e);
+            segcost::segment<int> s { tail_time, head_time, graph.output(e) };
+            return cost_func(min_cost_table, s) * cost_scale + (*old_weight_func)(f, e);
         });
 
         fst::forward_one_best<seg_fst<iseg_data>> one_best;
@@ -80,8 +108,8 @@ namespace seg {
         for (auto& e: cost_aug_path) {
             int tail_time = graph.time(graph.tail(e));
             int head_time = graph.time(graph.head(e));
-            cost::segment<int> s { tail_time, head_time, graph.output(e) };
-            double c = cost_func(min_cost_segs, s);
+            segcost::segment<int> s { tail_time, head_time, graph.output(e) };
+            double c = cost_func(min_cost_table, s);
             cost_aug_cost += c;
             cost_aug_weight += (*old_weight_func)(*graph_data.fst, e);
 
@@ -114,31 +142,44 @@ namespace seg {
 
     log_loss::log_loss(iseg_data& graph_data,
         std::vector<cost::segment<int>> const& gt_segs,
-        std::vector<int> const& sils)
+        std::vector<int> const& sils,
+        util::oracle_cache *oracle, util::oracle_cache::key const& oracle_key)
         : graph_data(graph_data)
     {
         seg_fst<iseg_data> graph { graph_data };
 
-        cost::overlap_cost<int> cost_func { sils };
+        segcost::overlap_cost<int> cost_func { sils };
+        segcost::cost_table<int> gt_table = make_cost_table(gt_segs);
 
         auto old_weight_func = graph_data.weight_func;
 
         graph_data.weight_func = make_weight<ifst::fst>([&](ifst::fst const& f, int e) {
             int tail_time = graph.time(graph.tail(e));
             int head_time = graph.time(graph.head(e));
-            cost::segment<int> s { tail_time, head_time, graph.output(e) };
-            return -cost_func(gt_segs, s);
+            segcost::segment<int> s { tail_time, head_time, graph.output(e) };
+            return -cost_func(gt_table, s);
         });
 
-        fst::forward_one_best<seg_fst<iseg_data>> one_best;
-        for (auto& i: graph.initials()) {
-            one_best.extra[i] = {-1, 0};
-        }
-        one_best.merge(graph, *graph_data.topo_order);
-        min_cost_path = one_best.best_path(graph);
+        auto min_cost_search = [&]() {
+            fst::forward_one_best<seg_fst<iseg_data>> one_best;
+            for (auto& i: graph.initials()) {
+                one_best.extra[i] = {-1, 0};
+            }
+            one_best.merge(graph, *graph_data.topo_order);
+            return one_best.best_path(graph);
+        };
+
+        util::oracle_cache::key cost_key = oracle_key;
+        std::get<6>(cost_key) = util::oracle_cache::cost_key("overlap", sils);
+
+        min_cost_path = (oracle == nullptr ? min_cost_search()
+            : oracle->get(cost_key, min_cost_search));
 
         graph_data.weight_func = old_weight_func;
 
+        weights = fst::make_weight_array(graph);
+        iseg_weight_array_fst weighted_graph { graph, weights };
+
         for (auto& e: min_cost_path) {
             int tail_time = graph.time(graph.tail(e));
             int head_time = graph.time(graph.head(e));
@@ -154,10 +195,10 @@ namespace seg {
         for (auto& e: min_cost_path) {
             int tail_time = graph.time(graph.tail(e));
             int head_time = graph.time(graph.head(e));
-            cost::segment<int> s { tail_time, head_time, graph.output(e) };
-            double c = cost_func(gt_segs, s);
+            segcost::segment<int> s { tail_time, head_time, graph.output(e) };
+            double c = cost_func(gt_table, s);
             gold_cost += c;
-            gold_score += graph.weight(e);
+            gold_score += weights[e];
 
             std::cout << " " << id_symbol[graph.output(e)] << " (" << c << ")";
         }
@@ -165,12 +206,10 @@ namespace seg {
         std::cout << "gold cost: " << gold_cost << std::endl;
         std::cout << "gold score: " << gold_score << std::endl;
 
-        forward.merge(graph, *graph_data.topo_order);
-
-        auto rev_topo_order = *graph_data.topo_order;
-        std::reverse(rev_topo_order.begin(), rev_topo_order.end());
+        auto levels = fst::make_topo_levels(weighted_graph, *graph_data.topo_order);
 
-        backward.merge(graph, rev_topo_order);
+        forward.merge(weighted_graph, levels);
+        backward.merge(weighted_graph, levels);
 
         double inf = std::numeric_limits<double>::infinity();
 
@@ -196,10 +235,8 @@ namespace seg {
     {
         double result = 0;
 
-        seg_fst<iseg_data> graph { graph_data };
-
         for (auto& e: min_cost_path) {
-            result -= graph.weight(e);
+            result -= weights[e];
         }
 
         result += logZ;
@@ -219,12 +256,12 @@ namespace seg {
             int tail = graph.tail(e);
             int head = graph.head(e);
 
-            if (!ebt::in(tail, forward.extra) || !ebt::in(head, backward.extra)) {
+            if (!forward.extra.has(tail) || !backward.extra.has(head)) {
                 continue;
             }
 
             graph_data.weight_func->accumulate_grad(
-                scale * std::exp(forward.extra.at(tail) + graph.weight(e)
+                scale * std::exp(forward.extra.at(tail) + weights[e]
                     + backward.extra.at(head) - logZ), *graph_data.fst, e);
         }
     }
@@ -235,12 +272,13 @@ namespace seg {
     {
         seg_fst<iseg_data> graph { graph_data };
 
-        forward_graph.merge(graph, *graph_data.topo_order);
+        weights = fst::make_weight_array(graph);
+        iseg_weight_array_fst weighted_graph { graph, weights };
 
-        auto rev_topo_order = *graph_data.topo_order;
-        std::reverse(rev_topo_order.begin(), rev_topo_order.end());
+        auto levels = fst::make_topo_levels(weighted_graph, *graph_data.topo_order);
 
-        backward_graph.merge(graph, rev_topo_order);
+        forward_graph.merge(weighted_graph, levels);
+        backward_graph.merge(weighted_graph, levels);
 
         double inf = std::numeric_limits<double>::infinity();
 
@@ -323,7 +361,7 @@ namespace seg {
 
         for (auto& e: graph.edges()) {
             graph_data.weight_func->accumulate_grad(
-                scale * (std::exp(forward_graph.extra.at(graph.tail(e)) + graph.weight(e)
+                scale * (std::exp(forward_graph.extra.at(graph.tail(e)) + weights[e]
                     + backward_graph.extra.at(graph.head(e)) - graph_logZ)), *graph_data.fst, e);
         }
     }
@@ -340,44 +378,34 @@ namespace seg {
     {
         seg_fst<iseg_data> graph { graph_data };
 
-        forward_graph.merge(graph, *graph_data.topo_order);
+        weights = fst::make_weight_array(graph);
+        iseg_weight_array_fst weighted_graph { graph, weights };
 
-        std::vector<int> rev_topo_order = *graph_data.topo_order;
-        std::reverse(rev_topo_order.begin(), rev_topo_order.end());
+        auto levels = fst::make_topo_levels(weighted_graph, *graph_data.topo_order);
 
-        backward_graph.merge(graph, rev_topo_order);
+        forward_exp.merge(weighted_graph, levels);
+        backward_exp.merge(weighted_graph, levels);
 
         double inf = std::numeric_limits<double>::infinity();
 
         double forward_logZ = -inf;
-        for (auto& f: graph.finals()) {
-            forward_logZ = ebt::log_add(forward_logZ, forward_graph.extra.at(f));
-        }
-
-        double backward_logZ = -inf;
-        for (auto& i: graph.initials()) {
-            backward_logZ = ebt::log_add(backward_logZ, backward_graph.extra.at(i));
-        }
-
-        std::cout << "forward: " << forward_logZ << " backward: " << backward_logZ << std::endl;
-
-        logZ = forward_logZ;
-
-        forward_exp.merge(graph, *graph_data.topo_order, forward_graph.extra);
-        backward_exp.merge(graph, rev_topo_order, backward_graph.extra);
-
         double forward_exp_score = 0;
         for (auto& f: graph.finals()) {
-            forward_exp_score += forward_exp.extra.at(f);
+            forward_logZ = ebt::log_add(forward_logZ, forward_exp.extra.at(f).log_sum);
+            forward_exp_score += forward_exp.extra.at(f).exp;
         }
 
+        double backward_logZ = -inf;
         double backward_exp_score = 0;
         for (auto& i: graph.initials()) {
-            backward_exp_score += backward_exp.extra.at(i);
+            backward_logZ = ebt::log_add(backward_logZ, backward_exp.extra.at(i).log_sum);
+            backward_exp_score += backward_exp.extra.at(i).exp;
         }
 
+        std::cout << "forward: " << forward_logZ << " backward: " << backward_logZ << std::endl;
         std::cout << "forward: " << forward_exp_score << " backward: " << backward_exp_score << std::endl;
 
+        logZ = forward_logZ;
         exp_score = forward_exp_score;
     }
 
@@ -393,29 +421,32 @@ namespace seg {
         for (auto& e: graph.edges()) {
             int tail = graph.tail(e);
             int head = graph.head(e);
-            double weight = graph.weight(e);
+            double weight = weights[e];
 
-            if (!ebt::in(tail, forward_graph.extra) || !ebt::in(head, backward_graph.extra)) {
+            if (!forward_exp.extra.has(tail) || !backward_exp.extra.has(head)) {
                 continue;
             }
 
-            double e_marginal = std::exp(forward_graph.extra.at(tail)
-                + backward_graph.extra.at(head) - logZ + weight);
+            auto& tail_value = forward_exp.extra.at(tail);
+            auto& head_value = backward_exp.extra.at(head);
+
+            double e_marginal = std::exp(tail_value.log_sum
+                + head_value.log_sum - logZ + weight);
 
-            double e_exp = forward_exp.extra.at(tail) + weight + backward_exp.extra.at(head);
+            double e_exp = tail_value.exp + weight + head_value.exp;
 
             if (std::isinf(e_marginal) || std::isnan(e_marginal)) {
-                std::cout << forward_graph.extra.at(tail)
-                    << " " << backward_graph.extra.at(head)
+                std::cout << tail_value.log_sum
+                    << " " << head_value.log_sum
                     << " " << logZ
                     << " " << weight << std::endl;
                 exit(1);
             }
 
             if (std::isinf(e_exp) || std::isnan(e_exp)) {
-                std::cout << " " << forward_exp.extra.at(tail)
+                std::cout << " " << tail_value.exp
                     << " " << weight
-                    << " " << backward_exp.extra.at(head) << std::endl;
+                    << " " << head_value.exp << std::endl;
                 exit(1);
             }
 
@@ -429,44 +460,36 @@ namespace seg {
     {
         seg_fst<iseg_data> graph { graph_data };
 
-        f_log_sum.merge(graph, *graph_data.topo_order);
+        weights = fst::make_weight_array(graph);
+        iseg_weight_array_fst weighted_graph { graph, weights };
+
+        f_risk.merge(weighted_graph, *graph_data.topo_order);
 
         std::vector<int> rev_topo_order = *graph_data.topo_order;
         std::reverse(rev_topo_order.begin(), rev_topo_order.end());
 
-        b_log_sum.merge(graph, rev_topo_order);
+        b_risk.merge(weighted_graph, rev_topo_order);
 
         double inf = std::numeric_limits<double>::infinity();
 
         double forward_logZ = -inf;
-        for (auto& f: graph.finals()) {
-            forward_logZ = ebt::log_add(forward_logZ, f_log_sum.extra.at(f));
-        }
-
-        double backward_logZ = -inf;
-        for (auto& i: graph.initials()) {
-            backward_logZ = ebt::log_add(backward_logZ, b_log_sum.extra.at(i));
-        }
-
-        std::cout << "forward: " << forward_logZ << " backward: " << backward_logZ << std::endl;
-
-        logZ = forward_logZ;
-
-        f_risk.merge(graph, *graph_data.topo_order, f_log_sum.extra);
-        b_risk.merge(graph, rev_topo_order, b_log_sum.extra);
-
         double forward_exp_risk = 0;
         for (auto& f: graph.finals()) {
-            forward_exp_risk += f_risk.extra.at(f);
+            forward_logZ = ebt::log_add(forward_logZ, f_risk.extra.at(f).log_sum);
+            forward_exp_risk += f_risk.extra.at(f).exp;
         }
 
+        double backward_logZ = -inf;
         double backward_exp_risk = 0;
         for (auto& i: graph.initials()) {
-            backward_exp_risk += b_risk.extra.at(i);
+            backward_logZ = ebt::log_add(backward_logZ, b_risk.extra.at(i).log_sum);
+            backward_exp_risk += b_risk.extra.at(i).exp;
         }
 
+        std::cout << "forward: " << forward_logZ << " backward: " << backward_logZ << std::endl;
         std::cout << "forward: " << forward_exp_risk << " backward: " << backward_exp_risk << std::endl;
 
+        logZ = forward_logZ;
         exp_risk = forward_exp_risk;
     }
 
@@ -482,17 +505,20 @@ namespace seg {
         for (auto& e: graph.edges()) {
             int tail = graph.tail(e);
             int head = graph.head(e);
-            double weight = graph.weight(e);
+            double weight = weights[e];
             double r_e = (*risk)(graph, e);
 
-            if (!ebt::in(tail, f_log_sum.extra) || !ebt::in(head, b_log_sum.extra)) {
+            if (!f_risk.extra.has(tail) || !b_risk.extra.has(head)) {
                 continue;
             }
 
-            double e_marginal = std::exp(f_log_sum.extra.at(tail)
-                + b_log_sum.extra.at(head) - logZ + weight);
+            auto& tail_value = f_risk.extra.at(tail);
+            auto& head_value = b_risk.extra.at(head);
+
+            double e_marginal = std::exp(tail_value.log_sum
+                + head_value.log_sum - logZ + weight);
 
-            double e_risk = f_risk.extra.at(tail) + r_e + b_risk.extra.at(head);
+            double e_risk = tail_value.exp + r_e + head_value.exp;
 
             graph_data.weight_func->accumulate_grad(scale * ((e_risk - exp_risk) * e_marginal), *graph_data.fst, e);
 
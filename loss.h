@@ -5,9 +5,12 @@
 #include "fst/fst-algo.h"
 #include "seg/loss-util.h"
 #include "seg/seg-cost.h"
+#include "seg/util.h"
 
 namespace seg {
 
+    using iseg_weight_array_fst = fst::weight_array_fst<seg_fst<iseg_data>>;
+
     struct loss_func {
         virtual ~loss_func();
 
@@ -29,7 +32,9 @@ namespace seg {
 
         hinge_loss(iseg_data& graph_data,
             std::vector<cost::segment<int>> const& gt_segs,
-            std::vector<int> const& sils, double cost_scale=1.0);
+            std::vector<int> const& sils, double cost_scale=1.0,
+            util::oracle_cache *oracle=nullptr,
+            util::oracle_cache::key const& oracle_key=util::oracle_cache::key{});
 
         virtual double loss() const override;
 
@@ -45,12 +50,16 @@ namespace seg {
         std::vector<int> min_cost_path;
         std::vector<cost::segment<int>> min_cost_segs;
 
-        fst::forward_log_sum<seg_fst<iseg_data>> forward;
-        fst::backward_log_sum<seg_fst<iseg_data>> backward;
+        std::vector<double> weights;
+
+        forward_log_sum<iseg_weight_array_fst> forward;
+        backward_log_sum<iseg_weight_array_fst> backward;
 
         log_loss(iseg_data& graph_data,
             std::vector<cost::segment<int>> const& gt_segs,
-            std::vector<int> const& sils);
+            std::vector<int> const& sils,
+            util::oracle_cache *oracle=nullptr,
+            util::oracle_cache::key const& oracle_key=util::oracle_cache::key{});
 
         virtual double loss() const override;
 
@@ -63,8 +72,10 @@ namespace seg {
 
         iseg_data& graph_data;
 
-        fst::forward_log_sum<seg_fst<iseg_data>> forward_graph;
-        fst::backward_log_sum<seg_fst<iseg_data>> backward_graph;
+        std::vector<double> weights;
+
+        forward_log_sum<iseg_weight_array_fst> forward_graph;
+        backward_log_sum<iseg_weight_array_fst> backward_graph;
 
         pair_iseg_data pair_data;
 
@@ -96,11 +107,10 @@ namespace seg {
         double logZ;
         double exp_score;
 
-        fst::forward_log_sum<seg_fst<iseg_data>> forward_graph;
-        fst::backward_log_sum<seg_fst<iseg_data>> backward_graph;
+        std::vector<double> weights;
 
-        forward_exp_risk<seg_fst<iseg_data>> forward_exp;
-        backward_exp_risk<seg_fst<iseg_data>> backward_exp;
+        forward_exp_risk<iseg_weight_array_fst, seg_fst<iseg_data>> forward_exp;
+        backward_exp_risk<iseg_weight_array_fst, seg_fst<iseg_data>> backward_exp;
 
         entropy_loss(iseg_data& graph_data);
 
@@ -119,11 +129,10 @@ namespace seg {
         double logZ;
         double exp_risk;
 
-        fst::forward_log_sum<seg_fst<iseg_data>> f_log_sum;
-        fst::backward_log_sum<seg_fst<iseg_data>> b_log_sum;
+        std::vector<double> weights;
 
-        forward_exp_risk<seg_fst<iseg_data>> f_risk;
-        backward_exp_risk<seg_fst<iseg_data>> b_risk;
+        forward_exp_risk<iseg_weight_array_fst, seg_fst<iseg_data>> f_risk;
+        backward_exp_risk<iseg_weight_array_fst, seg_fst<iseg_data>> b_risk;
 
         empirical_bayes_risk(iseg_data& graph_data,
             std::shared_ptr<risk_func<seg_fst<iseg_data>>> risk);
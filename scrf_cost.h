@@ -15,6 +15,7 @@ namespace scrf {
 
         std::shared_ptr<segcost::cost<typename fst::symbol>> cost;
         std::vector<segcost::segment<typename fst::symbol>> const& gold_segs;
+        segcost::cost_table<typename fst::symbol> table;
 
         virtual double operator()(fst const& f, typename fst::edge e) const override;
 
@@ -23,7 +24,7 @@ namespace scrf {
     template <class fst>
     seg_cost<fst>::seg_cost(std::shared_ptr<segcost::cost<typename fst::symbol>> cost,
         std::vector<segcost::segment<typename fst::symbol>> const& gold_segs)
-        : cost(cost), gold_segs(gold_segs)
+        : cost(cost), gold_segs(gold_segs), table(gold_segs)
     {}
 
     template <class fst>
@@ -33,7 +34,7 @@ namespace scrf {
         auto tail = f.tail(e);
         auto head = f.head(e);
 
-        return (*cost)(gold_segs, segcost::segment<typename fst::symbol> {
+        return (*cost)(table, segcost::segment<typename fst::symbol> {
             f.time(tail), f.time(head), f.output(e) });
     }
 
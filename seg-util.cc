@@ -2,9 +2,13 @@
 #include <cassert>
 #include "nn/lstm-tensor-tree.h"
 #include <fstream>
+#include <algorithm>
+#include <limits>
 #include "fst/fst-algo.h"
 #include "speech/speech.h"
 #include "ebt/ebt.h"
+#include "seg/util.h"
+#include "seg/semiring.h"
 
 using namespace std::string_literals;
 
@@ -212,6 +216,55 @@ namespace seg {
         return std::make_shared<ifst::fst>(result);
     }
 
+    std::shared_ptr<ifst::fst> make_boundary_graph(std::vector<int> const& boundaries,
+        std::unordered_map<std::string, int> const& label_id,
+        std::vector<std::string> const& id_label,
+        int min_seg_len, int max_seg_len)
+    {
+        assert(min_seg_len >= 1);
+        assert(max_seg_len >= min_seg_len);
+
+        ifst::fst_data data;
+
+        data.symbol_id = std::make_shared<std::unordered_map<std::string, int>>(label_id);
+        data.id_symbol = std::make_shared<std::vector<std::string>>(id_label);
+
+        for (int v = 0; v < boundaries.size(); ++v) {
+            ifst::add_vertex(data, v, ifst::vertex_data { boundaries[v] });
+        }
+
+        data.initials.push_back(0);
+        data.finals.push_back(boundaries.size() - 1);
+
+        for (int u = 0; u < data.vertices.size(); ++u) {
+            for (int v = u + 1; v < data.vertices.size(); ++v) {
+                int duration = data.vertices[v].time - data.vertices[u].time;
+
+                if (duration < min_seg_len) {
+                    continue;
+                }
+
+                if (duration > max_seg_len) {
+                    break;
+                }
+
+                for (auto& p: label_id) {
+                    if (p.first == "<eps>") {
+                        continue;
+                    }
+
+                    ifst::add_edge(data, data.edges.size(),
+                        ifst::edge_data { u, v, 0, p.second, p.second });
+                }
+            }
+        }
+
+        ifst::fst result;
+        result.data = std::make_shared<ifst::fst_data>(std::move(data));
+
+        return std::make_shared<ifst::fst>(result);
+    }
+
     std::shared_ptr<ifst::fst> make_forward_graph(int frames,
         std::unordered_map<std::string, int> const& label_id,
         std::vector<std::string> const& id_label,
@@ -587,12 +640,57 @@ namespace seg {
         graph_data.param = i_args.param;
     }
 
+    namespace {
+
+        /*
+         * Graphs of the same length are built once and shared by their
+         * samples.  The budget, in megabytes of "graph-cache", is taken
+         * from the first call.
+         *
+         */
+        util::graph_cache<ifst::fst>& shared_graph_cache(inference_args const& i_args)
+        {
+            static util::graph_cache<ifst::fst> cache {
+                (ebt::in(std::string("graph-cache"), i_args.args)
+                    ? std::stoul(i_args.args.at("graph-cache")) : 512ul) << 20 };
+
+            return cache;
+        }
+
+    }
+
     void make_graph(sample& s, inference_args& i_args, int frames)
     {
-        s.graph_data.fst = make_graph(frames,
-            i_args.label_id, i_args.id_label, i_args.min_seg, i_args.max_seg, i_args.stride);
-        s.graph_data.topo_order = std::make_shared<std::vector<int>>(
-            fst::topo_order(*s.graph_data.fst));
+        auto entry = shared_graph_cache(i_args).get(
+            std::make_tuple(frames, i_args.id_label, i_args.min_seg, i_args.max_seg, i_args.stride),
+            [&]() {
+                util::graph_cache<ifst::fst>::entry e;
+
+                e.graph = make_graph(frames,
+                    i_args.label_id, i_args.id_label, i_args.min_seg, i_args.max_seg, i_args.stride);
+                // Segments are at least one frame long, so sorting the
+                // vertices by time is a topological order.
+                fst::topo_levels<int> levels;
+                fst::make_time_levels(*e.graph, levels, false);
+                e.topo_order = std::make_shared<std::vector<int>>(
+                    std::move(levels.order));
+
+                // An explicit graph also keeps the index and attributes
+                // of every vertex, and the index, attributes, features
+                // and edge set node of every edge.
+                e.bytes = util::graph_bytes(e.graph->vertices().size(),
+                    e.graph->edges().size(), i_args.labels.size(),
+                    sizeof(ifst::vertex_data) + sizeof(int)
+                        + sizeof(std::vector<std::pair<std::string, std::string>>),
+                    sizeof(ifst::edge_data) + sizeof(int)
+                        + sizeof(std::vector<std::pair<std::string, std::string>>)
+                        + sizeof(std::vector<double>) + 32);
+
+                return e;
+            });
+
+        s.graph_data.fst = entry.graph;
+        s.graph_data.topo_order = entry.topo_order;
     }
 
     void make_graph(sample& s, inference_args& i_args)
@@ -600,6 +698,113 @@ namespace seg {
         make_graph(s, i_args, s.frames.size());
     }
 
+    void make_boundary_graph(sample& s, inference_args& i_args,
+        std::vector<double> const& boundary_score)
+    {
+        double threshold = std::numeric_limits<double>::infinity();
+        if (ebt::in(std::string("boundary-threshold"), i_args.args)) {
+            threshold = std::stod(i_args.args.at("boundary-threshold"));
+        }
+
+        std::vector<int> boundaries = util::select_boundaries(boundary_score,
+            s.frames.size(), threshold, i_args.min_seg, i_args.max_seg);
+
+        s.graph_data.fst = make_boundary_graph(boundaries,
+            i_args.label_id, i_args.id_label, i_args.min_seg, i_args.max_seg);
+
+        fst::topo_levels<int> levels;
+        fst::make_time_levels(*s.graph_data.fst, levels, false);
+        s.graph_data.topo_order = std::make_shared<std::vector<int>>(
+            std::move(levels.order));
+    }
+
+    std::shared_ptr<ifst::fst> prune_labels(ifst::fst const& graph,
+        seg_weight<ifst::fst> const& weight, int top_k, double beam)
+    {
+        ifst::fst_data data;
+
+        data.name = graph.data->name;
+        data.symbol_id = graph.data->symbol_id;
+        data.id_symbol = graph.data->id_symbol;
+
+        for (auto& v: graph.vertices()) {
+            ifst::add_vertex(data, v, ifst::vertex_data { int(graph.time(v)) });
+
+            if (v < graph.data->vertex_attrs.size()) {
+                data.vertex_attrs[v] = graph.data->vertex_attrs[v];
+            }
+        }
+
+        data.initials = graph.initials();
+        data.finals = graph.finals();
+
+        // (head, score, edge), sorted so that each span is a run with
+        // the best labels first
+
+        std::vector<std::tuple<int, double, int>> span;
+
+        for (auto& u: graph.vertices()) {
+            span.clear();
+
+            for (auto& e: graph.out_edges(u)) {
+                span.push_back(std::make_tuple(graph.head(e), -weight(graph, e), e));
+            }
+
+            std::sort(span.begin(), span.end());
+
+            for (int i = 0; i < span.size(); ) {
+                int v = std::get<0>(span[i]);
+                double best = -std::get<1>(span[i]);
+                int k = 0;
+
+                for (; i < span.size() && std::get<0>(span[i]) == v; ++i, ++k) {
+                    int e = std::get<2>(span[i]);
+
+                    if ((top_k > 0 && k >= top_k) || -std::get<1>(span[i]) < best - beam) {
+                        continue;
+                    }
+
+                    int f = data.edges.size();
+
+                    ifst::add_edge(data, f, ifst::edge_data { u, v,
+                        graph.weight(e), graph.input(e), graph.output(e) });
+
+                    if (e < graph.data->edge_attrs.size()) {
+                        data.edge_attrs[f] = graph.data->edge_attrs[e];
+                        data.feats[f] = graph.data->feats[e];
+                    }
+                }
+            }
+        }
+
+        ifst::fst result;
+        result.data = std::make_shared<ifst::fst_data>(std::move(data));
+
+        return std::make_shared<ifst::fst>(result);
+    }
+
+    void prune_graph(sample& s, inference_args const& i_args,
+        seg_weight<ifst::fst> const& weight)
+    {
+        int top_k = 0;
+        if (ebt::in(std::string("label-top-k"), i_args.args)) {
+            top_k = std::stoi(i_args.args.at("label-top-k"));
+        }
+
+        double beam = std::numeric_limits<double>::infinity();
+        if (ebt::in(std::string("label-beam"), i_args.args)) {
+            beam = std::stod(i_args.args.at("label-beam"));
+        }
+
+        if (top_k <= 0 && beam == std::numeric_limits<double>::infinity()) {
+            return;
+        }
+
+        // The vertices are kept as they are, so the topological order
+        // of the full graph still applies.
+        s.graph_data.fst = prune_labels(*s.graph_data.fst, weight, top_k, beam);
+    }
+
     void parse_learning_args(learning_args& l_args,
         std::unordered_map<std::string, std::string> const& args)
     {
@@ -649,6 +854,12 @@ namespace seg {
         if (ebt::in(std::string("adam-beta2"), args)) {
             l_args.adam_beta2 = std::stod(args.at("adam-beta2"));
         }
+
+        l_args.batch_size = 1;
+        if (ebt::in(std::string("batch-size"), args)) {
+            l_args.batch_size = std::stoi(args.at("batch-size"));
+            assert(l_args.batch_size >= 1);
+        }
     }
 
     learning_sample::learning_sample(learning_args const& l_args)
@@ -657,4 +868,10 @@ namespace seg {
         gold_data.param = l_args.param;
     }
 
+    std::vector<std::shared_ptr<tensor_tree::vertex>> minibatch_grad(learning_args const& l_args,
+        std::function<std::vector<std::shared_ptr<tensor_tree::vertex>>(int)> const& sample_grad)
+    {
+        return util::minibatch_grad(l_args.batch_size, sample_grad);
+    }
+
 }
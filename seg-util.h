@@ -9,6 +9,7 @@
 #include <vector>
 #include <unordered_map>
 #include <random>
+#include <functional>
 #include "seg/cost.h"
 
 namespace seg {
@@ -99,6 +100,48 @@ namespace seg {
     void make_graph(sample& s, inference_args& i_args);
     void make_graph(sample& s, inference_args& i_args, int frames);
 
+    /*
+     * Graphs on boundary candidates.  `make_boundary_graph` places
+     * vertices only at `boundaries`, as chosen by
+     * `util::select_boundaries`, and connects those between `min_seg`
+     * and `max_seg` frames apart.  The graph grows with the number of
+     * boundaries instead of the number of frames.  The sample version
+     * takes a score per frame and the threshold "boundary-threshold",
+     * which defaults to keeping local peaks only.  The boundaries
+     * follow the scores, so oracle paths of these graphs must not be
+     * kept in a `util::oracle_cache`.
+     *
+     */
+    std::shared_ptr<ifst::fst> make_boundary_graph(std::vector<int> const& boundaries,
+        std::unordered_map<std::string, int> const& label_id,
+        std::vector<std::string> const& id_label,
+        int min_seg_len, int max_seg_len);
+
+    void make_boundary_graph(sample& s, inference_args& i_args,
+        std::vector<double> const& boundary_score);
+
+    /*
+     * Two-stage graphs.  `prune_labels` scores every edge of `graph`
+     * with a cheap `weight`, such as frame averages, and keeps on each
+     * span only the `top_k` best labels and those within `beam` of the
+     * best.  The result is an explicit graph on the same vertices, so
+     * expensive features are only evaluated on the surviving edges.
+     * The surviving edges keep their features and attributes, so
+     * lattices can be pruned as well.
+     * A `top_k` of 0 keeps any number of labels.
+     *
+     * `prune_graph` applies it to a sample with "label-top-k" and
+     * "label-beam" from the arguments, and leaves the graph alone when
+     * neither is given.  The surviving edges change with `weight`,
+     * so pruned graphs must not use a `util::oracle_cache` either.
+     *
+     */
+    std::shared_ptr<ifst::fst> prune_labels(ifst::fst const& graph,
+        seg_weight<ifst::fst> const& weight, int top_k, double beam);
+
+    void prune_graph(sample& s, inference_args const& i_args,
+        seg_weight<ifst::fst> const& weight);
+
     struct learning_args
         : public inference_args {
 
@@ -114,6 +157,7 @@ namespace seg {
         double adam_beta1;
         double adam_beta2;
         int time;
+        int batch_size;
     };
 
     void parse_learning_args(learning_args& l_args,
@@ -128,6 +172,14 @@ namespace seg {
         learning_sample(learning_args const& args);
     };
 
+    /*
+     * `minibatch_grad` runs `util::minibatch_grad` over a minibatch of
+     * "batch-size" samples.
+     *
+     */
+    std::vector<std::shared_ptr<tensor_tree::vertex>> minibatch_grad(learning_args const& l_args,
+        std::function<std::vector<std::shared_ptr<tensor_tree::vertex>>(int)> const& sample_grad);
+
 }
 
 #endif
@@ -46,24 +46,41 @@ namespace seg {
 
     frame_sum_score::frame_sum_score(std::shared_ptr<autodiff::op_t> frames)
         : frames(frames)
-    {}
+    {
+        auto& m = autodiff::get_output<la::cpu::tensor_like<double>>(frames);
+
+        int time = m.size(0);
+        int labels = m.size(1);
+
+        cumsum.resize(labels * (time + 1));
+
+        for (int ell = 0; ell < labels; ++ell) {
+            double *c = cumsum.data() + ell * (time + 1);
+
+            for (int t = 0; t < time; ++t) {
+                c[t + 1] = c[t] + m({t, ell});
+            }
+        }
+    }
 
     double frame_sum_score::operator()(ifst::fst const& f,
         int e) const
     {
         auto& m = autodiff::get_output<la::cpu::tensor_like<double>>(frames);
 
-        double sum = 0;
+        int time = m.size(0);
 
         int ell = f.output(e) - 1;
         int tail_time = f.time(f.tail(e));
         int head_time = f.time(f.head(e));
 
-        for (int t = tail_time; t < head_time; ++t) {
-            sum += m({t, ell});
+        if (head_time <= tail_time) {
+            return 0;
         }
 
-        return sum;
+        double const *c = cumsum.data() + ell * (time + 1);
+
+        return c[head_time] - c[tail_time];
     }
 
     void frame_sum_score::accumulate_grad(double g, ifst::fst const& f,
@@ -71,6 +88,34 @@ namespace seg {
     {
         auto& m = autodiff::get_output<la::cpu::tensor_like<double>>(frames);
 
+        int time = m.size(0);
+
+        if (grad_diff.size() == 0) {
+            grad_diff.resize(m.size(1) * (time + 1));
+        }
+
+        int ell = f.output(e) - 1;
+        int tail_time = f.time(f.tail(e));
+        int head_time = f.time(f.head(e));
+
+        if (head_time <= tail_time) {
+            return;
+        }
+
+        double *d = grad_diff.data() + ell * (time + 1);
+
+        d[tail_time] += g;
+        d[head_time] -= g;
+    }
+
+    void frame_sum_score::grad() const
+    {
+        if (grad_diff.size() == 0) {
+            return;
+        }
+
+        auto& m = autodiff::get_output<la::cpu::tensor_like<double>>(frames);
+
         if (frames->grad == nullptr) {
             la::cpu::tensor<double> m_grad;
             la::cpu::resize_as(m_grad, m);
@@ -79,13 +124,19 @@ namespace seg {
 
         auto& m_grad = autodiff::get_grad<la::cpu::tensor_like<double>>(frames);
 
-        int ell = f.output(e) - 1;
-        int tail_time = f.time(f.tail(e));
-        int head_time = f.time(f.head(e));
+        int time = m.size(0);
 
-        for (int t = tail_time; t < head_time; ++t) {
-            m_grad({t, ell}) += g;
+        for (int ell = 0; ell < m.size(1); ++ell) {
+            double const *d = grad_diff.data() + ell * (time + 1);
+            double sum = 0;
+
+            for (int t = 0; t < time; ++t) {
+                sum += d[t];
+                m_grad({t, ell}) += sum;
+            }
         }
+
+        grad_diff.clear();
     }
 
     frame_avg_score::frame_avg_score(std::shared_ptr<autodiff::op_t> param,
@@ -93,6 +144,21 @@ namespace seg {
         : param(param), frames(frames)
     {
         score = autodiff::rtmul(param, frames);
+
+        auto& m = autodiff::get_output<la::cpu::tensor_like<double>>(score);
+
+        int labels = m.size(0);
+        int time = m.size(1);
+
+        cumsum.resize(labels * (time + 1));
+
+        for (int ell = 0; ell < labels; ++ell) {
+            double *c = cumsum.data() + ell * (time + 1);
+
+            for (int t = 0; t < time; ++t) {
+                c[t + 1] = c[t] + m({ell, t});
+            }
+        }
     }
 
     double frame_avg_score::operator()(ifst::fst const& f,
@@ -100,17 +166,19 @@ namespace seg {
     {
         auto& m = autodiff::get_output<la::cpu::tensor_like<double>>(score);
 
-        double sum = 0;
+        int time = m.size(1);
 
         int ell = f.output(e) - 1;
         int tail_time = f.time(f.tail(e));
         int head_time = f.time(f.head(e));
 
-        for (int t = tail_time; t < head_time; ++t) {
-            sum += m({ell, t});
+        if (head_time <= tail_time) {
+            return 0;
         }
 
-        return (head_time <= tail_time ? 0 : sum / (head_time - tail_time));
+        double const *c = cumsum.data() + ell * (time + 1);
+
+        return (c[head_time] - c[tail_time]) / (head_time - tail_time);
     }
 
     void frame_avg_score::accumulate_grad(double g, ifst::fst const& f,
@@ -118,31 +186,60 @@ namespace seg {
     {
         auto& m = autodiff::get_output<la::cpu::tensor_like<double>>(score);
 
-        if (score->grad == nullptr) {
-            la::cpu::tensor<double> m_grad;
-            la::cpu::resize_as(m_grad, m);
-            score->grad = std::make_shared<la::cpu::tensor<double>>(std::move(m_grad));
-        }
+        int time = m.size(1);
 
-        auto& m_grad = autodiff::get_grad<la::cpu::tensor_like<double>>(score);
+        if (grad_diff.size() == 0) {
+            grad_diff.resize(m.size(0) * (time + 1));
+        }
 
         int ell = f.output(e) - 1;
         int tail_time = f.time(f.tail(e));
         int head_time = f.time(f.head(e));
 
-        for (int t = tail_time; t < head_time; ++t) {
-            m_grad({ell, t}) += g / (head_time - tail_time);
+        if (head_time <= tail_time) {
+            return;
         }
+
+        double *d = grad_diff.data() + ell * (time + 1);
+
+        d[tail_time] += g / (head_time - tail_time);
+        d[head_time] -= g / (head_time - tail_time);
     }
 
     void frame_avg_score::grad() const
     {
+        auto& m = autodiff::get_output<la::cpu::tensor_like<double>>(score);
+
+        if (score->grad == nullptr) {
+            la::cpu::tensor<double> m_grad;
+            la::cpu::resize_as(m_grad, m);
+            score->grad = std::make_shared<la::cpu::tensor<double>>(std::move(m_grad));
+        }
+
+        auto& m_grad = autodiff::get_grad<la::cpu::tensor_like<double>>(score);
+
+        if (grad_diff.size() != 0) {
+            int time = m.size(1);
+
+            for (int ell = 0; ell < m.size(0); ++ell) {
+                double const *d = grad_diff.data() + ell * (time + 1);
+                double sum = 0;
+
+                for (int t = 0; t < time; ++t) {
+                    sum += d[t];
+                    m_grad({ell, t}) += sum;
+                }
+            }
+
+            grad_diff.clear();
+        }
+
         autodiff::eval_vertex(score, autodiff::grad_funcs);
     }
 
     frame_samples_score::frame_samples_score(std::shared_ptr<autodiff::op_t> param,
             std::shared_ptr<autodiff::op_t> frames, double scale)
-        : param(param), frames(frames), scale(scale)
+        : param(param), frames(frames), scale(scale), grad_cells(std::make_shared<util::sparse_grad>())
     {
         score = autodiff::rtmul(param, frames);
     }
@@ -166,31 +263,35 @@ namespace seg {
     {
         auto& m = autodiff::get_output<la::cpu::tensor<double>>(score);
 
-        if (score->grad == nullptr) {
-            la::cpu::tensor<double> m_grad;
-            la::cpu::resize_as(m_grad, m);
-            score->grad = std::make_shared<la::cpu::tensor<double>>(std::move(m_grad));
-        }
-
-        auto& m_grad = autodiff::get_grad<la::cpu::tensor<double>>(score);
-
         int ell = f.output(e) - 1;
         int tail_time = f.time(f.tail(e));
         int head_time = f.time(f.head(e));
 
         int dur = head_time - tail_time;
 
-        m_grad({ell, int(tail_time + dur * scale)}) += g;
+        grad_cells->add(m, ell, int(tail_time + dur * scale), g);
     }
 
     void frame_samples_score::grad() const
     {
+        if (!grad_cells->empty()) {
+            auto& m = autodiff::get_output<la::cpu::tensor<double>>(score);
+
+            if (score->grad == nullptr) {
+                la::cpu::tensor<double> m_grad;
+                la::cpu::resize_as(m_grad, m);
+                score->grad = std::make_shared<la::cpu::tensor<double>>(std::move(m_grad));
+            }
+
+            grad_cells->flush(autodiff::get_grad<la::cpu::tensor<double>>(score));
+        }
+
         autodiff::eval_vertex(score, autodiff::grad_funcs);
     }
 
     left_boundary_score::left_boundary_score(std::shared_ptr<autodiff::op_t> param,
             std::shared_ptr<autodiff::op_t> frames, int shift)
-        : param(param), frames(frames), shift(shift)
+        : param(param), frames(frames), shift(shift), grad_cells(std::make_shared<util::sparse_grad>())
     {
         score = autodiff::rtmul(param, frames);
     }
@@ -212,29 +313,33 @@ namespace seg {
     {
         auto& m = autodiff::get_output<la::cpu::tensor<double>>(score);
 
-        if (score->grad == nullptr) {
-            la::cpu::tensor<double> m_grad;
-            la::cpu::resize_as(m_grad, m);
-            score->grad = std::make_shared<la::cpu::tensor<double>>(std::move(m_grad));
-        }
-
-        auto& m_grad = autodiff::get_grad<la::cpu::tensor<double>>(score);
-
         int ell = f.output(e) - 1;
         int tail_time = f.time(f.tail(e));
         int head_time = f.time(f.head(e));
 
-        m_grad({ell, std::max<int>(tail_time + shift, 0)}) += g;
+        grad_cells->add(m, ell, std::max<int>(tail_time + shift, 0), g);
     }
 
     void left_boundary_score::grad() const
     {
+        if (!grad_cells->empty()) {
+            auto& m = autodiff::get_output<la::cpu::tensor<double>>(score);
+
+            if (score->grad == nullptr) {
+                la::cpu::tensor<double> m_grad;
+                la::cpu::resize_as(m_grad, m);
+                score->grad = std::make_shared<la::cpu::tensor<double>>(std::move(m_grad));
+            }
+
+            grad_cells->flush(autodiff::get_grad<la::cpu::tensor<double>>(score));
+        }
+
         autodiff::eval_vertex(score, autodiff::grad_funcs);
     }
 
     right_boundary_score::right_boundary_score(std::shared_ptr<autodiff::op_t> param,
             std::shared_ptr<autodiff::op_t> frames, int shift)
-        : param(param), frames(frames), shift(shift)
+        : param(param), frames(frames), shift(shift), grad_cells(std::make_shared<util::sparse_grad>())
     {
         score = autodiff::rtmul(param, frames);
     }
@@ -256,26 +361,40 @@ namespace seg {
     {
         auto& m = autodiff::get_output<la::cpu::tensor<double>>(score);
 
-        if (score->grad == nullptr) {
-            la::cpu::tensor<double> m_grad;
-            la::cpu::resize_as(m_grad, m);
-            score->grad = std::make_shared<la::cpu::tensor<double>>(std::move(m_grad));
-        }
-
-        auto& m_grad = autodiff::get_grad<la::cpu::tensor<double>>(score);
-
         int ell = f.output(e) - 1;
         int tail_time = f.time(f.tail(e));
         int head_time = f.time(f.head(e));
 
-        m_grad({ell, std::min<int>(head_time + shift, m.size(1) - 1)}) += g;
+        grad_cells->add(m, ell, std::min<int>(head_time + shift, m.size(1) - 1), g);
     }
 
     void right_boundary_score::grad() const
     {
+        if (!grad_cells->empty()) {
+            auto& m = autodiff::get_output<la::cpu::tensor<double>>(score);
+
+            if (score->grad == nullptr) {
+                la::cpu::tensor<double> m_grad;
+                la::cpu::resize_as(m_grad, m);
+                score->grad = std::make_shared<la::cpu::tensor<double>>(std::move(m_grad));
+            }
+
+            grad_cells->flush(autodiff::get_grad<la::cpu::tensor<double>>(score));
+        }
+
         autodiff::eval_vertex(score, autodiff::grad_funcs);
     }
 
+    namespace {
+
+        struct segrnn_la {
+            using tensor_like = la::cpu::tensor_like<double>;
+            using tensor = la::cpu::tensor<double>;
+            using weak_tensor = la::cpu::weak_tensor<double>;
+        };
+
+    }
+
     segrnn_score::segrnn_score(std::shared_ptr<tensor_tree::vertex> param,
         std::shared_ptr<autodiff::op_t> frames)
         : segrnn_score(param, frames, 0.0, nullptr)
@@ -287,6 +406,7 @@ namespace seg {
         double dropout,
         std::default_random_engine *gen)
         : param(param), frames(frames), dropout(dropout), gen(gen)
+        , batches(std::make_shared<segrnn::batch_table>())
     {
         assert(0.0 <= dropout && dropout <= 1.0);
 
@@ -303,121 +423,37 @@ namespace seg {
             tensor_tree::get_var(param->children[7]));
     }
 
-    double segrnn_score::operator()(ifst::fst const& f,
-        int e) const
+    segrnn::edge_batch& segrnn_score::get_batch(ifst::fst const& f) const
     {
-        autodiff::computation_graph& comp_graph = *frames->graph;
-
-        int begin_size = comp_graph.vertices.size();
-
-        auto& m = autodiff::get_output<la::cpu::tensor_like<double>>(frames);
-        auto& length_param = autodiff::get_output<la::cpu::tensor_like<double>>(
-            tensor_tree::get_var(param->children[6]));
-
-        int ell = f.output(e) - 1;
-        int tail_time = f.time(f.tail(e));
-        int head_time = f.time(f.head(e));
-
-        std::shared_ptr<autodiff::op_t> left_embedding;
-
-        if (std::max<int>(0, tail_time) == 0) {
-            left_embedding = autodiff::add(std::vector<std::shared_ptr<autodiff::op_t>>{ left_end });
-        } else {
-            left_embedding = autodiff::row_at(pre_left, std::max<int>(0, tail_time));
-        }
-
-        std::shared_ptr<autodiff::op_t> right_embedding;
-
-        if (std::min<int>(m.size(0) - 1, head_time) == m.size(0) - 1) {
-            right_embedding = autodiff::add(std::vector<std::shared_ptr<autodiff::op_t>>{ right_end });
-        } else {
-            right_embedding = autodiff::row_at(pre_right, std::min<int>(m.size(0) - 1, head_time));
-        }
-
-        auto label_embedding = autodiff::row_at(pre_label, ell);
-        auto length_embedding = autodiff::row_at(pre_length,
-            std::min<int>(int(std::log(head_time - tail_time) / std::log(1.6)) + 1,
-                 length_param.size(0) - 1));
-
-        auto& theta = autodiff::get_output<la::cpu::tensor<double>>(
-            tensor_tree::get_var(param->children[11]));
+        return batches->get(f, [&](segrnn::edge_batch& b) {
+            auto& m = autodiff::get_output<segrnn_la::tensor_like>(frames);
+            auto& length_param = autodiff::get_output<segrnn_la::tensor_like>(
+                tensor_tree::get_var(param->children[6]));
 
-        la::cpu::tensor<double> mask_vec;
-
-        if (dropout == 0.0) {
-            mask_vec.resize({theta.vec_size()}, 1);
-        } else {
-            mask_vec.resize({theta.vec_size()});
-            std::bernoulli_distribution dist {1 - dropout};
-
-            for (int i = 0; i < mask_vec.vec_size(); ++i) {
-                mask_vec({i}) = dist(*gen) / (1.0 - dropout);
-            }
-        }
-
-        auto mask = comp_graph.var(mask_vec);
-
-        if (e >= edge_scores.size()) {
-            edge_scores.resize(e + 1, nullptr);
-        }
-
-        auto edge_feat = autodiff::relu(
-            autodiff::add(std::vector<std::shared_ptr<autodiff::op_t>> {
-                left_embedding,
-                right_embedding,
-                label_embedding,
-                length_embedding,
-                tensor_tree::get_var(param->children[8])
-            })
-        );
-
-        auto s_e = autodiff::dot(tensor_tree::get_var(param->children[11]),
-            autodiff::emul(mask,
-                autodiff::tanh(
-                    autodiff::add(
-                        tensor_tree::get_var(param->children[10]),
-                        autodiff::mul(
-                            edge_feat,
-                            tensor_tree::get_var(param->children[9])
-                        )
-                    )
-                )
-            ));
-
-        edge_scores[e] = s_e;
-
-        int end_size = comp_graph.vertices.size();
+            segrnn::add_rows(b, f, m.size(0), length_param.size(0));
+            segrnn::forward<segrnn_la>(b, *this);
+        });
+    }
 
-        topo_shift = end_size - begin_size;
+    double segrnn_score::operator()(ifst::fst const& f,
+        int e) const
+    {
+        segrnn::edge_batch& b = get_batch(f);
 
-        return autodiff::get_output<double>(s_e);
+        return b.score[b.row[e]];
     }
 
     void segrnn_score::accumulate_grad(double g, ifst::fst const& f,
         int e) const
     {
-        std::shared_ptr<autodiff::op_t> s_e = edge_scores[e];
-        if (s_e->grad == nullptr) {
-            s_e->grad = std::make_shared<double>(0);
-        }
-        autodiff::get_grad<double>(s_e) += g;
+        segrnn::edge_batch& b = get_batch(f);
+
+        b.score_grad[b.row[e]] += g;
     }
 
     void segrnn_score::grad() const
     {
-        autodiff::computation_graph& comp_graph = *frames->graph;
-
-        for (int i = 0; i < edge_scores.size(); ++i) {
-            std::shared_ptr<autodiff::op_t> t = edge_scores.at(i);
-
-            if (t != nullptr && t->grad != nullptr) {
-                std::vector<std::shared_ptr<autodiff::op_t>> topo_order;
-                for (int k = t->id; k > t->id - topo_shift; --k) {
-                    topo_order.push_back(comp_graph.vertices.at(k));
-                }
-                autodiff::grad(topo_order, autodiff::grad_funcs);
-            }
-        }
+        segrnn::backward<segrnn_la>(batches->batches, *this);
 
         auto guarded_grad = [&](std::shared_ptr<autodiff::op_t> t) {
             if (t->grad != nullptr) {
@@ -541,7 +577,7 @@ namespace seg {
 
     logsoftmax_score::logsoftmax_score(std::shared_ptr<autodiff::op_t> param,
             std::shared_ptr<autodiff::op_t> frames)
-        : param(param), frames(frames)
+        : param(param), frames(frames), grad_cells(std::make_shared<util::sparse_grad>())
     {
         auto& t = autodiff::get_output<la::cpu::tensor_like<double>>(param);
         first = autodiff::reshape(param, {t.size(0), t.size(1) * t.size(2)});
@@ -566,27 +602,32 @@ namespace seg {
     void logsoftmax_score::accumulate_grad(double g, ifst::fst const& f,
         int e) const
     {
-        auto& t = autodiff::get_output<la::cpu::tensor_like<double>>(param);
         auto& m = autodiff::get_output<la::cpu::tensor_like<double>>(prob);
 
-        if (prob->grad == nullptr) {
-            la::cpu::tensor<double> m_grad;
-            la::cpu::resize_as(m_grad, m);
-            prob->grad = std::make_shared<la::cpu::tensor<double>>(std::move(m_grad));
-        }
-
-        auto& m_grad = autodiff::get_grad<la::cpu::tensor_like<double>>(prob);
+        auto& t = autodiff::get_output<la::cpu::tensor_like<double>>(param);
 
         int ell = f.output(e) - 1;
         int tail_time = f.time(f.tail(e));
         int head_time = f.time(f.head(e));
         int dur = head_time - tail_time;
 
-        m_grad({head_time - 1, (int)(ell * t.size(2) + dur - 1)}) += g;
+        grad_cells->add(m, head_time - 1, (int)(ell * t.size(2) + dur - 1), g);
     }
 
     void logsoftmax_score::grad() const
     {
+        if (!grad_cells->empty()) {
+            auto& m = autodiff::get_output<la::cpu::tensor_like<double>>(prob);
+
+            if (prob->grad == nullptr) {
+                la::cpu::tensor<double> m_grad;
+                la::cpu::resize_as(m_grad, m);
+                prob->grad = std::make_shared<la::cpu::tensor<double>>(std::move(m_grad));
+            }
+
+            grad_cells->flush(autodiff::get_grad<la::cpu::tensor_like<double>>(prob));
+        }
+
         auto& g = *prob->graph;
 
         for (int i = prob->id; i >= first->id; --i) {
@@ -596,7 +637,7 @@ namespace seg {
 
     label_logsoftmax_score::label_logsoftmax_score(std::shared_ptr<autodiff::op_t> param,
             std::shared_ptr<autodiff::op_t> frames)
-        : param(param), frames(frames)
+        : param(param), frames(frames), grad_cells(std::make_shared<util::sparse_grad>())
     {
         score = autodiff::mul(frames, param);
         prob = autodiff::logsoftmax(score);
@@ -626,29 +667,33 @@ namespace seg {
 
         auto& m = autodiff::get_output<la::cpu::tensor_like<double>>(prob);
 
-        if (prob->grad == nullptr) {
-            la::cpu::tensor<double> m_grad;
-            la::cpu::resize_as(m_grad, m);
-            prob->grad = std::make_shared<la::cpu::tensor<double>>(std::move(m_grad));
-        }
-
-        auto& m_grad = autodiff::get_grad<la::cpu::tensor_like<double>>(prob);
-
         int ell = f.output(e) - 1;
         int head_time = f.time(f.head(e));
 
-        m_grad({head_time - 1, ell}) += g;
+        grad_cells->add(m, head_time - 1, ell, g);
     }
 
     void label_logsoftmax_score::grad() const
     {
+        if (!grad_cells->empty()) {
+            auto& m = autodiff::get_output<la::cpu::tensor_like<double>>(prob);
+
+            if (prob->grad == nullptr) {
+                la::cpu::tensor<double> m_grad;
+                la::cpu::resize_as(m_grad, m);
+                prob->grad = std::make_shared<la::cpu::tensor<double>>(std::move(m_grad));
+            }
+
+            grad_cells->flush(autodiff::get_grad<la::cpu::tensor_like<double>>(prob));
+        }
+
         autodiff::eval_vertex(prob, autodiff::grad_funcs);
         autodiff::eval_vertex(score, autodiff::grad_funcs);
     }
 
     length_logsoftmax_score::length_logsoftmax_score(std::shared_ptr<autodiff::op_t> param,
             std::shared_ptr<autodiff::op_t> frames)
-        : param(param), frames(frames)
+        : param(param), frames(frames), grad_cells(std::make_shared<util::sparse_grad>())
     {
         score = autodiff::mul(frames, param);
         prob = autodiff::logsoftmax(score);
@@ -678,29 +723,33 @@ namespace seg {
 
         auto& m = autodiff::get_output<la::cpu::tensor_like<double>>(prob);
 
-        if (prob->grad == nullptr) {
-            la::cpu::tensor<double> m_grad;
-            la::cpu::resize_as(m_grad, m);
-            prob->grad = std::make_shared<la::cpu::tensor<double>>(std::move(m_grad));
-        }
-
-        auto& m_grad = autodiff::get_grad<la::cpu::tensor_like<double>>(prob);
-
         int tail_time = f.time(f.tail(e));
         int head_time = f.time(f.head(e));
 
-        m_grad({head_time - 1, head_time - tail_time - 1}) += g;
+        grad_cells->add(m, head_time - 1, head_time - tail_time - 1, g);
     }
 
     void length_logsoftmax_score::grad() const
     {
+        if (!grad_cells->empty()) {
+            auto& m = autodiff::get_output<la::cpu::tensor_like<double>>(prob);
+
+            if (prob->grad == nullptr) {
+                la::cpu::tensor<double> m_grad;
+                la::cpu::resize_as(m_grad, m);
+                prob->grad = std::make_shared<la::cpu::tensor<double>>(std::move(m_grad));
+            }
+
+            grad_cells->flush(autodiff::get_grad<la::cpu::tensor_like<double>>(prob));
+        }
+
         autodiff::eval_vertex(prob, autodiff::grad_funcs);
         autodiff::eval_vertex(score, autodiff::grad_funcs);
     }
 
     label_tanh_score::label_tanh_score(std::shared_ptr<autodiff::op_t> param,
             std::shared_ptr<autodiff::op_t> frames)
-        : param(param), frames(frames)
+        : param(param), frames(frames), grad_cells(std::make_shared<util::sparse_grad>())
     {
         score = autodiff::mul(frames, param);
         prob = autodiff::tanh(score);
@@ -730,29 +779,33 @@ namespace seg {
 
         auto& m = autodiff::get_output<la::cpu::tensor_like<double>>(prob);
 
-        if (prob->grad == nullptr) {
-            la::cpu::tensor<double> m_grad;
-            la::cpu::resize_as(m_grad, m);
-            prob->grad = std::make_shared<la::cpu::tensor<double>>(std::move(m_grad));
-        }
-
-        auto& m_grad = autodiff::get_grad<la::cpu::tensor_like<double>>(prob);
-
         int ell = f.output(e) - 1;
         int head_time = f.time(f.head(e));
 
-        m_grad({head_time - 1, ell}) += g;
+        grad_cells->add(m, head_time - 1, ell, g);
     }
 
     void label_tanh_score::grad() const
     {
+        if (!grad_cells->empty()) {
+            auto& m = autodiff::get_output<la::cpu::tensor_like<double>>(prob);
+
+            if (prob->grad == nullptr) {
+                la::cpu::tensor<double> m_grad;
+                la::cpu::resize_as(m_grad, m);
+                prob->grad = std::make_shared<la::cpu::tensor<double>>(std::move(m_grad));
+            }
+
+            grad_cells->flush(autodiff::get_grad<la::cpu::tensor_like<double>>(prob));
+        }
+
         autodiff::eval_vertex(prob, autodiff::grad_funcs);
         autodiff::eval_vertex(score, autodiff::grad_funcs);
     }
 
     length_tanh_score::length_tanh_score(std::shared_ptr<autodiff::op_t> param,
             std::shared_ptr<autodiff::op_t> frames)
-        : param(param), frames(frames)
+        : param(param), frames(frames), grad_cells(std::make_shared<util::sparse_grad>())
     {
         score = autodiff::mul(frames, param);
         prob = autodiff::tanh(score);
@@ -782,22 +835,26 @@ namespace seg {
 
         auto& m = autodiff::get_output<la::cpu::tensor_like<double>>(prob);
 
-        if (prob->grad == nullptr) {
-            la::cpu::tensor<double> m_grad;
-            la::cpu::resize_as(m_grad, m);
-            prob->grad = std::make_shared<la::cpu::tensor<double>>(std::move(m_grad));
-        }
-
-        auto& m_grad = autodiff::get_grad<la::cpu::tensor_like<double>>(prob);
-
         int tail_time = f.time(f.tail(e));
         int head_time = f.time(f.head(e));
 
-        m_grad({head_time - 1, head_time - tail_time - 1}) += g;
+        grad_cells->add(m, head_time - 1, head_time - tail_time - 1, g);
     }
 
     void length_tanh_score::grad() const
     {
+        if (!grad_cells->empty()) {
+            auto& m = autodiff::get_output<la::cpu::tensor_like<double>>(prob);
+
+            if (prob->grad == nullptr) {
+                la::cpu::tensor<double> m_grad;
+                la::cpu::resize_as(m_grad, m);
+                prob->grad = std::make_shared<la::cpu::tensor<double>>(std::move(m_grad));
+            }
+
+            grad_cells->flush(autodiff::get_grad<la::cpu::tensor_like<double>>(prob));
+        }
+
         autodiff::eval_vertex(prob, autodiff::grad_funcs);
         autodiff::eval_vertex(score, autodiff::grad_funcs);
     }
@@ -5,6 +5,8 @@
 #include "fst/fst.h"
 #include "fst/ifst.h"
 #include "nn/tensor-tree.h"
+#include "seg/util.h"
+#include "seg/segrnn.h"
 #include <vector>
 #include <memory>
 
@@ -98,11 +100,23 @@ namespace seg {
         virtual void grad() const override;
     };
 
+    /*
+     * The frame sum and average scores keep, for every label, the
+     * prefix sums over time, so that a segment takes two lookups.
+     * The sums are computed in the constructor, so copies of a
+     * scorer carry their own table.  Gradients of a segment are added
+     * to the two ends of `grad_diff`, and `grad` turns the differences
+     * back into per-frame gradients in one pass.
+     *
+     */
     struct frame_sum_score
         : public seg_weight<ifst::fst> {
 
         std::shared_ptr<autodiff::op_t> frames;
 
+        std::vector<double> cumsum;
+        mutable std::vector<double> grad_diff;
+
         frame_sum_score(std::shared_ptr<autodiff::op_t> frames);
 
         virtual double operator()(ifst::fst const& f,
@@ -111,6 +125,8 @@ namespace seg {
         virtual void accumulate_grad(double g, ifst::fst const& f,
             int e) const override;
 
+        virtual void grad() const override;
+
     };
 
     struct frame_avg_score
@@ -120,6 +136,9 @@ namespace seg {
         std::shared_ptr<autodiff::op_t> frames;
         std::shared_ptr<autodiff::op_t> score;
 
+        std::vector<double> cumsum;
+        mutable std::vector<double> grad_diff;
+
         frame_avg_score(std::shared_ptr<autodiff::op_t> param,
             std::shared_ptr<autodiff::op_t> frames);
 
@@ -140,6 +159,7 @@ namespace seg {
         std::shared_ptr<autodiff::op_t> frames;
         std::shared_ptr<autodiff::op_t> score;
         double scale;
+        std::shared_ptr<util::sparse_grad> grad_cells;
 
         frame_samples_score(std::shared_ptr<autodiff::op_t> param,
             std::shared_ptr<autodiff::op_t> frames, double scale);
@@ -161,6 +181,7 @@ namespace seg {
         std::shared_ptr<autodiff::op_t> frames;
         std::shared_ptr<autodiff::op_t> score;
         int shift;
+        std::shared_ptr<util::sparse_grad> grad_cells;
 
         left_boundary_score(std::shared_ptr<autodiff::op_t> param,
             std::shared_ptr<autodiff::op_t> frames, int shift);
@@ -182,6 +203,7 @@ namespace seg {
         std::shared_ptr<autodiff::op_t> frames;
         std::shared_ptr<autodiff::op_t> score;
         int shift;
+        std::shared_ptr<util::sparse_grad> grad_cells;
 
         right_boundary_score(std::shared_ptr<autodiff::op_t> param,
             std::shared_ptr<autodiff::op_t> frames, int shift);
@@ -209,12 +231,10 @@ namespace seg {
         std::shared_ptr<autodiff::op_t> pre_label;
         std::shared_ptr<autodiff::op_t> pre_length;
 
-        mutable int topo_shift;
-
         mutable std::default_random_engine *gen;
         double dropout;
 
-        mutable std::vector<std::shared_ptr<autodiff::op_t>> edge_scores;
+        std::shared_ptr<segrnn::batch_table> batches;
 
         segrnn_score(std::shared_ptr<tensor_tree::vertex> param,
             std::shared_ptr<autodiff::op_t> frames);
@@ -224,6 +244,8 @@ namespace seg {
             double dropout,
             std::default_random_engine *gen);
 
+        segrnn::edge_batch& get_batch(ifst::fst const& f) const;
+
         virtual double operator()(ifst::fst const& f,
             int e) const override;
 
@@ -287,6 +309,7 @@ namespace seg {
         std::shared_ptr<autodiff::op_t> first;
         std::shared_ptr<autodiff::op_t> score;
         std::shared_ptr<autodiff::op_t> prob;
+        std::shared_ptr<util::sparse_grad> grad_cells;
 
         logsoftmax_score(std::shared_ptr<autodiff::op_t> param,
             std::shared_ptr<autodiff::op_t> frames);
@@ -308,6 +331,7 @@ namespace seg {
         std::shared_ptr<autodiff::op_t> frames;
         std::shared_ptr<autodiff::op_t> score;
         std::shared_ptr<autodiff::op_t> prob;
+        std::shared_ptr<util::sparse_grad> grad_cells;
 
         label_logsoftmax_score(std::shared_ptr<autodiff::op_t> param,
             std::shared_ptr<autodiff::op_t> frames);
@@ -329,6 +353,7 @@ namespace seg {
         std::shared_ptr<autodiff::op_t> frames;
         std::shared_ptr<autodiff::op_t> score;
         std::shared_ptr<autodiff::op_t> prob;
+        std::shared_ptr<util::sparse_grad> grad_cells;
 
         length_logsoftmax_score(std::shared_ptr<autodiff::op_t> param,
             std::shared_ptr<autodiff::op_t> frames);
@@ -350,6 +375,7 @@ namespace seg {
         std::shared_ptr<autodiff::op_t> frames;
         std::shared_ptr<autodiff::op_t> score;
         std::shared_ptr<autodiff::op_t> prob;
+        std::shared_ptr<util::sparse_grad> grad_cells;
 
         label_tanh_score(std::shared_ptr<autodiff::op_t> param,
             std::shared_ptr<autodiff::op_t> frames);
@@ -371,6 +397,7 @@ namespace seg {
         std::shared_ptr<autodiff::op_t> frames;
         std::shared_ptr<autodiff::op_t> score;
         std::shared_ptr<autodiff::op_t> prob;
+        std::shared_ptr<util::sparse_grad> grad_cells;
 
         length_tanh_score(std::shared_ptr<autodiff::op_t> param,
             std::shared_ptr<autodiff::op_t> frames);
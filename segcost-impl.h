@@ -1,55 +1,202 @@
 namespace segcost {
 
     template <class symbol>
-    double hit_cost<symbol>::operator()(std::vector<segment<symbol>> const& gold_segs,
-        segment<symbol> const& e) const
+    cost_table<symbol>::cost_table()
+        : start_time(0), end_time(0), contiguous(false)
+    {}
+
+    template <class symbol>
+    cost_table<symbol>::cost_table(std::vector<segment<symbol>> const& gold_segs)
+        : gold_segs(gold_segs), start_time(0), end_time(0), contiguous(false)
     {
-        if (e.start_time == e.end_time && e.label == 0) {
-            return 0.01;
+        if (gold_segs.size() == 0) {
+            return;
         }
 
-        if (e.start_time == e.end_time) {
-            return 0;
+        contiguous = true;
+
+        for (int i = 1; i < gold_segs.size(); ++i) {
+            if (gold_segs[i].start_time != gold_segs[i - 1].end_time
+                    || gold_segs[i].end_time < gold_segs[i].start_time) {
+                contiguous = false;
+                return;
+            }
         }
 
-        segment<symbol> max_seg;
-        int max_overlap = -1;
+        start_time = gold_segs.front().start_time;
+        end_time = gold_segs.back().end_time;
+
+        frame_seg.resize(end_time - start_time);
+
+        for (int i = 0; i < gold_segs.size(); ++i) {
+            for (long t = gold_segs[i].start_time; t < gold_segs[i].end_time; ++t) {
+                frame_seg[t - start_time] = i;
+            }
+
+            label_segs[gold_segs[i].label].push_back(i);
+        }
+
+        for (long t = start_time; t <= end_time; ++t) {
+            hit_first.push_back(hit_first_seg(gold_segs, t));
+            hit_last.push_back(hit_last_seg(gold_segs, t));
+        }
 
+        // longest[k][i] is the first longest segment among i, ..., i + 2^k - 1.
+
+        longest.push_back(std::vector<int>(gold_segs.size()));
+
+        for (int i = 0; i < gold_segs.size(); ++i) {
+            longest[0][i] = i;
+        }
+
+        for (int k = 1; (1 << k) <= gold_segs.size(); ++k) {
+            std::vector<int> const& prev = longest[k - 1];
+            std::vector<int> level(gold_segs.size() - (1 << k) + 1);
+
+            for (int i = 0; i < level.size(); ++i) {
+                int a = prev[i];
+                int b = prev[i + (1 << (k - 1))];
+
+                level[i] = (gold_segs[b].end_time - gold_segs[b].start_time
+                    > gold_segs[a].end_time - gold_segs[a].start_time) ? b : a;
+            }
+
+            longest.push_back(std::move(level));
+        }
+    }
+
+    template <class symbol>
+    bool cost_table<symbol>::covers(segment<symbol> const& e) const
+    {
+        return contiguous && start_time <= e.start_time && e.start_time < e.end_time
+            && e.end_time <= end_time;
+    }
+
+    template <class symbol>
+    segment<symbol> const& cost_table<symbol>::max_overlap(
+        segment<symbol> const& e, int& overlap) const
+    {
+        assert(covers(e));
+
+        int first = frame_seg[e.start_time - start_time];
+        int last = frame_seg[e.end_time - 1 - start_time];
+
+        if (first == last) {
+            overlap = e.end_time - e.start_time;
+            return gold_segs[first];
+        }
+
+        // Ties go to the earlier segment, as in the linear scan.
+
+        int max_seg = first;
+        overlap = gold_segs[first].end_time - e.start_time;
+
+        if (first + 1 < last) {
+            int k = 0;
+            while ((2 << k) <= last - first - 1) {
+                ++k;
+            }
+
+            int a = longest[k][first + 1];
+            int b = longest[k][last - (1 << k)];
+            int mid = (gold_segs[b].end_time - gold_segs[b].start_time
+                > gold_segs[a].end_time - gold_segs[a].start_time) ? b : a;
+
+            int mid_overlap = gold_segs[mid].end_time - gold_segs[mid].start_time;
+
+            if (mid_overlap > overlap) {
+                max_seg = mid;
+                overlap = mid_overlap;
+            }
+        }
+
+        int last_overlap = e.end_time - gold_segs[last].start_time;
+
+        if (last_overlap > overlap) {
+            max_seg = last;
+            overlap = last_overlap;
+        }
+
+        return gold_segs[max_seg];
+    }
+
+    template <class symbol>
+    bool cost_table<symbol>::hit(segment<symbol> const& e) const
+    {
+        assert(covers(e));
+
+        auto iter = label_segs.find(e.label);
+
+        if (iter == label_segs.end()) {
+            return false;
+        }
+
+        int first = hit_first[e.start_time - start_time];
+        int last = hit_last[e.end_time - start_time];
+
+        auto k = std::lower_bound(iter->second.begin(), iter->second.end(), first);
+
+        return k != iter->second.end() && *k <= last;
+    }
+
+    template <class symbol>
+    int hit_first_seg(std::vector<segment<symbol>> const& gold_segs, long t)
+    {
         int left = 0;
         int right = gold_segs.size() - 1;
 
         while (left + 1 < right) {
             int mid = int((left + right) / 2);
 
-            if (e.start_time == gold_segs[mid].start_time) {
+            if (t == gold_segs[mid].start_time) {
                 left = mid;
                 break;
-            } else if (e.start_time > gold_segs[mid].start_time) {
+            } else if (t > gold_segs[mid].start_time) {
                 left = mid;
             } else {
                 right = mid;
             }
         }
 
-        int start_left = left;
+        return left;
+    }
 
-        left = 0;
-        right = gold_segs.size() - 1;
+    template <class symbol>
+    int hit_last_seg(std::vector<segment<symbol>> const& gold_segs, long t)
+    {
+        int left = 0;
+        int right = gold_segs.size() - 1;
 
         while (left + 1 < right) {
             int mid = int((left + right) / 2);
 
-            if (e.end_time == gold_segs[mid].end_time) {
+            if (t == gold_segs[mid].end_time) {
                 left = mid;
                 break;
-            } else if (e.end_time > gold_segs[mid].end_time) {
+            } else if (t > gold_segs[mid].end_time) {
                 left = mid;
             } else {
                 right = mid;
             }
         }
 
-        int end_right = right;
+        return right;
+    }
+
+    template <class symbol>
+    double hit_cost<symbol>::operator()(std::vector<segment<symbol>> const& gold_segs,
+        segment<symbol> const& e) const
+    {
+        if (e.start_time == e.end_time && e.label == 0) {
+            return 0.01;
+        }
+
+        if (e.start_time == e.end_time) {
+            return 0;
+        }
+
+        int start_left = hit_first_seg(gold_segs, e.start_time);
+        int end_right = hit_last_seg(gold_segs, e.end_time);
 
         for (int i = start_left; i <= end_right; ++i) {
             auto& s = gold_segs[i];
@@ -62,6 +209,17 @@ namespace segcost {
         return 1;
     }
 
+    template <class symbol>
+    double hit_cost<symbol>::operator()(cost_table<symbol> const& table,
+        segment<symbol> const& e) const
+    {
+        if (!table.covers(e)) {
+            return (*this)(table.gold_segs, e);
+        }
+
+        return table.hit(e) ? 0 : 1;
+    }
+
     template <class symbol>
     overlap_cost<symbol>::overlap_cost()
     {}
@@ -151,6 +309,33 @@ namespace segcost {
         }
     }
 
+    template <class symbol>
+    double overlap_cost<symbol>::operator()(cost_table<symbol> const& table,
+        segment<symbol> const& e) const
+    {
+        if (!table.covers(e)) {
+            return (*this)(table.gold_segs, e);
+        }
+
+        int max_overlap;
+        segment<symbol> const& max_seg = table.max_overlap(e, max_overlap);
+
+        int union_ = std::max(max_seg.end_time, e.end_time)
+            - std::min(max_seg.start_time, e.start_time);
+
+        for (auto& s: sils) {
+            if (e.label == s && e.label == max_seg.label) {
+                return (e.end_time - e.start_time) - max_overlap;
+            }
+        }
+
+        if (e.label == max_seg.label) {
+            return union_ - max_overlap;
+        } else {
+            return union_;
+        }
+    }
+
     template <class symbol>
     overlap_portion_cost<symbol>::overlap_portion_cost()
     {}
@@ -240,6 +425,33 @@ namespace segcost {
         }
     }
 
+    template <class symbol>
+    double overlap_portion_cost<symbol>::operator()(cost_table<symbol> const& table,
+        segment<symbol> const& e) const
+    {
+        if (!table.covers(e)) {
+            return (*this)(table.gold_segs, e);
+        }
+
+        int max_overlap;
+        segment<symbol> const& max_seg = table.max_overlap(e, max_overlap);
+
+        int union_ = std::max(max_seg.end_time, e.end_time)
+            - std::min(max_seg.start_time, e.start_time);
+
+        for (auto& s: sils) {
+            if (e.label == s && e.label == max_seg.label) {
+                return 1 - max_overlap / double(e.end_time - e.start_time);
+            }
+        }
+
+        if (e.label == max_seg.label) {
+            return 1 - max_overlap / double(union_);
+        } else {
+            return 1;
+        }
+    }
+
     template <class symbol>
     cover_cost<symbol>::cover_cost()
     {}
@@ -322,4 +534,22 @@ namespace segcost {
         }
     }
 
+    template <class symbol>
+    double cover_cost<symbol>::operator()(cost_table<symbol> const& table,
+        segment<symbol> const& e) const
+    {
+        if (!table.covers(e)) {
+            return (*this)(table.gold_segs, e);
+        }
+
+        int max_overlap;
+        segment<symbol> const& max_seg = table.max_overlap(e, max_overlap);
+
+        if (e.label == max_seg.label) {
+            return 1 - max_overlap / double(e.end_time - e.start_time);
+        } else {
+            return 1 - 0.5 * max_overlap / double(e.end_time - e.start_time);
+        }
+    }
+
 }
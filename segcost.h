@@ -1,7 +1,10 @@
-#ifndef SEG_COST_H
-#define SEG_COST_H
+#ifndef SEGCOST_H
+#define SEGCOST_H
 
 #include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <cassert>
 
 namespace segcost {
 
@@ -12,6 +15,57 @@ namespace segcost {
         symbol label;
     };
 
+    /*
+     * Per-utterance lookup tables over a gold segmentation.  Every frame
+     * maps to the gold segment covering it, and a sparse table over the
+     * segment lengths answers the longest segment in a range, so the gold
+     * segment with the largest overlap can be found in constant time.
+     * Segments of each label are kept in order for the hit test, and
+     * `hit_first` and `hit_last` hold, per time, the range of gold
+     * segments the hit test of `hit_cost` looks at for a segment
+     * starting or ending there.
+     *
+     * The tables only apply when the gold segments are contiguous and
+     * the queried segment lies within them; `covers` says whether that
+     * is the case.
+     */
+    template <class symbol>
+    struct cost_table {
+
+        std::vector<segment<symbol>> gold_segs;
+
+        long start_time;
+        long end_time;
+        bool contiguous;
+
+        std::vector<int> frame_seg;
+        std::vector<std::vector<int>> longest;
+        std::unordered_map<symbol, std::vector<int>> label_segs;
+        std::vector<int> hit_first;
+        std::vector<int> hit_last;
+
+        cost_table();
+        cost_table(std::vector<segment<symbol>> const& gold_segs);
+
+        bool covers(segment<symbol> const& e) const;
+
+        segment<symbol> const& max_overlap(segment<symbol> const& e, int& overlap) const;
+
+        bool hit(segment<symbol> const& e) const;
+
+    };
+
+    /*
+     * The two binary searches of the hit test: the first gold segment
+     * to look at for a segment starting at `t`, and the last one for
+     * a segment ending at `t`.
+     */
+    template <class symbol>
+    int hit_first_seg(std::vector<segment<symbol>> const& gold_segs, long t);
+
+    template <class symbol>
+    int hit_last_seg(std::vector<segment<symbol>> const& gold_segs, long t);
+
     template <class symbol>
     struct cost {
         
@@ -21,6 +75,12 @@ namespace segcost {
         virtual double operator()(std::vector<segment<symbol>> const& gold_edges,
             segment<symbol> const& e) const = 0;
 
+        virtual double operator()(cost_table<symbol> const& table,
+            segment<symbol> const& e) const
+        {
+            return (*this)(table.gold_segs, e);
+        }
+
     };
 
     template <class symbol>
@@ -30,6 +90,9 @@ namespace segcost {
         virtual double operator()(std::vector<segment<symbol>> const& gold_edges,
             segment<symbol> const& e) const override;
 
+        virtual double operator()(cost_table<symbol> const& table,
+            segment<symbol> const& e) const override;
+
     };
 
     template <class symbol>
@@ -44,6 +107,9 @@ namespace segcost {
         virtual double operator()(std::vector<segment<symbol>> const& gold_edges,
             segment<symbol> const& e) const override;
 
+        virtual double operator()(cost_table<symbol> const& table,
+            segment<symbol> const& e) const override;
+
     };
 
     template <class symbol>
@@ -58,6 +124,9 @@ namespace segcost {
         virtual double operator()(std::vector<segment<symbol>> const& gold_edges,
             segment<symbol> const& e) const override;
 
+        virtual double operator()(cost_table<symbol> const& table,
+            segment<symbol> const& e) const override;
+
     };
 
     template <class symbol>
@@ -72,10 +141,13 @@ namespace segcost {
         virtual double operator()(std::vector<segment<symbol>> const& gold_edges,
             segment<symbol> const& e) const override;
 
+        virtual double operator()(cost_table<symbol> const& table,
+            segment<symbol> const& e) const override;
+
     };
 
 }
 
-#include "seg/segcost.h"
+#include "seg/segcost-impl.h"
 
 #endif
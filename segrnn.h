@@ -0,0 +1,365 @@
+#ifndef SEGRNN_H
+#define SEGRNN_H
+
+#include "autodiff/autodiff.h"
+#include "nn/tensor-tree.h"
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <random>
+#include <cmath>
+#include <algorithm>
+
+namespace segrnn {
+
+    /*
+     * The segmental RNN score of an edge is a two-layer network over
+     * the sum of the embeddings of its left end, right end, label and
+     * length.  All edges of a graph are scored as one batch, with one
+     * row per edge in the order of `f.edges()`, and `row` maps an edge
+     * id to its row.  The hidden and output layers are kept so that
+     * `backward` can handle all edges of the batch at once.
+     *
+     * The scorers of fscrf and seg share this code.  They differ in
+     * the fst and in the la namespace, which is passed as a struct
+     * with the `tensor_like`, `tensor` and `weak_tensor` types;
+     * `mul`, `ltmul`, `rtmul` and `resize_as` are found from the
+     * tensor types.
+     *
+     */
+    struct edge_batch {
+        std::shared_ptr<void const> data;
+        std::vector<int> row;
+
+        std::vector<int> left;
+        std::vector<int> right;
+        std::vector<int> label;
+        std::vector<int> length;
+
+        std::vector<double> hidden;
+        std::vector<double> output;
+        std::vector<double> mask;
+
+        std::vector<double> score;
+        std::vector<double> score_grad;
+    };
+
+    /*
+     * A scorer keeps one batch per fst.  Batches are built under
+     * `mutex` and do not change afterwards, other than `score_grad`.
+     * The batch resolved last is published in `last`, so the edges of
+     * the graph being swept are looked up with one atomic load, and
+     * the mutex is only taken when a sweep moves to another fst.
+     *
+     */
+    struct batch_table {
+        std::mutex mutex;
+        std::vector<std::shared_ptr<edge_batch>> batches;
+        std::atomic<edge_batch*> last;
+
+        batch_table();
+
+        template <class fst, class build>
+        edge_batch& get(fst const& f, build b);
+    };
+
+    template <class fst>
+    void add_rows(edge_batch& b, fst const& f, int frames, int lengths);
+
+    template <class la_types>
+    typename la_types::tensor_like& grad_tensor(std::shared_ptr<autodiff::op_t> t);
+
+    template <class la_types, class score>
+    void forward(edge_batch& b, score const& s);
+
+    /*
+     * `backward` adds the gradients of all batches to the parameters
+     * and to the embeddings of `s`, and clears `score_grad`.  It
+     * returns false if no edge has a gradient.
+     *
+     */
+    template <class la_types, class score>
+    bool backward(std::vector<std::shared_ptr<edge_batch>> const& batches,
+        score const& s);
+
+}
+
+namespace segrnn {
+
+    inline batch_table::batch_table()
+        : last(nullptr)
+    {}
+
+    template <class fst, class build>
+    edge_batch& batch_table::get(fst const& f, build b)
+    {
+        edge_batch *p = last.load(std::memory_order_acquire);
+
+        if (p != nullptr && p->data == f.data) {
+            return *p;
+        }
+
+        std::lock_guard<std::mutex> lock { mutex };
+
+        for (auto& q: batches) {
+            if (q->data == f.data) {
+                last.store(q.get(), std::memory_order_release);
+                return *q;
+            }
+        }
+
+        auto q = std::make_shared<edge_batch>();
+        q->data = f.data;
+        b(*q);
+
+        batches.push_back(q);
+        last.store(q.get(), std::memory_order_release);
+
+        return *q;
+    }
+
+    template <class fst>
+    void add_rows(edge_batch& b, fst const& f, int frames, int lengths)
+    {
+        auto const& edges = f.edges();
+        int rows = edges.size();
+
+        int max_edge = -1;
+        for (auto& e: edges) {
+            max_edge = std::max<int>(max_edge, e);
+        }
+
+        b.row.resize(max_edge + 1, -1);
+
+        for (int i = 0; i < rows; ++i) {
+            int e = edges[i];
+
+            int tail_time = f.time(f.tail(e));
+            int head_time = f.time(f.head(e));
+
+            b.row[e] = i;
+            b.left.push_back(tail_time <= 0 ? -1 : tail_time);
+            b.right.push_back(head_time >= frames - 1 ? -1 : head_time);
+            b.label.push_back(f.output(e) - 1);
+            b.length.push_back(std::min<int>(int(std::log(head_time - tail_time) / std::log(1.6)) + 1,
+                lengths - 1));
+        }
+    }
+
+    template <class la_types>
+    typename la_types::tensor_like& grad_tensor(std::shared_ptr<autodiff::op_t> t)
+    {
+        using tensor_like = typename la_types::tensor_like;
+        using tensor = typename la_types::tensor;
+
+        if (t->grad == nullptr) {
+            auto& v = autodiff::get_output<tensor_like>(t);
+            tensor v_grad;
+            resize_as(v_grad, v);
+            t->grad = std::make_shared<tensor>(std::move(v_grad));
+        }
+
+        return autodiff::get_grad<tensor_like>(t);
+    }
+
+    template <class la_types, class score>
+    void forward(edge_batch& b, score const& s)
+    {
+        using tensor_like = typename la_types::tensor_like;
+        using weak_tensor = typename la_types::weak_tensor;
+
+        auto& left_mat = autodiff::get_output<tensor_like>(s.pre_left);
+        auto& right_mat = autodiff::get_output<tensor_like>(s.pre_right);
+        auto& label_mat = autodiff::get_output<tensor_like>(s.pre_label);
+        auto& length_mat = autodiff::get_output<tensor_like>(s.pre_length);
+        auto& left_vec = autodiff::get_output<tensor_like>(s.left_end);
+        auto& right_vec = autodiff::get_output<tensor_like>(s.right_end);
+
+        auto& b1 = autodiff::get_output<tensor_like>(tensor_tree::get_var(s.param->children[8]));
+        auto& w = autodiff::get_output<tensor_like>(tensor_tree::get_var(s.param->children[9]));
+        auto& b2 = autodiff::get_output<tensor_like>(tensor_tree::get_var(s.param->children[10]));
+        auto& theta = autodiff::get_output<tensor_like>(tensor_tree::get_var(s.param->children[11]));
+
+        int rows = b.left.size();
+        int hidden = b1.vec_size();
+        int out = b2.vec_size();
+
+        if (s.dropout != 0.0) {
+            b.mask.resize(rows * out);
+            std::bernoulli_distribution dist {1 - s.dropout};
+
+            for (int i = 0; i < b.mask.size(); ++i) {
+                b.mask[i] = dist(*s.gen) / (1.0 - s.dropout);
+            }
+        }
+
+        b.hidden.resize(rows * hidden);
+        b.output.resize(rows * out);
+        b.score.resize(rows);
+        b.score_grad.resize(rows, 0);
+
+        #pragma omp parallel for
+        for (int i = 0; i < rows; ++i) {
+            double const *l = (b.left[i] == -1 ? left_vec.data() : left_mat.data() + b.left[i] * hidden);
+            double const *r = (b.right[i] == -1 ? right_vec.data() : right_mat.data() + b.right[i] * hidden);
+            double const *a = label_mat.data() + b.label[i] * hidden;
+            double const *d = length_mat.data() + b.length[i] * hidden;
+            double const *bias = b1.data();
+
+            double *h = b.hidden.data() + i * hidden;
+
+            for (int k = 0; k < hidden; ++k) {
+                h[k] = std::max<double>(0, l[k] + r[k] + a[k] + d[k] + bias[k]);
+            }
+
+            double *o = b.output.data() + i * out;
+
+            for (int j = 0; j < out; ++j) {
+                o[j] = b2.data()[j];
+            }
+        }
+
+        if (rows > 0) {
+            weak_tensor h_mat { b.hidden.data(), { (unsigned int) rows, (unsigned int) hidden } };
+            weak_tensor o_mat { b.output.data(), { (unsigned int) rows, (unsigned int) out } };
+
+            mul(o_mat, h_mat, w);
+        }
+
+        #pragma omp parallel for
+        for (int i = 0; i < rows; ++i) {
+            double *o = b.output.data() + i * out;
+            double s_i = 0;
+
+            for (int j = 0; j < out; ++j) {
+                o[j] = std::tanh(o[j]);
+                s_i += theta.data()[j] * (b.mask.size() == 0 ? o[j] : b.mask[i * out + j] * o[j]);
+            }
+
+            b.score[i] = s_i;
+        }
+    }
+
+    template <class la_types, class score>
+    bool backward(std::vector<std::shared_ptr<edge_batch>> const& batches,
+        score const& s)
+    {
+        using tensor_like = typename la_types::tensor_like;
+        using weak_tensor = typename la_types::weak_tensor;
+
+        bool has_grad = false;
+
+        for (auto& b: batches) {
+            for (int i = 0; i < b->score_grad.size() && !has_grad; ++i) {
+                has_grad = (b->score_grad[i] != 0);
+            }
+        }
+
+        if (!has_grad) {
+            return false;
+        }
+
+        auto& w = autodiff::get_output<tensor_like>(tensor_tree::get_var(s.param->children[9]));
+        auto& theta = autodiff::get_output<tensor_like>(tensor_tree::get_var(s.param->children[11]));
+
+        auto& b1_grad = grad_tensor<la_types>(tensor_tree::get_var(s.param->children[8]));
+        auto& w_grad = grad_tensor<la_types>(tensor_tree::get_var(s.param->children[9]));
+        auto& b2_grad = grad_tensor<la_types>(tensor_tree::get_var(s.param->children[10]));
+        auto& theta_grad = grad_tensor<la_types>(tensor_tree::get_var(s.param->children[11]));
+
+        auto& left_grad = grad_tensor<la_types>(s.pre_left);
+        auto& right_grad = grad_tensor<la_types>(s.pre_right);
+        auto& label_grad = grad_tensor<la_types>(s.pre_label);
+        auto& length_grad = grad_tensor<la_types>(s.pre_length);
+
+        int hidden = b1_grad.vec_size();
+        int out = b2_grad.vec_size();
+
+        std::vector<int> active;
+        std::vector<double> h;
+        std::vector<double> o_grad;
+        std::vector<double> h_grad;
+
+        for (auto& b_ptr: batches) {
+            edge_batch& b = *b_ptr;
+
+            active.clear();
+
+            for (int i = 0; i < b.score_grad.size(); ++i) {
+                if (b.score_grad[i] != 0) {
+                    active.push_back(i);
+                }
+            }
+
+            if (active.size() == 0) {
+                continue;
+            }
+
+            int n = active.size();
+
+            h.resize(n * hidden);
+            o_grad.resize(n * out);
+            h_grad.assign(n * hidden, 0);
+
+            for (int m = 0; m < n; ++m) {
+                int i = active[m];
+                double g = b.score_grad[i];
+
+                double const *o = b.output.data() + i * out;
+                double *og = o_grad.data() + m * out;
+
+                std::copy(b.hidden.data() + i * hidden, b.hidden.data() + (i + 1) * hidden,
+                    h.data() + m * hidden);
+
+                for (int j = 0; j < out; ++j) {
+                    double mask = (b.mask.size() == 0 ? 1 : b.mask[i * out + j]);
+
+                    theta_grad.data()[j] += g * mask * o[j];
+                    og[j] = g * theta.data()[j] * mask * (1 - o[j] * o[j]);
+                    b2_grad.data()[j] += og[j];
+                }
+
+                b.score_grad[i] = 0;
+            }
+
+            weak_tensor h_mat { h.data(), { (unsigned int) n, (unsigned int) hidden } };
+            weak_tensor o_grad_mat { o_grad.data(), { (unsigned int) n, (unsigned int) out } };
+            weak_tensor h_grad_mat { h_grad.data(), { (unsigned int) n, (unsigned int) hidden } };
+
+            ltmul(w_grad, h_mat, o_grad_mat);
+            rtmul(h_grad_mat, o_grad_mat, w);
+
+            for (int m = 0; m < n; ++m) {
+                int i = active[m];
+
+                double const *hm = h.data() + m * hidden;
+                double *hg = h_grad.data() + m * hidden;
+
+                double *l = (b.left[i] == -1 ? grad_tensor<la_types>(s.left_end).data()
+                    : left_grad.data() + b.left[i] * hidden);
+                double *r = (b.right[i] == -1 ? grad_tensor<la_types>(s.right_end).data()
+                    : right_grad.data() + b.right[i] * hidden);
+                double *a = label_grad.data() + b.label[i] * hidden;
+                double *d = length_grad.data() + b.length[i] * hidden;
+
+                for (int k = 0; k < hidden; ++k) {
+                    if (hm[k] == 0) {
+                        continue;
+                    }
+
+                    b1_grad.data()[k] += hg[k];
+                    l[k] += hg[k];
+                    r[k] += hg[k];
+                    a[k] += hg[k];
+                    d[k] += hg[k];
+                }
+            }
+        }
+
+        return true;
+    }
+
+}
+
+#endif
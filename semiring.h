@@ -0,0 +1,922 @@
+#ifndef SEMIRING_H
+#define SEMIRING_H
+
+#include <unordered_map>
+#include <vector>
+#include <limits>
+#include <algorithm>
+#include <memory>
+#include <cmath>
+#include <type_traits>
+#include <cassert>
+#include "ebt/ebt.h"
+
+/*
+ * The shortest-distance sweep, the semirings it runs on, and the
+ * weight array shared by the sweeps of a loss.  The header only
+ * relies on the member functions of an fst, not on the fst classes
+ * in seg/fst.h, so it can be used with any fst library that
+ * provides `vertex`, `edge`, `in_edges`, `tail`, `weight` and
+ * friends.
+ *
+ */
+
+namespace fst {
+
+    template <class edge>
+    struct edge_trait;
+
+    /*
+     * `state_map` holds the per-vertex (and per-edge) state of the
+     * algorithms below.  In general it is a hash map.  When the key
+     * is integral, as it is for `ilat::fst`, vertices and edges are
+     * dense ids, and the state is kept in a flat array indexed by
+     * the id instead.  This keeps the sweeps free of hashing.
+     *
+     */
+    template <class key, class value, class enable = void>
+    struct state_map {
+
+        std::unordered_map<key, value> map;
+
+        bool has(key const& k) const
+        {
+            return ebt::in(k, map);
+        }
+
+        value& operator[](key const& k)
+        {
+            return map[k];
+        }
+
+        value& at(key const& k)
+        {
+            return map.at(k);
+        }
+
+        value const& at(key const& k) const
+        {
+            return map.at(k);
+        }
+
+        void erase(key const& k)
+        {
+            map.erase(k);
+        }
+
+        void clear()
+        {
+            map.clear();
+        }
+
+    };
+
+    template <class key, class value>
+    struct state_map<key, value,
+            typename std::enable_if<std::is_integral<key>::value>::type> {
+
+        std::vector<value> values;
+        std::vector<char> reached;
+
+        bool has(key k) const
+        {
+            return 0 <= k && k < reached.size() && reached[k];
+        }
+
+        value& operator[](key k)
+        {
+            assert(k >= 0);
+
+            if (k >= values.size()) {
+                values.resize(k + 1);
+                reached.resize(k + 1, 0);
+            }
+
+            reached[k] = 1;
+
+            return values[k];
+        }
+
+        value& at(key k)
+        {
+            assert(has(k));
+
+            return values[k];
+        }
+
+        value const& at(key k) const
+        {
+            assert(has(k));
+
+            return values[k];
+        }
+
+        void erase(key k)
+        {
+            if (has(k)) {
+                reached[k] = 0;
+            }
+        }
+
+        void clear()
+        {
+            values.clear();
+            reached.clear();
+        }
+
+    };
+
+    /*
+     * The semirings below define `value`, `zero()`, `one()`, `plus`
+     * and `times`.  `times(v, f, e)` extends the value `v` of a
+     * vertex along the edge `e`.  Unreachable vertices never take
+     * part in `times`.  `score(v)` is the log-domain score of a value
+     * that pruning compares against the beam.
+     *
+     */
+    template <class fst>
+    struct tropical_semiring {
+
+        using edge = typename fst::edge;
+
+        struct extra_data {
+            edge pi;
+            double value;
+        };
+
+        using value = extra_data;
+
+        value zero() const;
+        value one() const;
+        value plus(value const& a, value const& b) const;
+        value times(value const& a, fst const& f, edge const& e) const;
+        double score(value const& a) const;
+
+    };
+
+    template <class fst>
+    struct log_semiring {
+
+        using edge = typename fst::edge;
+        using value = double;
+
+        value zero() const;
+        value one() const;
+        value plus(value a, value b) const;
+        value times(value a, fst const& f, edge const& e) const;
+        double score(value a) const;
+
+    };
+
+    /*
+     * The expectation semiring carries the log sum of the path weights
+     * together with the expected risk of the paths, normalized by the
+     * sum.  The class `risk` needs an `operator()(f, e)` that returns
+     * the risk of an edge.
+     *
+     */
+    template <class fst, class risk>
+    struct expectation_semiring {
+
+        using edge = typename fst::edge;
+
+        struct value {
+            double log_sum;
+            double exp;
+        };
+
+        std::shared_ptr<risk> r;
+
+        expectation_semiring() = default;
+
+        template <class risk_type>
+        expectation_semiring(std::shared_ptr<risk_type> r);
+
+        value zero() const;
+        value one() const;
+        value plus(value const& a, value const& b) const;
+        value times(value const& a, fst const& f, edge const& e) const;
+        double score(value const& a) const;
+
+    };
+
+    /*
+     * `topo_levels` is a topological order grouped into levels.  The
+     * level of a vertex is the length of the longest path to it from
+     * a vertex with no incoming edges, so no edge connects two vertices
+     * of the same level, and the vertices of a level can be visited
+     * in any order, or at the same time.  Level `i` is
+     * `order[begin[i]]` to `order[begin[i + 1] - 1]`.
+     *
+     */
+    template <class vertex>
+    struct topo_levels {
+        std::vector<vertex> order;
+        std::vector<int> begin;
+    };
+
+    template <class fst>
+    topo_levels<typename fst::vertex> make_topo_levels(fst const& f,
+        std::vector<typename fst::vertex> const& order);
+
+    /*
+     * `make_time_levels` orders the vertices of a timed fst with a
+     * counting sort on their times, one level per distinct time, in
+     * time linear in the number of vertices and the span of times.
+     * This is a topological order, and the levels can be swept in
+     * parallel, as long as every edge goes strictly forward in time.
+     * Unless `check` is false, the edges are checked, and false is
+     * returned if one does not.  The vertices are those of `vertices()`.
+     *
+     */
+    template <class fst>
+    bool make_time_levels(fst const& f, topo_levels<typename fst::vertex>& levels,
+        bool check = true);
+
+    /*
+     * A direction tells the sweep where the values start, which
+     * edges to merge at a vertex, which end of an edge the value
+     * comes from, and in which order to visit the levels of a
+     * `topo_levels` and the times of a timed fst.
+     *
+     */
+    template <class fst>
+    struct forward_sweep {
+
+        using vertex = typename fst::vertex;
+        using edge = typename fst::edge;
+
+        static std::vector<vertex> const& sources(fst const& f);
+        static std::vector<edge> const& edges(fst const& f, vertex const& v);
+        static vertex from(fst const& f, edge const& e);
+        static int level(int i, int levels);
+        static bool earlier(long t1, long t2);
+
+    };
+
+    template <class fst>
+    struct backward_sweep {
+
+        using vertex = typename fst::vertex;
+        using edge = typename fst::edge;
+
+        static std::vector<vertex> const& sources(fst const& f);
+        static std::vector<edge> const& edges(fst const& f, vertex const& v);
+        static vertex from(fst const& f, edge const& e);
+        static int level(int i, int levels);
+        static bool earlier(long t1, long t2);
+
+    };
+
+    /*
+     * `merge` visits the vertices in `order`, which should be a
+     * topological order for `forward_sweep` and a reversed one for
+     * `backward_sweep`.  Sources that have not been seeded by the
+     * caller start at `one()`.  Every vertex in `order` ends up in
+     * `extra`; vertices that cannot be reached hold `zero()`.
+     *
+     * The second `merge` takes the levels of a forward topological
+     * order for both directions, and relaxes the vertices of a level
+     * in parallel when built with OpenMP.  The whole sweep runs in one
+     * parallel region, with a barrier between levels, so the weights
+     * and the semiring have to be safe to call from several threads;
+     * `weight_array_fst` is.
+     *
+     * `beam_merge` and `posterior_merge` are the pruned sweeps.
+     *
+     * `beam_merge` needs a timed fst whose edges never go back in
+     * time.  It visits the vertices time by time, in the direction of
+     * the sweep, and keeps a frontier of the vertices whose edges
+     * reach past the current time.  After each time, the frontier
+     * loses the vertices scoring more than `beam` below the best
+     * vertex at that time, and if `max_active` is positive, all but
+     * the best `max_active`.  No more edges are taken out of a vertex
+     * once it leaves the frontier, so their weights are never
+     * evaluated.  This prunes graphs with one vertex per time as
+     * well, since the older vertices of the frontier compete with the
+     * newest one.  Pruned vertices keep their values in `extra`, so
+     * that best paths can be traced back through them.
+     *
+     * `posterior_merge` takes the values of a finished sweep in the
+     * other direction, typically a forward pass with `beam_merge`.
+     * Vertices that the other sweep did not reach are skipped, and a
+     * vertex is dropped when the score of its two values falls below
+     * the total by more than log(`threshold`).  Dropped vertices are
+     * left out of `extra`, as if they could not be reached.
+     *
+     */
+    template <class fst, class semiring, class direction>
+    struct shortest_distance {
+
+        using vertex = typename fst::vertex;
+        using edge = typename fst::edge;
+        using value = typename semiring::value;
+
+        semiring ring;
+
+        state_map<vertex, value> extra;
+
+        shortest_distance() = default;
+
+        shortest_distance(semiring ring);
+
+        void merge(fst const& f, std::vector<vertex> const& order);
+        void merge(fst const& f, topo_levels<vertex> const& levels);
+
+        void beam_merge(fst const& f, std::vector<vertex> const& order,
+            double beam, int max_active = 0);
+
+        void posterior_merge(fst const& f, std::vector<vertex> const& order,
+            state_map<vertex, value> const& other, double threshold);
+
+        value relax(fst const& f, vertex const& u) const;
+
+    };
+
+    /*
+     * `make_weight_array` evaluates the weight of every edge once
+     * and stores it at the index of the edge id.  The edges have to
+     * be integers.  The weights are evaluated in one thread, because
+     * weight functions such as `cached_weight` and the segrnn scorers
+     * keep caches and computation graphs that are not thread-safe.
+     *
+     * `weight_array_fst` is `f` with `weight` answered from such an
+     * array, so that the forward, backward and gradient passes of a
+     * loss do not call the weight function again.  The array has to
+     * outlive the fst.
+     *
+     */
+    template <class fst>
+    std::vector<double> make_weight_array(fst const& f);
+
+    template <class fst>
+    struct weight_array_fst
+        : public fst {
+
+        using edge = typename fst::edge;
+
+        std::vector<double> const& weights;
+
+        weight_array_fst(fst const& f, std::vector<double> const& weights);
+
+        double weight(edge e) const;
+
+    };
+
+}
+
+namespace fst {
+
+    template <class fst>
+    typename tropical_semiring<fst>::value
+    tropical_semiring<fst>::zero() const
+    {
+        return value { edge_trait<edge>::null, -std::numeric_limits<double>::infinity() };
+    }
+
+    template <class fst>
+    typename tropical_semiring<fst>::value
+    tropical_semiring<fst>::one() const
+    {
+        return value { edge_trait<edge>::null, 0 };
+    }
+
+    template <class fst>
+    typename tropical_semiring<fst>::value
+    tropical_semiring<fst>::plus(value const& a, value const& b) const
+    {
+        return b.value > a.value ? b : a;
+    }
+
+    template <class fst>
+    typename tropical_semiring<fst>::value
+    tropical_semiring<fst>::times(value const& a, fst const& f, edge const& e) const
+    {
+        return value { e, a.value + f.weight(e) };
+    }
+
+    template <class fst>
+    double tropical_semiring<fst>::score(value const& a) const
+    {
+        return a.value;
+    }
+
+    template <class fst>
+    double log_semiring<fst>::zero() const
+    {
+        return -std::numeric_limits<double>::infinity();
+    }
+
+    template <class fst>
+    double log_semiring<fst>::one() const
+    {
+        return 0;
+    }
+
+    template <class fst>
+    double log_semiring<fst>::plus(double a, double b) const
+    {
+        if (b == -std::numeric_limits<double>::infinity()) {
+            return a;
+        }
+
+        return ebt::log_add(a, b);
+    }
+
+    template <class fst>
+    double log_semiring<fst>::times(double a, fst const& f, edge const& e) const
+    {
+        return a + f.weight(e);
+    }
+
+    template <class fst>
+    double log_semiring<fst>::score(double a) const
+    {
+        return a;
+    }
+
+    template <class fst, class risk>
+    template <class risk_type>
+    expectation_semiring<fst, risk>::expectation_semiring(std::shared_ptr<risk_type> r)
+        : r(r)
+    {}
+
+    template <class fst, class risk>
+    typename expectation_semiring<fst, risk>::value
+    expectation_semiring<fst, risk>::zero() const
+    {
+        return value { -std::numeric_limits<double>::infinity(), 0 };
+    }
+
+    template <class fst, class risk>
+    typename expectation_semiring<fst, risk>::value
+    expectation_semiring<fst, risk>::one() const
+    {
+        return value { 0, 0 };
+    }
+
+    template <class fst, class risk>
+    typename expectation_semiring<fst, risk>::value
+    expectation_semiring<fst, risk>::plus(value const& a, value const& b) const
+    {
+        double inf = std::numeric_limits<double>::infinity();
+
+        if (b.log_sum == -inf) {
+            return a;
+        } else if (a.log_sum == -inf) {
+            return b;
+        }
+
+        double s = ebt::log_add(a.log_sum, b.log_sum);
+
+        return value { s, std::exp(a.log_sum - s) * a.exp + std::exp(b.log_sum - s) * b.exp };
+    }
+
+    template <class fst, class risk>
+    typename expectation_semiring<fst, risk>::value
+    expectation_semiring<fst, risk>::times(value const& a, fst const& f, edge const& e) const
+    {
+        return value { a.log_sum + f.weight(e), a.exp + (*r)(f, e) };
+    }
+
+    template <class fst, class risk>
+    double expectation_semiring<fst, risk>::score(value const& a) const
+    {
+        return a.log_sum;
+    }
+
+    template <class fst>
+    std::vector<typename fst::vertex> const&
+    forward_sweep<fst>::sources(fst const& f)
+    {
+        return f.initials();
+    }
+
+    template <class fst>
+    std::vector<typename fst::edge> const&
+    forward_sweep<fst>::edges(fst const& f, vertex const& v)
+    {
+        return f.in_edges(v);
+    }
+
+    template <class fst>
+    typename fst::vertex forward_sweep<fst>::from(fst const& f, edge const& e)
+    {
+        return f.tail(e);
+    }
+
+    template <class fst>
+    int forward_sweep<fst>::level(int i, int levels)
+    {
+        return i;
+    }
+
+    template <class fst>
+    bool forward_sweep<fst>::earlier(long t1, long t2)
+    {
+        return t1 < t2;
+    }
+
+    template <class fst>
+    std::vector<typename fst::vertex> const&
+    backward_sweep<fst>::sources(fst const& f)
+    {
+        return f.finals();
+    }
+
+    template <class fst>
+    std::vector<typename fst::edge> const&
+    backward_sweep<fst>::edges(fst const& f, vertex const& v)
+    {
+        return f.out_edges(v);
+    }
+
+    template <class fst>
+    typename fst::vertex backward_sweep<fst>::from(fst const& f, edge const& e)
+    {
+        return f.head(e);
+    }
+
+    template <class fst>
+    int backward_sweep<fst>::level(int i, int levels)
+    {
+        return levels - 1 - i;
+    }
+
+    template <class fst>
+    bool backward_sweep<fst>::earlier(long t1, long t2)
+    {
+        return t1 > t2;
+    }
+
+    template <class fst>
+    topo_levels<typename fst::vertex> make_topo_levels(fst const& f,
+        std::vector<typename fst::vertex> const& order)
+    {
+        state_map<typename fst::vertex, int> depth;
+        int max_depth = -1;
+
+        for (auto& v: order) {
+            int d = 0;
+
+            for (auto& e: f.in_edges(v)) {
+                auto u = f.tail(e);
+
+                if (depth.has(u)) {
+                    d = std::max(d, depth.at(u) + 1);
+                }
+            }
+
+            depth[v] = d;
+            max_depth = std::max(max_depth, d);
+        }
+
+        topo_levels<typename fst::vertex> result;
+
+        result.begin.resize(max_depth + 2, 0);
+
+        for (auto& v: order) {
+            ++result.begin[depth.at(v) + 1];
+        }
+
+        for (int i = 1; i < result.begin.size(); ++i) {
+            result.begin[i] += result.begin[i - 1];
+        }
+
+        std::vector<int> next { result.begin.begin(), result.begin.end() - 1 };
+
+        result.order.resize(order.size());
+
+        for (auto& v: order) {
+            result.order[next[depth.at(v)]++] = v;
+        }
+
+        return result;
+    }
+
+    template <class fst>
+    bool make_time_levels(fst const& f, topo_levels<typename fst::vertex>& levels,
+        bool check)
+    {
+        auto& vertices = f.vertices();
+
+        std::vector<long> times;
+        times.reserve(vertices.size());
+
+        long min_time = std::numeric_limits<long>::max();
+        long max_time = std::numeric_limits<long>::min();
+
+        for (auto& v: vertices) {
+            long t = f.time(v);
+            times.push_back(t);
+            min_time = std::min(min_time, t);
+            max_time = std::max(max_time, t);
+        }
+
+        if (check) {
+            for (int i = 0; i < vertices.size(); ++i) {
+                for (auto& e: f.out_edges(vertices[i])) {
+                    if (f.time(f.head(e)) <= times[i]) {
+                        return false;
+                    }
+                }
+            }
+        }
+
+        levels.order.clear();
+        levels.begin.clear();
+
+        if (vertices.size() == 0) {
+            levels.begin.push_back(0);
+            return true;
+        }
+
+        std::vector<int> count;
+        count.resize(max_time - min_time + 2, 0);
+
+        for (auto& t: times) {
+            ++count[t - min_time + 1];
+        }
+
+        for (int i = 1; i < count.size(); ++i) {
+            count[i] += count[i - 1];
+        }
+
+        std::vector<int> next { count.begin(), count.end() - 1 };
+
+        levels.order.resize(vertices.size());
+
+        for (int i = 0; i < vertices.size(); ++i) {
+            levels.order[next[times[i] - min_time]++] = vertices[i];
+        }
+
+        for (int i = 0; i + 1 < count.size(); ++i) {
+            if (count[i + 1] > count[i]) {
+                levels.begin.push_back(count[i]);
+            }
+        }
+
+        levels.begin.push_back(vertices.size());
+
+        return true;
+    }
+
+    template <class fst, class semiring, class direction>
+    shortest_distance<fst, semiring, direction>::shortest_distance(semiring ring)
+        : ring(ring)
+    {}
+
+    template <class fst, class semiring, class direction>
+    typename shortest_distance<fst, semiring, direction>::value
+    shortest_distance<fst, semiring, direction>::relax(fst const& f,
+        vertex const& u) const
+    {
+        value s = extra.has(u) ? extra.at(u) : ring.zero();
+
+        for (auto& e: direction::edges(f, u)) {
+            vertex v = direction::from(f, e);
+
+            if (extra.has(v)) {
+                s = ring.plus(s, ring.times(extra.at(v), f, e));
+            }
+        }
+
+        return s;
+    }
+
+    template <class fst, class semiring, class direction>
+    void shortest_distance<fst, semiring, direction>::merge(fst const& f,
+        std::vector<vertex> const& order)
+    {
+        for (auto& v: direction::sources(f)) {
+            if (!extra.has(v)) {
+                extra[v] = ring.one();
+            }
+        }
+
+        for (auto& u: order) {
+            value s = relax(f, u);
+            extra[u] = s;
+        }
+    }
+
+    template <class fst, class semiring, class direction>
+    void shortest_distance<fst, semiring, direction>::merge(fst const& f,
+        topo_levels<vertex> const& levels)
+    {
+        for (auto& v: direction::sources(f)) {
+            if (!extra.has(v)) {
+                extra[v] = ring.one();
+            }
+        }
+
+        // Every vertex is in `extra` before the parallel region, so
+        // the threads only write to existing entries.
+
+        for (auto& u: levels.order) {
+            if (!extra.has(u)) {
+                extra[u] = ring.zero();
+            }
+        }
+
+        int level_count = int(levels.begin.size()) - 1;
+
+        #pragma omp parallel
+        for (int i = 0; i < level_count; ++i) {
+            int ell = direction::level(i, level_count);
+
+            #pragma omp for schedule(dynamic, 16)
+            for (int j = levels.begin[ell]; j < levels.begin[ell + 1]; ++j) {
+                extra.at(levels.order[j]) = relax(f, levels.order[j]);
+            }
+        }
+    }
+
+    template <class fst, class semiring, class direction>
+    void shortest_distance<fst, semiring, direction>::beam_merge(fst const& f,
+        std::vector<vertex> const& order, double beam, int max_active)
+    {
+        for (auto& v: direction::sources(f)) {
+            if (!extra.has(v)) {
+                extra[v] = ring.one();
+            }
+        }
+
+        // A stable sort keeps the vertices of the same time in
+        // topological order.
+
+        std::vector<vertex> sorted = order;
+        std::stable_sort(sorted.begin(), sorted.end(),
+            [&](vertex const& a, vertex const& b) {
+                return direction::earlier(f.time(a), f.time(b));
+            });
+
+        // The last time, in the direction of the sweep, that the
+        // edges of a vertex reach.  Only the graph is looked at here,
+        // not the weights.
+
+        state_map<vertex, long> reach;
+
+        for (auto& u: sorted) {
+            for (auto& e: direction::edges(f, u)) {
+                vertex v = direction::from(f, e);
+
+                if (!reach.has(v) || direction::earlier(reach.at(v), f.time(u))) {
+                    reach[v] = f.time(u);
+                }
+            }
+        }
+
+        double inf = std::numeric_limits<double>::infinity();
+
+        state_map<vertex, char> live;
+        std::vector<std::pair<double, vertex>> frontier;
+        std::vector<std::pair<double, vertex>> next;
+
+        int i = 0;
+        while (i < sorted.size()) {
+            long t = f.time(sorted[i]);
+            double best = -inf;
+
+            int j = i;
+            for (; j < sorted.size() && f.time(sorted[j]) == t; ++j) {
+                vertex const& u = sorted[j];
+
+                value s = extra.has(u) ? extra.at(u) : ring.zero();
+
+                for (auto& e: direction::edges(f, u)) {
+                    vertex v = direction::from(f, e);
+
+                    if (live.has(v)) {
+                        s = ring.plus(s, ring.times(extra.at(v), f, e));
+                    }
+                }
+
+                double score = ring.score(s);
+
+                if (score == -inf) {
+                    extra.erase(u);
+                    continue;
+                }
+
+                extra[u] = s;
+                best = std::max(best, score);
+
+                if (reach.has(u)) {
+                    live[u] = 1;
+                    frontier.push_back(std::make_pair(score, u));
+                }
+            }
+
+            i = j;
+
+            if (best == -inf) {
+                continue;
+            }
+
+            // Drop the vertices whose edges all end by now, and those
+            // that fall out of the beam of the best vertex at `t`.
+            // Their values stay in `extra`, so best paths can still be
+            // traced back through them.
+
+            next.clear();
+
+            for (auto& p: frontier) {
+                if (direction::earlier(t, reach.at(p.second))
+                        && p.first >= best - beam) {
+                    next.push_back(p);
+                } else {
+                    live.erase(p.second);
+                }
+            }
+
+            if (max_active > 0 && next.size() > max_active) {
+                std::nth_element(next.begin(), next.begin() + max_active, next.end(),
+                    [](std::pair<double, vertex> const& a, std::pair<double, vertex> const& b) {
+                        return a.first > b.first;
+                    });
+
+                for (int k = max_active; k < next.size(); ++k) {
+                    live.erase(next[k].second);
+                }
+
+                next.resize(max_active);
+            }
+
+            frontier.swap(next);
+        }
+    }
+
+    template <class fst, class semiring, class direction>
+    void shortest_distance<fst, semiring, direction>::posterior_merge(fst const& f,
+        std::vector<vertex> const& order, state_map<vertex, value> const& other,
+        double threshold)
+    {
+        value total = ring.zero();
+
+        for (auto& v: direction::sources(f)) {
+            if (!extra.has(v)) {
+                extra[v] = ring.one();
+            }
+
+            if (other.has(v)) {
+                total = ring.plus(total, other.at(v));
+            }
+        }
+
+        double cutoff = ring.score(total) + std::log(threshold);
+
+        for (auto& u: order) {
+            if (!other.has(u)) {
+                extra.erase(u);
+                continue;
+            }
+
+            value s = relax(f, u);
+
+            if (ring.score(other.at(u)) + ring.score(s) < cutoff) {
+                extra.erase(u);
+            } else {
+                extra[u] = s;
+            }
+        }
+    }
+
+    template <class fst>
+    std::vector<double> make_weight_array(fst const& f)
+    {
+        static_assert(std::is_integral<typename fst::edge>::value,
+            "weight arrays are indexed by edge id");
+
+        auto const& edges = f.edges();
+
+        typename fst::edge max = -1;
+        for (auto& e: edges) {
+            max = std::max(max, e);
+        }
+
+        std::vector<double> result;
+        result.resize(max + 1);
+
+        for (auto& e: edges) {
+            result[e] = f.weight(e);
+        }
+
+        return result;
+    }
+
+    template <class fst>
+    weight_array_fst<fst>::weight_array_fst(fst const& f,
+            std::vector<double> const& weights)
+        : fst(f), weights(weights)
+    {}
+
+    template <class fst>
+    double weight_array_fst<fst>::weight(edge e) const
+    {
+        return weights[e];
+    }
+
+}
+
+#endif
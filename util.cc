@@ -1,5 +1,8 @@
 #include "seg/util.h"
 #include <fstream>
+#include <iostream>
+#include <algorithm>
+#include <cassert>
 #include "ebt/ebt.h"
 
 namespace util {
@@ -49,4 +52,210 @@ namespace util {
         return result;
     }
 
+
+    std::vector<int> select_boundaries(std::vector<double> const& score, int frames,
+        double threshold, int min_seg, int max_seg)
+    {
+        assert(score.size() >= frames);
+        assert(1 <= min_seg && min_seg <= max_seg);
+
+        std::vector<int> picks;
+
+        for (int t = 1; t < frames; ++t) {
+            bool peak = score[t] > score[t - 1]
+                && (t + 1 == score.size() || score[t] >= score[t + 1]);
+
+            if (peak || score[t] >= threshold) {
+                picks.push_back(t);
+            }
+        }
+
+        picks.push_back(frames);
+
+        // reachable[t] tells whether segments between min_seg and
+        // max_seg frames long can tile [t, frames], and count[t] is
+        // the number of such t' >= t.
+        std::vector<bool> reachable(frames + 1);
+        std::vector<int> count(frames + 2, 0);
+
+        for (int t = frames; t >= 0; --t) {
+            int lo = std::min(t + min_seg, frames + 1);
+            int hi = std::min(t + max_seg, frames) + 1;
+
+            reachable[t] = (t == frames || (lo < hi && count[lo] - count[hi] > 0));
+            count[t] = count[t + 1] + reachable[t];
+        }
+
+        assert(reachable[0]);
+
+        // Ties go to the later frame, which reaches further.
+        auto best_reachable = [&](int start, int end) {
+            int best = -1;
+
+            for (int t = start; t <= end; ++t) {
+                if (reachable[t] && (best == -1 || score[t] >= score[best])) {
+                    best = t;
+                }
+            }
+
+            return best;
+        };
+
+        std::vector<int> result { 0 };
+
+        for (auto& b: picks) {
+            if (b - result.back() < min_seg || !reachable[b]) {
+                continue;
+            }
+
+            while (b - result.back() > max_seg) {
+                int start = result.back() + min_seg;
+                int end = result.back() + max_seg;
+
+                // Frames that leave at least min_seg frames before b
+                // come first, so b can still be kept.
+                int best = best_reachable(start, std::min(end, b - min_seg));
+
+                if (best == -1) {
+                    best = best_reachable(start, end);
+                }
+
+                assert(best != -1);
+
+                result.push_back(best);
+            }
+
+            if (b - result.back() >= min_seg) {
+                result.push_back(b);
+            }
+        }
+
+        return result;
+    }
+
+    namespace {
+
+        // Sorted and joined by commas, or "-" if empty, so that the
+        // key stays one word in the text file.
+        std::string join_ids(std::vector<int> ids)
+        {
+            if (ids.size() == 0) {
+                return "-";
+            }
+
+            std::sort(ids.begin(), ids.end());
+
+            std::string result = std::to_string(ids.front());
+
+            for (int i = 1; i < ids.size(); ++i) {
+                result += "," + std::to_string(ids[i]);
+            }
+
+            return result;
+        }
+
+    }
+
+    std::string oracle_cache::label_key(std::vector<int> labels)
+    {
+        return join_ids(labels);
+    }
+
+    std::string oracle_cache::cost_key(std::string const& cost, std::vector<int> sils)
+    {
+        return cost + ":" + join_ids(sils);
+    }
+
+    void oracle_cache::load(std::istream& is)
+    {
+        std::string line;
+
+        std::lock_guard<std::mutex> lock { mutex };
+
+        while (std::getline(is, line)) {
+            auto parts = ebt::split(line);
+
+            if (parts.size() < 7) {
+                std::cerr << "malformed oracle path: " << line << std::endl;
+                exit(1);
+            }
+
+            key k { parts[0], std::stoi(parts[1]), std::stoi(parts[2]),
+                std::stoi(parts[3]), std::stoi(parts[4]), parts[5], parts[6] };
+
+            std::vector<int> path;
+
+            for (int i = 7; i < parts.size(); ++i) {
+                path.push_back(std::stoi(parts[i]));
+            }
+
+            paths[k] = path;
+        }
+    }
+
+    void oracle_cache::save(std::ostream& os)
+    {
+        std::lock_guard<std::mutex> lock { mutex };
+
+        for (auto& p: paths) {
+            os << std::get<0>(p.first) << " " << std::get<1>(p.first)
+                << " " << std::get<2>(p.first) << " " << std::get<3>(p.first)
+                << " " << std::get<4>(p.first) << " " << std::get<5>(p.first)
+                << " " << std::get<6>(p.first);
+
+            for (auto& e: p.second) {
+                os << " " << e;
+            }
+
+            os << std::endl;
+        }
+    }
+
+    size_t graph_bytes(size_t vertices, size_t edges, int labels,
+        size_t vertex_bytes, size_t edge_bytes)
+    {
+        // An edge is in an in and an out list and an in and an out
+        // map.  A vertex has the two lists and two maps, with a node
+        // per label in each map.
+        return edges * (edge_bytes + 4 * sizeof(int))
+            + vertices * (vertex_bytes + labels * 64 + 256);
+    }
+
+    std::vector<std::shared_ptr<tensor_tree::vertex>> minibatch_grad(int batch_size,
+        std::function<std::vector<std::shared_ptr<tensor_tree::vertex>>(int)> const& sample_grad)
+    {
+        assert(batch_size >= 1);
+
+        std::vector<std::vector<std::shared_ptr<tensor_tree::vertex>>> grads;
+        grads.resize(batch_size);
+
+        #pragma omp parallel for schedule(dynamic, 1)
+        for (int i = 0; i < batch_size; ++i) {
+            grads[i] = sample_grad(i);
+        }
+
+        for (int stride = 1; stride < batch_size; stride *= 2) {
+            #pragma omp parallel for
+            for (int i = 0; i < batch_size - stride; i += 2 * stride) {
+                auto& g = grads[i];
+                auto& h = grads[i + stride];
+
+                if (h.size() == 0) {
+                    continue;
+                } else if (g.size() == 0) {
+                    g = h;
+                    continue;
+                }
+
+                assert(g.size() == h.size());
+
+                for (int k = 0; k < g.size(); ++k) {
+                    tensor_tree::axpy(g[k], 1, h[k]);
+                }
+            }
+        }
+
+        return grads[0];
+    }
+
 }
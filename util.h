@@ -3,7 +3,20 @@
 
 #include <unordered_map>
 #include <vector>
+#include <list>
+#include <mutex>
+#include <memory>
+#include <tuple>
+#include <string>
+#include <algorithm>
+#include <cassert>
+#include <functional>
 #include "seg/segcost.h"
+#include "ebt/ebt.h"
+#include "nn/tensor-tree.h"
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 #include <fstream>
 
 namespace util {
@@ -13,6 +26,326 @@ namespace util {
 
     std::vector<segcost::segment<std::string>> load_segments(std::istream& is);
 
+    /*
+     * `select_boundaries` picks the frames where segments may start or
+     * end from a score per frame: local peaks and frames scoring at
+     * least `threshold`, plus 0 and `frames`.  Picks closer than
+     * `min_seg` to the previous boundary, or from which `frames` can
+     * no longer be reached, are dropped.  When two picks are more than
+     * `max_seg` frames apart, the best frame within reach of the
+     * earlier one is added, preferring those that keep the later pick
+     * at least `min_seg` away.  Consecutive boundaries are thus always
+     * between `min_seg` and `max_seg` frames apart.  `frames` has to
+     * be reachable from 0 with such segments.
+     *
+     */
+    std::vector<int> select_boundaries(std::vector<double> const& score, int frames,
+        double threshold, int min_seg, int max_seg);
+
+    /*
+     * `graph_cache` keeps segment graphs and their topological orders
+     * for reuse, because the structure of a graph only depends on the
+     * number of frames, the label table it is built from, the segment
+     * lengths and the stride.  The labels are keyed by `id_label`,
+     * which determines `label_id` as well.  The graphs are shared by
+     * `shared_ptr` and must not be modified.
+     *
+     * Entries are evicted least recently used first once their total
+     * size, as estimated by whoever builds them, goes over `budget`
+     * bytes.  A missing graph is built outside the lock, so two
+     * threads may build the same one; the first one stored is kept.
+     *
+     */
+    /*
+     * `graph_bytes` is the size estimate of the entries of a
+     * `graph_cache`.  It counts `vertex_bytes` and `edge_bytes` for
+     * what the graph stores per vertex and edge, plus the adjacency
+     * lists and label maps of every vertex as if all were filled.
+     *
+     */
+    size_t graph_bytes(size_t vertices, size_t edges, int labels,
+        size_t vertex_bytes, size_t edge_bytes);
+
+    template <class fst>
+    struct graph_cache {
+
+        // frames, id_label, min_seg_len, max_seg_len, stride
+        using key = std::tuple<int, std::vector<std::string>, int, int, int>;
+
+        struct entry {
+            std::shared_ptr<fst> graph;
+            std::shared_ptr<std::vector<typename fst::vertex>> topo_order;
+            size_t bytes;
+        };
+
+        std::mutex mutex;
+
+        size_t budget;
+        size_t bytes;
+
+        std::list<key> recent;
+        std::unordered_map<key, std::pair<entry, typename std::list<key>::iterator>> entries;
+
+        graph_cache(size_t budget);
+
+        template <class make_func>
+        entry get(key const& k, make_func make);
+
+    };
+
+    template <class fst>
+    graph_cache<fst>::graph_cache(size_t budget)
+        : budget(budget), bytes(0)
+    {}
+
+    template <class fst>
+    template <class make_func>
+    typename graph_cache<fst>::entry graph_cache<fst>::get(key const& k, make_func make)
+    {
+        {
+            std::lock_guard<std::mutex> lock { mutex };
+
+            auto i = entries.find(k);
+
+            if (i != entries.end()) {
+                recent.splice(recent.begin(), recent, i->second.second);
+                return i->second.first;
+            }
+        }
+
+        entry e = make();
+
+        std::lock_guard<std::mutex> lock { mutex };
+
+        auto i = entries.find(k);
+
+        if (i != entries.end()) {
+            recent.splice(recent.begin(), recent, i->second.second);
+            return i->second.first;
+        }
+
+        recent.push_front(k);
+        entries[k] = std::make_pair(e, recent.begin());
+        bytes += e.bytes;
+
+        while (bytes > budget && recent.size() > 1) {
+            auto& old = entries.at(recent.back());
+            bytes -= old.first.bytes;
+            entries.erase(recent.back());
+            recent.pop_back();
+        }
+
+        return e;
+    }
+
+
+    /*
+     * `oracle_cache` remembers the min-cost path of each utterance,
+     * which only depends on the graph and the ground truth and is
+     * otherwise searched again every epoch.  Paths are stored as edge
+     * ids, so the key has to pin down the graph and the cost
+     * completely.  The caller fills in the utterance, the shape of the
+     * graph and its labels with `label_key`; the losses fill in the
+     * cost with `cost_key`, so a path found under one cost function
+     * or set of silences is not reused under another.
+     *
+     * Graphs that depend on anything else must not use the cache:
+     * graphs built with randomness, such as edge dropping, and graphs
+     * pruned by the scores of a model, such as those of `prune_labels`
+     * and `make_boundary_graph`, which change as the model trains.
+     *
+     * The cache can be saved to and loaded from a text file, one path
+     * per line, to carry it across runs.
+     *
+     */
+    struct oracle_cache {
+
+        // utterance id, frames, min_seg_len, max_seg_len, stride,
+        // labels, cost
+        using key = std::tuple<std::string, int, int, int, int,
+            std::string, std::string>;
+
+        static std::string label_key(std::vector<int> labels);
+        static std::string cost_key(std::string const& cost, std::vector<int> sils);
+
+        std::mutex mutex;
+
+        std::unordered_map<key, std::vector<int>> paths;
+
+        template <class compute_func>
+        std::vector<int> get(key const& k, compute_func compute);
+
+        void load(std::istream& is);
+        void save(std::ostream& os);
+
+    };
+
+    template <class compute_func>
+    std::vector<int> oracle_cache::get(key const& k, compute_func compute)
+    {
+        {
+            std::lock_guard<std::mutex> lock { mutex };
+
+            auto i = paths.find(k);
+
+            if (i != paths.end()) {
+                return i->second;
+            }
+        }
+
+        std::vector<int> path = compute();
+
+        std::lock_guard<std::mutex> lock { mutex };
+
+        paths[k] = path;
+
+        return path;
+    }
+
+
+    /*
+     * `sparse_grad` collects the cells of a gradient matrix written by
+     * `accumulate_grad`.  When only a few paths are backpropagated, as
+     * with the hinge losses, the cells touched are far fewer than the
+     * matrix, and the dense gradient is only needed once `grad` hands
+     * it to autodiff.
+     *
+     * Each OpenMP thread writes to its own buffer, picked by thread
+     * number, so `add` takes no lock.  Writers have to be threads of
+     * one team, or a single thread.  Once a buffer holds more than
+     * `dense_fraction` of the cells of the matrix, as with the losses
+     * that spread over all edges, it switches to a dense block of the
+     * size of the matrix.  `empty` and `flush` are not to be called
+     * while cells are being added.
+     *
+     */
+    struct sparse_grad {
+
+        struct cell {
+            int row;
+            int col;
+            double value;
+        };
+
+        struct buffer {
+            std::vector<cell> cells;
+            std::vector<double> dense;
+
+            // keeps the vectors of neighboring threads off one cache line
+            char pad[64];
+        };
+
+        std::vector<buffer> buffers;
+        double dense_fraction;
+
+        sparse_grad(double dense_fraction=0.125);
+
+        template <class tensor>
+        void add(tensor const& m, int row, int col, double g);
+
+        bool empty() const;
+
+        template <class tensor>
+        void flush(tensor& m);
+
+    };
+
+    inline sparse_grad::sparse_grad(double dense_fraction)
+#ifdef _OPENMP
+        : buffers(std::max(omp_get_max_threads(), omp_get_num_threads()))
+#else
+        : buffers(1)
+#endif
+        , dense_fraction(dense_fraction)
+    {}
+
+    template <class tensor>
+    void sparse_grad::add(tensor const& m, int row, int col, double g)
+    {
+#ifdef _OPENMP
+        int t = omp_get_thread_num();
+#else
+        int t = 0;
+#endif
+
+        assert(t < buffers.size());
+
+        auto& b = buffers[t];
+        int cols = m.size(1);
+
+        if (b.dense.size() != 0) {
+            b.dense[row * cols + col] += g;
+            return;
+        }
+
+        b.cells.push_back(cell { row, col, g });
+
+        if (b.cells.size() > dense_fraction * m.vec_size()) {
+            b.dense.resize(m.vec_size());
+
+            for (auto& c: b.cells) {
+                b.dense[c.row * cols + c.col] += c.value;
+            }
+
+            b.cells.clear();
+        }
+    }
+
+    inline bool sparse_grad::empty() const
+    {
+        for (auto& b: buffers) {
+            if (b.cells.size() != 0 || b.dense.size() != 0) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    template <class tensor>
+    void sparse_grad::flush(tensor& m)
+    {
+        for (auto& b: buffers) {
+            if (b.dense.size() != 0) {
+                assert(b.dense.size() == m.vec_size());
+
+                double *d = m.data();
+
+                for (int i = 0; i < b.dense.size(); ++i) {
+                    d[i] += b.dense[i];
+                }
+
+                b.dense.clear();
+            }
+
+            for (auto& c: b.cells) {
+                m({c.row, c.col}) += c.value;
+            }
+
+            b.cells.clear();
+        }
+    }
+
+    /*
+     * `minibatch_grad` calls `sample_grad(i)` for i from 0 to
+     * `batch_size - 1` on the OpenMP threads, and returns the sum of
+     * the gradient trees that the calls return.  A call can return
+     * more than one tree, e.g., one for the segmental model and one
+     * for the LSTM, and the trees are summed position by position.
+     *
+     * Each call should build its own computation graph and variable
+     * tree and hand back fresh gradient trees, so that the only thing
+     * the workers share is the parameters, which they only read.
+     * Random engines for dropout should not be shared either.  A call
+     * may return an empty vector to skip a sample.
+     *
+     * The sums are formed pairwise in log2(batch_size) rounds, each of
+     * which runs in parallel.  The optimizer step is left to the caller.
+     *
+     */
+    std::vector<std::shared_ptr<tensor_tree::vertex>> minibatch_grad(int batch_size,
+        std::function<std::vector<std::shared_ptr<tensor_tree::vertex>>(int)> const& sample_grad);
+
 }
 
 #endif